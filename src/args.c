@@ -11,6 +11,15 @@
 #include "args.h"
 
 
+// Windows declares the environment as _environ in stdlib.h. POSIX requires
+// applications to declare it themselves.
+#ifdef _WIN32
+    #define environ _environ
+#else
+    extern char** environ;
+#endif
+
+
 /* ------------------ */
 /* Utility functions. */
 /* ------------------ */
@@ -30,27 +39,35 @@ static void exit_with_error(const char* format_string, ...) {
 }
 
 
-// Prints to an automatically-allocated string. Returns NULL if an encoding
-// error occurs or if sufficient memory cannot be allocated.
-static char* str(const char* format_string, ...) {
-    va_list args;
+// Prints to an automatically-allocated string using a va_list. Returns NULL if
+// an encoding error occurs or if sufficient memory cannot be allocated.
+static char* vstr(const char* format_string, va_list args) {
+    va_list args_copy;
 
-    va_start(args, format_string);
-    int len = vsnprintf(NULL, 0, format_string, args);
+    va_copy(args_copy, args);
+    int len = vsnprintf(NULL, 0, format_string, args_copy);
+    va_end(args_copy);
     if (len < 0) {
         return NULL;
     }
-    va_end(args);
 
     char *string = malloc(len + 1);
     if (string == NULL) {
         return NULL;
     }
 
-    va_start(args, format_string);
     vsnprintf(string, len + 1, format_string, args);
-    va_end(args);
+    return string;
+}
 
+
+// Prints to an automatically-allocated string. Returns NULL if an encoding
+// error occurs or if sufficient memory cannot be allocated.
+static char* str(const char* format_string, ...) {
+    va_list args;
+    va_start(args, format_string);
+    char* string = vstr(format_string, args);
+    va_end(args);
     return string;
 }
 
@@ -64,10 +81,28 @@ static char* str_dup(const char* string) {
 }
 
 
-// Hashes a string using the FNV-1a algorithm.
-static uint32_t str_hash(const char* string) {
-    uint32_t hash = 2166136261u;
-    size_t length = strlen(string);
+// Duplicates the first [length] bytes of a string, adding a NUL terminator.
+// Returns NULL if memory cannot be allocated for the copy.
+static char* str_dup_n(const char* string, size_t length) {
+    char *copy = malloc(length + 1);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+
+// The FNV-1a offset basis, i.e. the hash of the empty string.
+#define FNV_OFFSET_BASIS 2166136261u
+
+
+// Continues an FNV-1a hash over the first [length] bytes of a string. FNV-1a
+// consumes its input a byte at a time, so the hash of a key can be resumed from
+// the hash of any prefix of the key.
+static uint32_t str_hash_extend(uint32_t hash, const char* string,
+    size_t length) {
     for (size_t i = 0; i < length; i++) {
         hash ^= (uint8_t)string[i];
         hash *= 16777619;
@@ -76,33 +111,65 @@ static uint32_t str_hash(const char* string) {
 }
 
 
-// Attempts to parse a string as an integer value, exiting on failure.
-static int try_str_to_int(const char* string) {
+// Hashes the first [length] bytes of a string using the FNV-1a algorithm.
+static uint32_t str_hash_n(const char* string, size_t length) {
+    return str_hash_extend(FNV_OFFSET_BASIS, string, length);
+}
+
+
+// Attempts to parse a string as an integer value. On failure, returns a format
+// string for an error message, otherwise NULL.
+static const char* str_to_int(const char* string, int* value) {
     char *endptr;
     errno = 0;
     long result = strtol(string, &endptr, 0);
     if (errno == ERANGE || result > INT_MAX || result < INT_MIN) {
-        exit_with_error("'%s' is out of range", string);
+        return "'%s' is out of range";
     }
     if (*endptr != '\0') {
-        exit_with_error("cannot parse '%s' as an integer", string);
+        return "cannot parse '%s' as an integer";
     }
-    return (int) result;
+    *value = (int) result;
+    return NULL;
 }
 
 
-// Attempts to parse a string as a double value, exiting on failure.
-static double try_str_to_double(const char* string) {
+// Attempts to parse a string as a double value. On failure, returns a format
+// string for an error message, otherwise NULL.
+static const char* str_to_double(const char* string, double* value) {
     char *endptr;
     errno = 0;
     double result = strtod(string, &endptr);
     if (errno == ERANGE) {
-        exit_with_error("'%s' is out of range", string);
+        return "'%s' is out of range";
     }
     if (*endptr != '\0') {
-        exit_with_error("cannot parse '%s' as a floating-point value", string);
+        return "cannot parse '%s' as a floating-point value";
     }
-    return result;
+    *value = result;
+    return NULL;
+}
+
+
+// Attempts to parse a string as an integer value, exiting on failure.
+static int try_str_to_int(const char* string) {
+    int value = 0;
+    const char* error = str_to_int(string, &value);
+    if (error) {
+        exit_with_error(error, string);
+    }
+    return value;
+}
+
+
+// Attempts to parse a string as a double value, exiting on failure.
+static double try_str_to_double(const char* string) {
+    double value = 0.0;
+    const char* error = str_to_double(string, &value);
+    if (error) {
+        exit_with_error(error, string);
+    }
+    return value;
 }
 
 
@@ -138,6 +205,21 @@ static void vec_free(Vec* vec) {
 }
 
 
+// Ensures the vector has capacity for at least [capacity] entries.
+static bool vec_reserve(Vec* vec, int capacity) {
+    if (capacity <= vec->capacity) {
+        return true;
+    }
+    void** new_array = realloc(vec->entries, sizeof(void*) * capacity);
+    if (!new_array) {
+        return false;
+    }
+    vec->entries = new_array;
+    vec->capacity = capacity;
+    return true;
+}
+
+
 static bool vec_add(Vec* vec, void* entry) {
     if (vec->count + 1 > vec->capacity) {
         int new_capacity = vec->capacity < 8 ? 8 : vec->capacity * 2;
@@ -168,13 +250,17 @@ typedef struct {
     char* key;
     void* value;
     uint32_t key_hash;
+    size_t key_len;
 } MapEntry;
 
 
+// If [owns_keys] is false, the map's key strings are owned elsewhere and aren't
+// freed by map_free().
 typedef struct {
     int count;
     int capacity;
     int max_load_threshold;
+    bool owns_keys;
     MapEntry* entries;
 } Map;
 
@@ -187,6 +273,7 @@ static Map* map_new(void) {
     map->count = 0;
     map->capacity = 0;
     map->max_load_threshold = 0;
+    map->owns_keys = true;
     map->entries = NULL;
     return map;
 }
@@ -196,7 +283,7 @@ static void map_free(Map* map) {
     if (map) {
         for (int i = 0; i < map->capacity; i++) {
             MapEntry* entry = &map->entries[i];
-            if (entry->key != NULL) {
+            if (entry->key != NULL && map->owns_keys) {
                 free(entry->key);
             }
         }
@@ -206,7 +293,9 @@ static void map_free(Map* map) {
 }
 
 
-static MapEntry* map_find(Map* map, const char* key, uint32_t key_hash) {
+// Finds the entry for the [key_len]-byte key, which needn't be NUL-terminated.
+static MapEntry* map_find(Map* map, const char* key, size_t key_len,
+    uint32_t key_hash) {
     // Capacity is always a power of 2 so we can use bitwise-AND as a fast
     // modulo operator, i.e. this is equivalent to: index = key_hash % capacity.
     size_t index = key_hash & (map->capacity - 1);
@@ -215,7 +304,8 @@ static MapEntry* map_find(Map* map, const char* key, uint32_t key_hash) {
         MapEntry* entry = &map->entries[index];
         if (entry->key == NULL) {
             return entry;
-        } else if (key_hash == entry->key_hash && strcmp(key, entry->key) == 0) {
+        } else if (key_hash == entry->key_hash && key_len == entry->key_len &&
+            memcmp(key, entry->key, key_len) == 0) {
             return entry;
         }
         index = (index + 1) & (map->capacity - 1);
@@ -223,10 +313,33 @@ static MapEntry* map_find(Map* map, const char* key, uint32_t key_hash) {
 }
 
 
-static bool map_grow(Map* map) {
+// Finds the entry for the key '[prefix].[name]' without assembling it.
+// [key_hash] is the hash of the whole key.
+static MapEntry* map_find_dotted(Map* map, const char* prefix,
+    size_t prefix_len, const char* name, size_t name_len, uint32_t key_hash) {
+    size_t key_len = prefix_len + 1 + name_len;
+    size_t index = key_hash & (map->capacity - 1);
+
+    for (;;) {
+        MapEntry* entry = &map->entries[index];
+        if (entry->key == NULL) {
+            return entry;
+        } else if (key_hash == entry->key_hash && key_len == entry->key_len &&
+            memcmp(entry->key, prefix, prefix_len) == 0 &&
+            entry->key[prefix_len] == '.' &&
+            memcmp(entry->key + prefix_len + 1, name, name_len) == 0) {
+            return entry;
+        }
+        index = (index + 1) & (map->capacity - 1);
+    }
+}
+
+
+// Rehashes the map's entries into a new array of size [new_capacity], which
+// must be a power of 2.
+static bool map_resize(Map* map, int new_capacity) {
     MapEntry* old_entries = map->entries;
     int old_capacity = map->capacity;
-    int new_capacity = old_capacity < 8 ? 8 : old_capacity * 2;
 
     MapEntry* new_entries = malloc(sizeof(MapEntry) * new_capacity);
     if (!new_entries) {
@@ -246,10 +359,8 @@ static bool map_grow(Map* map) {
         MapEntry* src = &old_entries[i];
         if (src->key == NULL) continue;
 
-        MapEntry* dst = map_find(map, src->key, src->key_hash);
-        dst->key = src->key;
-        dst->value = src->value;
-        dst->key_hash = src->key_hash;
+        MapEntry* dst = map_find(map, src->key, src->key_len, src->key_hash);
+        *dst = *src;
         map->count++;
     }
 
@@ -258,12 +369,31 @@ static bool map_grow(Map* map) {
 }
 
 
+static bool map_grow(Map* map) {
+    return map_resize(map, map->capacity < 8 ? 8 : map->capacity * 2);
+}
+
+
+// Ensures the map can hold at least [count] entries without growing.
+static bool map_reserve(Map* map, int count) {
+    int new_capacity = map->capacity < 8 ? 8 : map->capacity;
+    while (count >= new_capacity * MAP_MAX_LOAD) {
+        new_capacity *= 2;
+    }
+    if (new_capacity == map->capacity) {
+        return true;
+    }
+    return map_resize(map, new_capacity);
+}
+
+
 // Returns true if the key was found.
-static bool map_get(Map* map, const char* key, void** value) {
+// Looks up the [key_len]-byte key, which needn't be NUL-terminated.
+static bool map_get_n(Map* map, const char* key, size_t key_len, void** value) {
     if (map->count == 0) return false;
 
-    uint32_t key_hash = str_hash(key);
-    MapEntry* entry = map_find(map, key, key_hash);
+    uint32_t key_hash = str_hash_n(key, key_len);
+    MapEntry* entry = map_find(map, key, key_len, key_hash);
     if (entry->key == NULL) return false;
 
     *value = entry->value;
@@ -271,19 +401,25 @@ static bool map_get(Map* map, const char* key, void** value) {
 }
 
 
-// Adds a new entry to the map or updates the value of an existing entry.
-// (Note that the map stores its own internal copy of the key string.)
-static bool map_set(Map* map, const char* key, void* value) {
+static bool map_get(Map* map, const char* key, void** value) {
+    return map_get_n(map, key, strlen(key), value);
+}
+
+
+// Adds a new entry to the map or updates the value of an existing entry. If the
+// map owns its keys it stores its own NUL-terminated copy of the [key_len]-byte
+// key, otherwise it stores [key] itself.
+static bool map_set_n(Map* map, const char* key, size_t key_len, void* value) {
     if (map->count == map->max_load_threshold) {
         if (!map_grow(map)) {
             return false;
         }
     }
 
-    uint32_t key_hash = str_hash(key);
-    MapEntry* entry = map_find(map, key, key_hash);
+    uint32_t key_hash = str_hash_n(key, key_len);
+    MapEntry* entry = map_find(map, key, key_len, key_hash);
     if (entry->key == NULL) {
-        char* key_copy = str_dup(key);
+        char* key_copy = map->owns_keys ? str_dup_n(key, key_len) : (char*)key;
         if (!key_copy) {
             return false;
         }
@@ -291,6 +427,7 @@ static bool map_set(Map* map, const char* key, void* value) {
         entry->key = key_copy;
         entry->value = value;
         entry->key_hash = key_hash;
+        entry->key_len = key_len;
     } else {
         entry->value = value;
     }
@@ -299,1071 +436,5708 @@ static bool map_set(Map* map, const char* key, void* value) {
 }
 
 
-// Convenience wrapper for map_set(). This splits the key string into space-
-// separated words and adds a separate entry to the map for each word.
-static bool map_set_splitkey(Map* map, const char* key_string, void* value) {
-    char *copy_of_key_string = str_dup(key_string);
-    if (!copy_of_key_string) {
-        return false;
-    }
-
-    char* word_start = copy_of_key_string;
-    char* string_end = word_start + strlen(copy_of_key_string);
-
-    while (word_start < string_end) {
-        if (*word_start == ' ') {
-            word_start++;
-            continue;
-        }
+static bool map_set(Map* map, const char* key, void* value) {
+    return map_set_n(map, key, strlen(key), value);
+}
 
-        char* word_end = word_start;
-        while (true) {
-            if (*word_end == ' ' || *word_end == '\0') {
-                break;
-            }
-            word_end++;
-        }
-        *word_end = '\0';
 
-        if (!map_set(map, word_start, value)) {
-            free(copy_of_key_string);
-            return false;
+// Removes all entries, keeping the map's capacity.
+static void map_clear(Map* map) {
+    for (int i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->key != NULL && map->owns_keys) {
+            free(entry->key);
         }
-
-        word_start = word_end + 1;
+        entry->key = NULL;
     }
-
-    free(copy_of_key_string);
-    return true;
+    map->count = 0;
 }
 
 
-/* -------- */
-/* Options. */
-/* -------- */
+/* ------------------------------------------------------------------- */
+/* Trie: an ordered radix trie with string-keys and pointer-values.    */
+/* ------------------------------------------------------------------- */
 
 
-typedef enum {
-    OPT_FLAG,
-    OPT_STR,
-    OPT_INT,
-    OPT_DBL,
-} OptionType;
+// Each node stores the label of the edge leading into it from its parent. A
+// node with a non-NULL key marks the end of a registered key. Child nodes are
+// kept sorted by the first byte of their labels so a depth-first walk visits
+// the keys in lexicographic order.
+//
+// Each node also caches the value shared by all the keys in its subtree. This
+// is NULL if the subtree is empty or TRIE_AMBIGUOUS if the subtree's keys map
+// to different values. This lets us resolve a unique prefix in time
+// proportional to the length of the prefix.
 
 
-typedef union {
-    char* str_val;
-    int int_val;
-    double dbl_val;
-} OptionValue;
+static char trie_ambiguous_sentinel;
+#define TRIE_AMBIGUOUS ((void*)&trie_ambiguous_sentinel)
+
+
+typedef struct TrieNode {
+    char* label;
+    char* key;
+    void* value;
+    void* subtree_value;
+    int child_count;
+    int child_capacity;
+    struct TrieNode** children;
+} TrieNode;
 
 
 typedef struct {
-    OptionType type;
     int count;
-    int capacity;
-    OptionValue* values;
-    OptionValue fallback;
-    bool is_greedy;
-} Option;
+    TrieNode* root;
+} Trie;
 
 
-static void option_free(Option* opt) {
-    if (opt) {
-        free(opt->values);
-        free(opt);
+static TrieNode* trie_node_new(const char* label, size_t label_length) {
+    TrieNode* node = malloc(sizeof(TrieNode));
+    if (!node) {
+        return NULL;
+    }
+    node->label = malloc(label_length + 1);
+    if (!node->label) {
+        free(node);
+        return NULL;
     }
+    memcpy(node->label, label, label_length);
+    node->label[label_length] = '\0';
+    node->key = NULL;
+    node->value = NULL;
+    node->subtree_value = NULL;
+    node->child_count = 0;
+    node->child_capacity = 0;
+    node->children = NULL;
+    return node;
 }
 
 
-static bool option_append_value(Option* opt, OptionValue value) {
-    if (opt->count + 1 > opt->capacity) {
-        int new_capacity = opt->capacity < 4 ? 4 : opt->capacity * 2;
-        OptionValue* new_array = realloc(opt->values, sizeof(OptionValue) * new_capacity);
-        if (!new_array) {
-            return false;
+static void trie_node_free(TrieNode* node) {
+    if (node) {
+        for (int i = 0; i < node->child_count; i++) {
+            trie_node_free(node->children[i]);
         }
-        opt->capacity = new_capacity;
-        opt->values = new_array;
+        free(node->children);
+        free(node->label);
+        free(node->key);
+        free(node);
     }
-    opt->values[opt->count] = value;
-    opt->count++;
-    return true;
 }
 
 
-static bool option_try_set(Option* opt, char* arg) {
-    if (opt->type == OPT_STR) {
-        return option_append_value(opt, (OptionValue){.str_val = arg});
-    }
-    else if (opt->type == OPT_INT) {
-        int value = try_str_to_int(arg);
-        return option_append_value(opt, (OptionValue){.int_val = value});
+static Trie* trie_new(void) {
+    Trie* trie = malloc(sizeof(Trie));
+    if (!trie) {
+        return NULL;
     }
-    else if (opt->type == OPT_DBL) {
-        double value = try_str_to_double(arg);
-        return option_append_value(opt, (OptionValue){.dbl_val = value});
+    trie->count = 0;
+    trie->root = trie_node_new("", 0);
+    if (!trie->root) {
+        free(trie);
+        return NULL;
     }
-    assert(false);
-    return false;
+    return trie;
 }
 
 
-static Option* option_new(void) {
-    Option *option = malloc(sizeof(Option));
-    if (!option) {
-        return NULL;
+static void trie_free(Trie* trie) {
+    if (trie) {
+        trie_node_free(trie->root);
+        free(trie);
     }
-    option->count = 0;
-    option->capacity = 0;
-    option->values = NULL;
-    option->is_greedy = false;
-    return option;
 }
 
 
-static Option* option_new_flag(void) {
-    Option *opt = option_new();
-    if (!opt) {
-        return NULL;
+// Returns the index of the child whose label begins with [c], or -1.
+static int trie_find_child(TrieNode* node, char c) {
+    int lo = 0;
+    int hi = node->child_count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        uint8_t mid_c = (uint8_t)node->children[mid]->label[0];
+        if (mid_c == (uint8_t)c) {
+            return mid;
+        } else if (mid_c < (uint8_t)c) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
     }
-    opt->type = OPT_FLAG;
-    return opt;
+    return -1;
 }
 
 
-static Option* option_new_str(char* fallback) {
-    Option *opt = option_new();
-    if (!opt) {
-        return NULL;
+// Inserts [child] into the node's list of children, preserving the sort order.
+static bool trie_add_child(TrieNode* node, TrieNode* child) {
+    if (node->child_count + 1 > node->child_capacity) {
+        int new_capacity =
+            node->child_capacity < 4 ? 4 : node->child_capacity * 2;
+        TrieNode** new_array =
+            realloc(node->children, sizeof(TrieNode*) * new_capacity);
+        if (!new_array) {
+            return false;
+        }
+        node->children = new_array;
+        node->child_capacity = new_capacity;
     }
-    opt->type = OPT_STR;
-    opt->fallback = (OptionValue){.str_val = fallback};
-    return opt;
-}
-
 
-static Option* option_new_int(int fallback) {
-    Option *opt = option_new();
-    if (!opt) {
-        return NULL;
+    int index = node->child_count;
+    while (index > 0 && (uint8_t)node->children[index - 1]->label[0] >
+        (uint8_t)child->label[0]) {
+        node->children[index] = node->children[index - 1];
+        index--;
     }
-    opt->type = OPT_INT;
-    opt->fallback = (OptionValue){.int_val = fallback};
-    return opt;
+    node->children[index] = child;
+    node->child_count++;
+    return true;
 }
 
 
-static Option* option_new_double(double fallback) {
-    Option *opt = option_new();
-    if (!opt) {
-        return NULL;
+// Recomputes the node's cached subtree value from its own value and the cached
+// values of its children.
+static void trie_node_refresh(TrieNode* node) {
+    void* subtree_value = node->key ? node->value : NULL;
+    for (int i = 0; i < node->child_count; i++) {
+        void* child_value = node->children[i]->subtree_value;
+        if (child_value == NULL || child_value == subtree_value) {
+            continue;
+        }
+        if (subtree_value == NULL) {
+            subtree_value = child_value;
+        } else {
+            subtree_value = TRIE_AMBIGUOUS;
+            break;
+        }
     }
-    opt->type = OPT_DBL;
-    opt->fallback = (OptionValue){.dbl_val = fallback};
-    return opt;
+    node->subtree_value = subtree_value;
 }
 
 
-static char* option_get_str(Option* opt) {
-    if (opt->count > 0) {
-        return opt->values[opt->count - 1].str_val;
+// Inserts the remaining characters [rest] of [key] below [node].
+static bool trie_node_insert(Trie* trie, TrieNode* node, const char* key,
+    const char* rest, void* value) {
+    if (*rest == '\0') {
+        if (!node->key) {
+            node->key = str_dup(key);
+            if (!node->key) {
+                return false;
+            }
+            trie->count++;
+        }
+        node->value = value;
+        trie_node_refresh(node);
+        return true;
     }
-    return opt->fallback.str_val;
-}
 
+    int index = trie_find_child(node, *rest);
 
-static int option_get_int(Option* opt) {
-    if (opt->count > 0) {
-        return opt->values[opt->count - 1].int_val;
+    if (index == -1) {
+        TrieNode* leaf = trie_node_new(rest, strlen(rest));
+        if (!leaf) {
+            return false;
+        }
+        if (!trie_node_insert(trie, leaf, key, "", value) ||
+            !trie_add_child(node, leaf)) {
+            trie_node_free(leaf);
+            return false;
+        }
+        trie_node_refresh(node);
+        return true;
     }
-    return opt->fallback.int_val;
-}
 
+    TrieNode* child = node->children[index];
+    size_t common = 0;
+    while (child->label[common] != '\0' &&
+        child->label[common] == rest[common]) {
+        common++;
+    }
 
-static double option_get_double(Option* opt) {
-    if (opt->count > 0) {
-        return opt->values[opt->count - 1].dbl_val;
+    // If the key diverges part way along the child's edge, split the edge by
+    // inserting a new intermediate node.
+    if (child->label[common] != '\0') {
+        TrieNode* split = trie_node_new(child->label, common);
+        if (!split) {
+            return false;
+        }
+        char* new_label = str_dup(child->label + common);
+        if (!new_label || !trie_add_child(split, child)) {
+            free(new_label);
+            trie_node_free(split);
+            return false;
+        }
+        free(child->label);
+        child->label = new_label;
+        trie_node_refresh(split);
+        node->children[index] = split;
+        child = split;
     }
-    return opt->fallback.dbl_val;
+
+    if (!trie_node_insert(trie, child, key, rest + common, value)) {
+        return false;
+    }
+    trie_node_refresh(node);
+    return true;
 }
 
 
-// Returns the option's values as a freshly-allocated array of string pointers.
-static char** option_get_str_list(Option* opt) {
-    if (opt->count == 0) {
-        return NULL;
-    }
-    char** list = malloc(sizeof(char*) * opt->count);
-    if (!list) {
-        return NULL;
-    }
-    for (int i = 0; i < opt->count; i++) {
-        list[i] = opt->values[i].str_val;
-    }
-    return list;
+// Adds a new entry to the trie or updates the value of an existing entry.
+// (Note that the trie stores its own internal copy of the key string.)
+static bool trie_set(Trie* trie, const char* key, void* value) {
+    return trie_node_insert(trie, trie->root, key, key, value);
 }
 
 
-// Returns the option's values as a freshly-allocated array of integers.
-static int* option_get_int_list(Option* opt) {
-    if (opt->count == 0) {
-        return NULL;
-    }
-    int* list = malloc(sizeof(int) * opt->count );
-    if (!list) {
-        return NULL;
+// Returns the node whose subtree contains exactly the keys beginning with
+// [prefix], or NULL if no key begins with [prefix].
+static TrieNode* trie_find_prefix(Trie* trie, const char* prefix) {
+    TrieNode* node = trie->root;
+    const char* rest = prefix;
+
+    while (*rest != '\0') {
+        int index = trie_find_child(node, *rest);
+        if (index == -1) {
+            return NULL;
+        }
+        TrieNode* child = node->children[index];
+        size_t common = 0;
+        while (child->label[common] != '\0' &&
+            child->label[common] == rest[common]) {
+            common++;
+        }
+        if (rest[common] == '\0') {
+            return child;
+        }
+        if (child->label[common] != '\0') {
+            return NULL;
+        }
+        node = child;
+        rest += common;
     }
-    for (int i = 0; i < opt->count ; i++) {
-        list[i] = opt->values[i].int_val;
+
+    return node;
+}
+
+
+// Returns the value of the longest key which is a prefix of the first [length]
+// bytes of [string] and sets [match_length] to its length, or returns NULL if
+// there's no such key. This walks a single path from the root, so each byte of
+// [string] is examined at most once however many keys the trie holds.
+static void* trie_match_longest(Trie* trie, const char* string, size_t length,
+    size_t* match_length) {
+    TrieNode* node = trie->root;
+    size_t pos = 0;
+    void* value = NULL;
+
+    for (;;) {
+        if (node->key) {
+            value = node->value;
+            *match_length = pos;
+        }
+        if (pos == length) {
+            return value;
+        }
+        int index = trie_find_child(node, string[pos]);
+        if (index == -1) {
+            return value;
+        }
+        TrieNode* child = node->children[index];
+        size_t common = 0;
+        while (child->label[common] != '\0' && pos + common < length &&
+            child->label[common] == string[pos + common]) {
+            common++;
+        }
+        if (child->label[common] != '\0') {
+            return value;
+        }
+        node = child;
+        pos += common;
     }
-    return list;
 }
 
 
-// Returns the option's values as a freshly-allocated array of doubles.
-static double* option_get_double_list(Option* opt) {
-    if (opt->count  == 0) {
-        return NULL;
+// Appends the keys in the node's subtree to [vec] in lexicographic order.
+static bool trie_node_collect(TrieNode* node, Vec* vec) {
+    if (node->key && !vec_add(vec, node->key)) {
+        return false;
     }
-    double* list = malloc(sizeof(double) * opt->count );
-    if (!list) {
+    for (int i = 0; i < node->child_count; i++) {
+        if (!trie_node_collect(node->children[i], vec)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Returns the keys beginning with [prefix] as a freshly-allocated,
+// NULL-terminated array of string pointers in lexicographic order. Returns NULL
+// if memory cannot be allocated for the array.
+static char** trie_get_keys(Trie* trie, const char* prefix) {
+    Vec* vec = vec_new();
+    if (!vec) {
         return NULL;
     }
-    for (int i = 0; i < opt->count ; i++) {
-        list[i] = opt->values[i].dbl_val;
+
+    TrieNode* node = trie_find_prefix(trie, prefix);
+    if ((node && !trie_node_collect(node, vec)) || !vec_add(vec, NULL)) {
+        vec_free(vec);
+        return NULL;
     }
-    return list;
+
+    char** keys = (char**)vec->entries;
+    free(vec);
+    return keys;
 }
 
 
-// Returns a freshly-allocated state-string for debugging.
-static char* option_to_str(Option* opt) {
-    if (opt->type == OPT_FLAG) {
-        return str("%i", opt->count);
+/* ---------------------------- */
+/* Space-separated key strings. */
+/* ---------------------------- */
+
+
+// This splits the key string into space-separated words and adds a separate
+// entry to both the map and the trie for each word. [trie] can be NULL to index
+// the words in the map only.
+static bool index_splitkey(Map* map, Trie* trie, const char* key_string,
+    void* value) {
+    char *copy_of_key_string = str_dup(key_string);
+    if (!copy_of_key_string) {
+        return false;
     }
 
-    char *fallback = NULL;
-    if (opt->type == OPT_STR) {
-        fallback = str_dup(opt->fallback.str_val);
-    } else if (opt->type == OPT_INT) {
-        fallback = str("%i", opt->fallback.int_val);
-    } else if (opt->type == OPT_DBL) {
-        fallback = str("%f", opt->fallback.dbl_val);
+    char* word_start = copy_of_key_string;
+    char* string_end = word_start + strlen(copy_of_key_string);
+
+    while (word_start < string_end) {
+        if (*word_start == ' ') {
+            word_start++;
+            continue;
+        }
+
+        char* word_end = word_start;
+        while (true) {
+            if (*word_end == ' ' || *word_end == '\0') {
+                break;
+            }
+            word_end++;
+        }
+        *word_end = '\0';
+
+        if (!map_set(map, word_start, value) ||
+            (trie && !trie_set(trie, word_start, value))) {
+            free(copy_of_key_string);
+            return false;
+        }
+
+        word_start = word_end + 1;
     }
 
-    char *values = str_dup("");
-    for (int i = 0; i < opt->count; i++) {
-        char *value = NULL;
-        if (opt->type == OPT_STR) {
-            value = str_dup(opt->values[i].str_val);
-        } else if (opt->type == OPT_INT) {
-            value = str("%i", opt->values[i].int_val);
-        } else if (opt->type == OPT_DBL) {
-            value = str("%f", opt->values[i].dbl_val);
+    free(copy_of_key_string);
+    return true;
+}
+
+
+/* ------------------------------------------------ */
+/* Suggestions: bounded bit-parallel edit distance. */
+/* ------------------------------------------------ */
+
+
+// The longest name we compute suggestions for: one bit per character of a
+// 64-bit word.
+#define SUGGEST_MAX_LEN 64
+
+
+// Returns the Levenshtein distance between the pattern described by [peq] (of
+// length [m]) and the [n]-byte string [text], or [bound] + 1 if the distance is
+// greater than [bound].
+//
+// This is Hyyrö's formulation of Myers' bit-parallel algorithm. Each column of
+// the dynamic programming matrix is encoded as a pair of bitvectors holding its
+// vertical +1/-1 deltas, so a whole column is advanced with a handful of word
+// operations. [peq] maps each byte to the bitmask of pattern positions holding
+// that byte.
+static int edit_distance(const uint64_t* peq, int m, const char* text, int n,
+    int bound) {
+    uint64_t pv = ~(uint64_t)0;
+    uint64_t mv = 0;
+    uint64_t high_bit = (uint64_t)1 << (m - 1);
+    int score = m;
+
+    for (int j = 0; j < n; j++) {
+        uint64_t eq = peq[(uint8_t)text[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+
+        if (ph & high_bit) {
+            score++;
+        } else if (mh & high_bit) {
+            score--;
         }
-        char *old_values = values;
-        if (i == 0) {
-            values = str_dup(value);
-        } else {
-            values = str("%s, %s", old_values, value);
+
+        // Each remaining character can lower the score by at most one.
+        if (score - (n - j - 1) > bound) {
+            return bound + 1;
         }
-        free(old_values);
-        free(value);
+
+        ph = (ph << 1) | 1;
+        mh = mh << 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
     }
 
-    char *output = str("(%s) [%s]", fallback, values);
-    free(fallback);
-    free(values);
-    return output;
+    return score > bound ? bound + 1 : score;
+}
+
+
+// Tracks the candidate closest to a misspelt name. Candidates can come from
+// several sources.
+typedef struct {
+    uint64_t peq[256];
+    int name_len;
+    int bound;
+    const char* best_key;
+    int best_distance;
+} Suggester;
+
+
+// Returns false if no suggestion can be made for the [name_len]-byte [name].
+static bool suggester_init(Suggester* suggester, const char* name,
+    size_t name_len) {
+    if (name_len == 0 || name_len > SUGGEST_MAX_LEN) {
+        return false;
+    }
+
+    memset(suggester->peq, 0, sizeof(suggester->peq));
+    for (size_t i = 0; i < name_len; i++) {
+        suggester->peq[(uint8_t)name[i]] |= (uint64_t)1 << i;
+    }
+
+    suggester->name_len = (int)name_len;
+    suggester->bound = name_len < 3 ? 1 : (int)(name_len + 1) / 3;
+    suggester->best_key = NULL;
+    suggester->best_distance = suggester->bound + 1;
+    return true;
+}
+
+
+// Ties are broken alphabetically so the suggestion doesn't depend on the order
+// of the candidates.
+static void suggester_consider(Suggester* suggester, const char* key,
+    size_t key_len) {
+    // The distance is at least the difference in length.
+    int length_difference = (int)key_len - suggester->name_len;
+    if (length_difference > suggester->bound ||
+        -length_difference > suggester->bound) {
+        return;
+    }
+
+    int distance = edit_distance(suggester->peq, suggester->name_len, key,
+        (int)key_len, suggester->best_distance);
+    if (distance < suggester->best_distance ||
+        (distance == suggester->best_distance && suggester->best_key &&
+            strcmp(key, suggester->best_key) < 0)) {
+        suggester->best_key = key;
+        suggester->best_distance = distance;
+    }
+}
+
+
+// Returns the key in [map] closest to the [name_len]-byte [name], or NULL if no
+// key is close enough to be a plausible typo. Keys shorter than [min_key_len]
+// are ignored.
+static const char* map_suggest_key(Map* map, const char* name, size_t name_len,
+    size_t min_key_len) {
+    Suggester suggester;
+    if (!suggester_init(&suggester, name, name_len)) {
+        return NULL;
+    }
+
+    for (int i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->key != NULL && entry->key_len >= min_key_len) {
+            suggester_consider(&suggester, entry->key, entry->key_len);
+        }
+    }
+
+    return suggester.best_key;
 }
 
 
 /* ----------------------------------------------------- */
-/* ArgStream: a wrapper for an array of string pointers. */
+/* Choice sets: perfect hashing of a fixed set of names. */
 /* ----------------------------------------------------- */
 
 
-typedef struct ArgStream {
+// A choice set maps each of its names to its index in the original list. Names
+// are hashed into buckets, then each bucket gets its own seed chosen so that
+// its names land in distinct, unused slots. A lookup hashes twice and compares
+// against a single candidate. The names themselves are not copied.
+typedef struct {
     int count;
-    int index;
-    char** args;
-} ArgStream;
+    uint32_t bucket_mask;
+    uint32_t slot_mask;
+    const char** names;
+    uint32_t* seeds;
+    int* slots;
+} ChoiceSet;
+
+
+// Tries this many seeds per bucket before retrying with a larger table.
+#define CHOICE_MAX_SEED 4096
+
+
+// Seeded variant of FNV-1a with a final avalanche step so that nearby seeds
+// give unrelated hashes.
+static uint32_t choice_hash(const char* string, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (const char* c = string; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+
+static uint32_t next_power_of_two(uint32_t value) {
+    uint32_t result = 1;
+    while (result < value) {
+        result *= 2;
+    }
+    return result;
+}
+
+
+// Looks for a seed which places every name in the bucket in a distinct empty
+// slot. On success, claims the slots and returns true.
+static bool choice_set_place_bucket(ChoiceSet* set, int bucket, int* head,
+    int* next) {
+    for (uint32_t seed = 1; seed <= CHOICE_MAX_SEED; seed++) {
+        int placed = head[bucket];
+        for (; placed != -1; placed = next[placed]) {
+            uint32_t slot =
+                choice_hash(set->names[placed], seed) & set->slot_mask;
+            if (set->slots[slot] != -1) {
+                break;
+            }
+            set->slots[slot] = placed;
+        }
+        if (placed == -1) {
+            set->seeds[bucket] = seed;
+            return true;
+        }
+        for (int i = head[bucket]; i != placed; i = next[i]) {
+            set->slots[choice_hash(set->names[i], seed) & set->slot_mask] = -1;
+        }
+    }
+    return false;
+}
+
+
+// Fills the set's seed and slot tables. Buckets are placed largest first, while
+// the table is still mostly empty.
+static bool choice_set_build(ChoiceSet* set, int* head, int* next, int* sizes) {
+    int bucket_count = (int)set->bucket_mask + 1;
+    int max_size = 0;
+
+    for (int i = 0; i < bucket_count; i++) {
+        head[i] = -1;
+        sizes[i] = 0;
+        set->seeds[i] = 0;
+    }
+    for (uint32_t i = 0; i <= set->slot_mask; i++) {
+        set->slots[i] = -1;
+    }
+
+    for (int i = set->count - 1; i >= 0; i--) {
+        int bucket = (int)(choice_hash(set->names[i], 0) & set->bucket_mask);
+        next[i] = head[bucket];
+        head[bucket] = i;
+        if (++sizes[bucket] > max_size) {
+            max_size = sizes[bucket];
+        }
+    }
+
+    for (int size = max_size; size > 0; size--) {
+        for (int i = 0; i < bucket_count; i++) {
+            if (sizes[i] == size &&
+                !choice_set_place_bucket(set, i, head, next)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Allocates a ChoiceSet and its tables as a single block, laid out for a slot
+// table of at least [min_slots] entries.
+static ChoiceSet* choice_set_alloc(const char* names[], int count,
+    uint32_t min_slots) {
+    uint32_t bucket_count =
+        next_power_of_two(count > 1 ? (uint32_t)count / 2 : 1);
+    uint32_t slot_count = next_power_of_two(min_slots);
+
+    ChoiceSet* set = malloc(
+        sizeof(ChoiceSet) +
+        sizeof(const char*) * count +
+        sizeof(uint32_t) * bucket_count +
+        sizeof(int) * slot_count
+    );
+    if (!set) {
+        return NULL;
+    }
+
+    set->count = count;
+    set->bucket_mask = bucket_count - 1;
+    set->slot_mask = slot_count - 1;
+    set->names = (const char**)(set + 1);
+    set->seeds = (uint32_t*)(set->names + count);
+    set->slots = (int*)(set->seeds + bucket_count);
+    memcpy(set->names, names, sizeof(const char*) * count);
+    return set;
+}
+
+
+// Returns the index of the first name that repeats an earlier one, or -1 if the
+// names are unique.
+static int choice_names_find_duplicate(const char* names[], int count) {
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < i; j++) {
+            if (strcmp(names[i], names[j]) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+
+// Builds a perfect-hash set over [names], which the caller must have checked
+// for duplicates with choice_names_find_duplicate(). Returns NULL if memory
+// cannot be allocated.
+static ChoiceSet* choice_set_new(const char* names[], int count) {
+    int bucket_count =
+        (int)next_power_of_two(count > 1 ? (uint32_t)count / 2 : 1);
+    int* scratch =
+        malloc(sizeof(int) * (2 * bucket_count + (count > 0 ? count : 1)));
+    if (!scratch) {
+        return NULL;
+    }
+
+    // A load factor of at most 1/2 makes a seed search failure vanishingly
+    // unlikely, but if it does fail we retry with a larger table.
+    ChoiceSet* set = NULL;
+    for (uint32_t min_slots = 2 * (uint32_t)count; min_slots < (1u << 30);
+        min_slots *= 2) {
+        set = choice_set_alloc(names, count, min_slots > 0 ? min_slots : 1);
+        if (!set) {
+            break;
+        }
+        if (choice_set_build(set, scratch, scratch + 2 * bucket_count,
+            scratch + bucket_count)) {
+            break;
+        }
+        free(set);
+        set = NULL;
+    }
+
+    free(scratch);
+    return set;
+}
+
+
+// Returns the index of [name] in the set, or -1 if it isn't one of the set's
+// names.
+static int choice_set_find(ChoiceSet* set, const char* name) {
+    uint32_t bucket = choice_hash(name, 0) & set->bucket_mask;
+    int index =
+        set->slots[choice_hash(name, set->seeds[bucket]) & set->slot_mask];
+    if (index != -1 && strcmp(set->names[index], name) == 0) {
+        return index;
+    }
+    return -1;
+}
+
+
+// Returns the set's names as a freshly-allocated, comma-separated list.
+static char* choice_set_list(ChoiceSet* set) {
+    size_t size = 1;
+    for (int i = 0; i < set->count; i++) {
+        size += strlen(set->names[i]) + 2;
+    }
+
+    char* list = malloc(size);
+    if (!list) {
+        return NULL;
+    }
+
+    char* cursor = list;
+    for (int i = 0; i < set->count; i++) {
+        size_t length = strlen(set->names[i]);
+        if (i > 0) {
+            memcpy(cursor, ", ", 2);
+            cursor += 2;
+        }
+        memcpy(cursor, set->names[i], length);
+        cursor += length;
+    }
+    *cursor = '\0';
+    return list;
+}
+
+
+/* ----------------------------------------------------------- */
+/* Blob: sequential writing and reading of flat binary buffers. */
+/* ----------------------------------------------------------- */
+
+
+// Blobs contain no pointers, only inline data, so they're position-independent.
+// Fields are written in native byte order and alignment-agnostically, i.e. via
+// memcpy().
+
+
+#define BLOB_NULL_STRING UINT32_MAX
+
+
+// The writer counts the bytes required even when the buffer is too small, so a
+// first pass with a NULL buffer can be used to size the buffer for a second
+// pass.
+typedef struct {
+    uint8_t* buf;
+    size_t size;
+    size_t pos;
+} BlobWriter;
+
+
+typedef struct {
+    const uint8_t* buf;
+    size_t size;
+    size_t pos;
+    bool ok;
+} BlobReader;
+
+
+static void blob_write(BlobWriter* writer, const void* data, size_t length) {
+    if (writer->buf && writer->pos + length <= writer->size) {
+        memcpy(writer->buf + writer->pos, data, length);
+    }
+    writer->pos += length;
+}
+
+
+static void blob_write_u32(BlobWriter* writer, uint32_t value) {
+    blob_write(writer, &value, sizeof(uint32_t));
+}
+
+
+static void blob_write_i32(BlobWriter* writer, int32_t value) {
+    blob_write(writer, &value, sizeof(int32_t));
+}
+
+
+static void blob_write_dbl(BlobWriter* writer, double value) {
+    blob_write(writer, &value, sizeof(double));
+}
+
+
+// Strings are written as a length followed by the string's bytes and a
+// terminating NUL so they can be used in place when reading. A NULL string is
+// written as the length BLOB_NULL_STRING.
+static void blob_write_str(BlobWriter* writer, const char* string) {
+    if (!string) {
+        blob_write_u32(writer, BLOB_NULL_STRING);
+        return;
+    }
+    size_t length = strlen(string);
+    blob_write_u32(writer, (uint32_t)length);
+    blob_write(writer, string, length + 1);
+}
+
+
+static bool blob_read(BlobReader* reader, void* data, size_t length) {
+    if (!reader->ok || length > reader->size - reader->pos) {
+        reader->ok = false;
+        return false;
+    }
+    memcpy(data, reader->buf + reader->pos, length);
+    reader->pos += length;
+    return true;
+}
+
+
+static uint32_t blob_read_u32(BlobReader* reader) {
+    uint32_t value = 0;
+    blob_read(reader, &value, sizeof(uint32_t));
+    return value;
+}
+
+
+static int32_t blob_read_i32(BlobReader* reader) {
+    int32_t value = 0;
+    blob_read(reader, &value, sizeof(int32_t));
+    return value;
+}
+
+
+static double blob_read_dbl(BlobReader* reader) {
+    double value = 0.0;
+    blob_read(reader, &value, sizeof(double));
+    return value;
+}
+
+
+// Returns a pointer to the string in the buffer itself, i.e. nothing is copied.
+static char* blob_read_str(BlobReader* reader) {
+    uint32_t length = blob_read_u32(reader);
+    if (!reader->ok || length == BLOB_NULL_STRING) {
+        return NULL;
+    }
+    if ((size_t)length >= reader->size - reader->pos ||
+        reader->buf[reader->pos + length] != '\0') {
+        reader->ok = false;
+        return NULL;
+    }
+    char* string = (char*)(reader->buf + reader->pos);
+    reader->pos += (size_t)length + 1;
+    return string;
+}
+
+
+/* -------- */
+/* Options. */
+/* -------- */
+
+
+typedef enum {
+    OPT_FLAG,
+    OPT_STR,
+    OPT_INT,
+    OPT_DBL,
+    OPT_CHOICE,
+    OPT_SET,
+    OPT_KV,
+} OptionType;
+
+
+typedef union {
+    char* str_val;
+    int int_val;
+    double dbl_val;
+} OptionValue;
+
+
+// An option's values are stored in a contiguous array of the option's own type
+// so they can be exposed directly to the caller.
+typedef union {
+    void* data;
+    char** str_vals;
+    int* int_vals;
+    double* dbl_vals;
+} OptionValueArray;
+
+
+typedef struct {
+    OptionType type;
+    int count;
+    int capacity;
+    OptionValueArray values;
+    OptionValue fallback;
+    bool is_greedy;
+    bool rejects_duplicates;
+    bool is_global;
+    bool is_family;
+    int index;
+    ApSourceKind source;
+    int source_index;
+    const char* source_name;
+    size_t source_name_len;
+    ChoiceSet* choices;
+    Map* lookup;
+} Option;
+
+
+// Frees the option's lookup tables but not the option or its values.
+static void option_free_tables(Option* opt) {
+    free(opt->choices);
+    map_free(opt->lookup);
+}
+
+
+static void option_free(Option* opt) {
+    if (opt) {
+        free(opt->values.data);
+        option_free_tables(opt);
+        free(opt);
+    }
+}
+
+
+// Returns the size in bytes of a single stored value. Flags are counted but
+// store no values.
+static size_t option_value_size(Option* opt) {
+    switch (opt->type) {
+        case OPT_STR:
+        case OPT_SET:
+        case OPT_KV:
+            return sizeof(char*);
+        case OPT_INT:
+        case OPT_CHOICE:
+            return sizeof(int);
+        case OPT_DBL:
+            return sizeof(double);
+        default:
+            return 0;
+    }
+}
+
+
+// Returns true if the option's values are strings.
+static bool option_has_str_values(Option* opt) {
+    return opt->type == OPT_STR || opt->type == OPT_SET || opt->type == OPT_KV;
+}
+
+
+// Returns the length of the key in a key-value option's 'key=value' argument.
+static size_t kv_key_len(const char* arg) {
+    return strcspn(arg, "=");
+}
+
+
+// Adds a set or key-value option's value to its lookup table. A key-value
+// argument is split on its first '=' without copying: the map's key is the
+// argument string itself, limited to the key's length, and its value points
+// just past the '='. A later value for the same key replaces the earlier one.
+static bool option_index_value(Option* opt, char* value) {
+    if (opt->type == OPT_SET) {
+        return map_set(opt->lookup, value, value);
+    }
+    size_t key_len = kv_key_len(value);
+    char* kv_value =
+        value[key_len] == '=' ? value + key_len + 1 : value + key_len;
+    return map_set_n(opt->lookup, value, key_len, kv_value);
+}
+
+
+// For a set option, a value that's already in the set is skipped.
+static bool option_append_value(Option* opt, OptionValue value) {
+    void* existing;
+    if (opt->type == OPT_SET &&
+        map_get(opt->lookup, value.str_val, &existing)) {
+        return true;
+    }
+
+    if (opt->count + 1 > opt->capacity) {
+        int new_capacity = opt->capacity < 4 ? 4 : opt->capacity * 2;
+        void* new_array =
+            realloc(opt->values.data, option_value_size(opt) * new_capacity);
+        if (!new_array) {
+            return false;
+        }
+        opt->capacity = new_capacity;
+        opt->values.data = new_array;
+    }
+    if (option_has_str_values(opt)) {
+        if (opt->lookup && !option_index_value(opt, value.str_val)) {
+            return false;
+        }
+        opt->values.str_vals[opt->count] = value.str_val;
+    } else if (opt->type == OPT_INT || opt->type == OPT_CHOICE) {
+        opt->values.int_vals[opt->count] = value.int_val;
+    } else {
+        opt->values.dbl_vals[opt->count] = value.dbl_val;
+    }
+    opt->count++;
+    return true;
+}
+
+
+static Option* option_new(void) {
+    Option *option = malloc(sizeof(Option));
+    if (!option) {
+        return NULL;
+    }
+    option->count = 0;
+    option->capacity = 0;
+    option->values.data = NULL;
+    option->is_greedy = false;
+    option->rejects_duplicates = false;
+    option->is_global = false;
+    option->is_family = false;
+    option->index = -1;
+    option->source = AP_SOURCE_FALLBACK;
+    option->source_index = -1;
+    option->source_name = NULL;
+    option->source_name_len = 0;
+    option->choices = NULL;
+    option->lookup = NULL;
+    return option;
+}
+
+
+// Records where the option's current value came from.
+static void option_set_source(Option* opt, ApSourceKind kind, const char* name,
+    size_t name_len, int index) {
+    opt->source = kind;
+    opt->source_name = name;
+    opt->source_name_len = name_len;
+    opt->source_index = index;
+}
+
+
+static Option* option_new_flag(void) {
+    Option *opt = option_new();
+    if (!opt) {
+        return NULL;
+    }
+    opt->type = OPT_FLAG;
+    return opt;
+}
+
+
+static Option* option_new_str(char* fallback) {
+    Option *opt = option_new();
+    if (!opt) {
+        return NULL;
+    }
+    opt->type = OPT_STR;
+    opt->fallback = (OptionValue){.str_val = fallback};
+    return opt;
+}
+
+
+static Option* option_new_int(int fallback) {
+    Option *opt = option_new();
+    if (!opt) {
+        return NULL;
+    }
+    opt->type = OPT_INT;
+    opt->fallback = (OptionValue){.int_val = fallback};
+    return opt;
+}
+
+
+static Option* option_new_double(double fallback) {
+    Option *opt = option_new();
+    if (!opt) {
+        return NULL;
+    }
+    opt->type = OPT_DBL;
+    opt->fallback = (OptionValue){.dbl_val = fallback};
+    return opt;
+}
+
+
+// Takes ownership of [choices].
+static Option* option_new_choice(ChoiceSet* choices, int fallback) {
+    Option *opt = option_new();
+    if (!opt) {
+        free(choices);
+        return NULL;
+    }
+    opt->type = OPT_CHOICE;
+    opt->fallback = (OptionValue){.int_val = fallback};
+    opt->choices = choices;
+    return opt;
+}
+
+
+// Set and key-value options index their values with a map which borrows the
+// value strings as its keys. A set option stores its distinct values in order
+// of appearance; a key-value option stores every 'key=value' argument.
+static Option* option_new_indexed(OptionType type) {
+    Option *opt = option_new();
+    if (!opt) {
+        return NULL;
+    }
+    opt->type = type;
+    opt->fallback = (OptionValue){.str_val = NULL};
+    opt->lookup = map_new();
+    if (!opt->lookup) {
+        free(opt);
+        return NULL;
+    }
+    opt->lookup->owns_keys = false;
+    return opt;
+}
+
+
+// Clears the option's values.
+static void option_clear_values(Option* opt) {
+    opt->count = 0;
+    if (opt->lookup) {
+        map_clear(opt->lookup);
+    }
+}
+
+
+// Records that the option was found on the command line. A global option can be
+// found by a command after its own parser's lower-precedence sources have been
+// applied, in which case their values are discarded.
+static void option_set_argv_source(Option* opt, int index) {
+    if (opt->source == AP_SOURCE_ENV || opt->source == AP_SOURCE_CONFIG) {
+        option_clear_values(opt);
+    }
+    option_set_source(opt, AP_SOURCE_ARGV, NULL, 0, index);
+}
+
+
+static int option_get_int(Option* opt) {
+    if (opt->count > 0) {
+        return opt->values.int_vals[opt->count - 1];
+    }
+    return opt->fallback.int_val;
+}
+
+
+// Returns the name of the choice at [index], or NULL if [index] doesn't name a
+// choice, e.g. a fallback of -1.
+static char* option_choice_name(Option* opt, int index) {
+    if (index < 0 || index >= opt->choices->count) {
+        return NULL;
+    }
+    return (char*)opt->choices->names[index];
+}
+
+
+// A choice option's string value is the name of its choice.
+static char* option_get_str(Option* opt) {
+    if (opt->type == OPT_CHOICE) {
+        return option_choice_name(opt, option_get_int(opt));
+    }
+    if (opt->count > 0) {
+        return opt->values.str_vals[opt->count - 1];
+    }
+    return opt->fallback.str_val;
+}
+
+
+static double option_get_double(Option* opt) {
+    if (opt->count > 0) {
+        return opt->values.dbl_vals[opt->count - 1];
+    }
+    return opt->fallback.dbl_val;
+}
+
+
+// Returns the option's values as a freshly-allocated array of string pointers.
+// A choice option's values are the names of its choices.
+static char** option_get_str_list(Option* opt) {
+    if (opt->count == 0) {
+        return NULL;
+    }
+    char** list = malloc(sizeof(char*) * opt->count);
+    if (!list) {
+        return NULL;
+    }
+    if (opt->type == OPT_CHOICE) {
+        for (int i = 0; i < opt->count; i++) {
+            list[i] = option_choice_name(opt, opt->values.int_vals[i]);
+        }
+    } else {
+        memcpy(list, opt->values.str_vals, sizeof(char*) * opt->count);
+    }
+    return list;
+}
+
+
+// Returns the option's values as a freshly-allocated array of integers.
+static int* option_get_int_list(Option* opt) {
+    if (opt->count == 0) {
+        return NULL;
+    }
+    int* list = malloc(sizeof(int) * opt->count);
+    if (!list) {
+        return NULL;
+    }
+    memcpy(list, opt->values.int_vals, sizeof(int) * opt->count);
+    return list;
+}
+
+
+// Returns the option's values as a freshly-allocated array of doubles.
+static double* option_get_double_list(Option* opt) {
+    if (opt->count == 0) {
+        return NULL;
+    }
+    double* list = malloc(sizeof(double) * opt->count);
+    if (!list) {
+        return NULL;
+    }
+    memcpy(list, opt->values.dbl_vals, sizeof(double) * opt->count);
+    return list;
+}
+
+
+// Returns a freshly-allocated state-string for debugging.
+static char* option_to_str(Option* opt) {
+    if (opt->type == OPT_FLAG) {
+        return str("%i", opt->count);
+    }
+
+    char *fallback = NULL;
+    if (opt->type == OPT_STR) {
+        fallback = str_dup(opt->fallback.str_val);
+    } else if (opt->type == OPT_SET || opt->type == OPT_KV) {
+        fallback = str_dup("");
+    } else if (opt->type == OPT_INT || opt->type == OPT_CHOICE) {
+        fallback = str("%i", opt->fallback.int_val);
+    } else if (opt->type == OPT_DBL) {
+        fallback = str("%f", opt->fallback.dbl_val);
+    }
+
+    char *values = str_dup("");
+    for (int i = 0; i < opt->count; i++) {
+        char *value = NULL;
+        if (option_has_str_values(opt)) {
+            value = str_dup(opt->values.str_vals[i]);
+        } else if (opt->type == OPT_INT || opt->type == OPT_CHOICE) {
+            value = str("%i", opt->values.int_vals[i]);
+        } else if (opt->type == OPT_DBL) {
+            value = str("%f", opt->values.dbl_vals[i]);
+        }
+        char *old_values = values;
+        if (i == 0) {
+            values = str_dup(value);
+        } else {
+            values = str("%s, %s", old_values, value);
+        }
+        free(old_values);
+        free(value);
+    }
+
+    char *output = str("(%s) [%s]", fallback, values);
+    free(fallback);
+    free(values);
+    return output;
+}
+
+
+/* ----------------------------------------------------- */
+/* ArgStream: a wrapper for an array of string pointers. */
+/* ----------------------------------------------------- */
+
+
+// [offset] is the position of args[0] in the original argument array, used to
+// report where an option was found.
+typedef struct ArgStream {
+    int count;
+    int index;
+    char** args;
+    int offset;
+} ArgStream;
+
+
+static ArgStream* argstream_new(int count, char** args) {
+    ArgStream* stream = malloc(sizeof(ArgStream));
+    if (!stream) {
+        return NULL;
+    }
+    stream->count = count;
+    stream->index = 0;
+    stream->args = args;
+    stream->offset = 0;
+    return stream;
+}
+
+
+static void argstream_free(ArgStream* stream) {
+    free(stream);
+}
+
+
+static char* argstream_next(ArgStream* stream) {
+    return stream->args[stream->index++];
+}
+
+
+static bool argstream_has_next(ArgStream* stream) {
+    return stream->index < stream->count;
+}
+
+
+/* ----------------- */
+/* ArgParser: setup. */
+/* ----------------- */
+
+
+// A value loaded from a config file, waiting to be applied to any option not
+// found on the command line. [value] points into the parser's copy of the file.
+typedef struct {
+    Option* opt;
+    char* value;
+    int line;
+} ConfigEntry;
+
+
+// A config file's contents and the entries parsed from it.
+typedef struct {
+    char* path;
+    char* image;
+    ConfigEntry* entries;
+    int count;
+    int capacity;
+} ConfigSource;
+
+
+static void config_source_free(ConfigSource* config) {
+    free(config->path);
+    free(config->image);
+    free(config->entries);
+    *config = (ConfigSource){NULL, NULL, NULL, 0, 0};
+}
+
+
+// A flag, option value, or positional argument found on the command line.
+// Events are appended to a single buffer per parser in the order they're found.
+// [option] is an index into the option_vec of the parser [depth] levels up the
+// parent chain -- non-zero for global options -- or -1 for a positional
+// argument. [value] is NULL for a flag.
+typedef struct {
+    char* value;
+    int option;
+    int depth;
+    int argv_index;
+} ParseEvent;
+
+
+typedef enum {
+    CONSTRAINT_REQUIRED,
+    CONSTRAINT_REQUIRES,
+    CONSTRAINT_CONFLICTS,
+} ConstraintKind;
+
+
+// A single registered rule. [index] and [other] are indexes into the parser's
+// option_vec.
+typedef struct {
+    ConstraintKind kind;
+    int index;
+    int other;
+} Constraint;
+
+
+// The parser's rules and, once compiled, their bitmasks over option indexes.
+// Each row holds the requires-mask followed by the conflicts-mask for the
+// option [row_index[i]]. The compiled tables are a single allocation starting
+// at [required]; [words] is zero until they're built.
+typedef struct {
+    Constraint* rules;
+    int count;
+    int capacity;
+    int words;
+    int row_count;
+    uint64_t* required;
+    uint64_t* rows;
+    uint64_t* found;
+    int* row_index;
+} ConstraintSet;
+
+
+static void constraint_set_free(ConstraintSet* constraints) {
+    free(constraints->rules);
+    free(constraints->required);
+    *constraints = (ConstraintSet){NULL, 0, 0, 0, 0, NULL, NULL, NULL, NULL};
+}
+
+
+struct ArgParser {
+    char* helptext;
+    char* version;
+    Vec* option_vec;
+    Map* option_map;
+    Trie* option_trie;
+    Vec* command_vec;
+    Map* command_map;
+    Trie* command_trie;
+    Vec* positional_args;
+    ParseEvent* events;
+    int event_count;
+    int event_capacity;
+    ap_callback_t cmd_callback;
+    int cmd_callback_exit_code;
+    ap_resolver_t resolver;
+    void* resolver_context;
+    char* cmd_name;
+    struct ArgParser* cmd_parser;
+    struct ArgParser* root_parser;
+    bool enable_help_command;
+    bool had_memory_error;
+    struct ArgParser* parent;
+    int global_count;
+    Trie* family_trie;
+    bool first_pos_arg_ends_option_parsing;
+    bool all_args_as_pos_args;
+    bool enable_abbreviations;
+    char* zeroth_root_arg;
+    char* chain_separator;
+    Vec* chained_cmds;
+    char* env_prefix;
+    ConfigSource config;
+    ConstraintSet constraints;
+    char* spec_image;
+    char* span_buffer;
+    size_t span_buffer_size;
+    bool span_buffer_in_use;
+    void* frozen_block;
+    bool exit_on_error;
+    bool record_parse_order;
+    bool halted;
+    bool in_parse;
+    bool had_setup_memory_error;
+    char* error_message;
+    const char* error_context;
+    int error_context_len;
+};
+
+
+// A command found in a chained invocation. Repeated commands are parsed into
+// clones of the registered command parser, which are owned by the chain.
+typedef struct {
+    char* name;
+    ArgParser* parser;
+    int exit_code;
+    bool is_clone;
+} ChainedCmd;
+
+
+static void ap_clear_chained_cmds(ArgParser* parser) {
+    for (int i = 0; i < parser->chained_cmds->count; i++) {
+        ChainedCmd* link = parser->chained_cmds->entries[i];
+        if (link->is_clone) {
+            ap_free(link->parser);
+        }
+        free(link);
+    }
+    parser->chained_cmds->count = 0;
+}
+
+
+ArgParser* ap_new_parser(void) {
+    ArgParser *parser = malloc(sizeof(ArgParser));
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->helptext = NULL;
+    parser->version = NULL;
+    parser->cmd_callback = NULL;
+    parser->cmd_callback_exit_code = 0;
+    parser->resolver = NULL;
+    parser->resolver_context = NULL;
+    parser->cmd_name = NULL;
+    parser->cmd_parser = NULL;
+    parser->enable_help_command = false;
+    parser->had_memory_error = false;
+    parser->parent = NULL;
+    parser->global_count = 0;
+    parser->family_trie = NULL;
+    parser->first_pos_arg_ends_option_parsing = false;
+    parser->all_args_as_pos_args = false;
+    parser->enable_abbreviations = false;
+    parser->option_vec = NULL;
+    parser->option_map = NULL;
+    parser->option_trie = NULL;
+    parser->command_vec = NULL;
+    parser->command_map = NULL;
+    parser->command_trie = NULL;
+    parser->positional_args = NULL;
+    parser->events = NULL;
+    parser->event_count = 0;
+    parser->event_capacity = 0;
+    parser->root_parser = parser;
+    parser->zeroth_root_arg = NULL;
+    parser->chain_separator = NULL;
+    parser->chained_cmds = NULL;
+    parser->env_prefix = NULL;
+    parser->config = (ConfigSource){NULL, NULL, NULL, 0, 0};
+    parser->constraints =
+        (ConstraintSet){NULL, 0, 0, 0, 0, NULL, NULL, NULL, NULL};
+    parser->spec_image = NULL;
+    parser->span_buffer = NULL;
+    parser->span_buffer_size = 0;
+    parser->span_buffer_in_use = false;
+    parser->frozen_block = NULL;
+    parser->exit_on_error = true;
+    parser->record_parse_order = false;
+    parser->halted = false;
+    parser->in_parse = false;
+    parser->had_setup_memory_error = false;
+    parser->error_message = NULL;
+    parser->error_context = NULL;
+    parser->error_context_len = 0;
+
+    parser->option_vec = vec_new();
+    if (!parser->option_vec) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    parser->option_map = map_new();
+    if (!parser->option_map) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    parser->option_trie = trie_new();
+    if (!parser->option_trie) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    parser->command_vec = vec_new();
+    if (!parser->command_vec) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    parser->command_map = map_new();
+    if (!parser->command_map) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    parser->command_trie = trie_new();
+    if (!parser->command_trie) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    parser->positional_args = vec_new();
+    if (!parser->positional_args) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    return parser;
+}
+
+
+void ap_free(ArgParser* parser) {
+    if (!parser) {
+        return;
+    }
+
+    free(parser->helptext);
+    free(parser->version);
+    free(parser->error_message);
+    free(parser->spec_image);
+    free(parser->span_buffer);
+    free(parser->chain_separator);
+    free(parser->env_prefix);
+    config_source_free(&parser->config);
+    constraint_set_free(&parser->constraints);
+
+    if (parser->chained_cmds) {
+        ap_clear_chained_cmds(parser);
+        vec_free(parser->chained_cmds);
+    }
+
+    if (parser->option_map) {
+        map_free(parser->option_map);
+    }
+
+    if (parser->option_trie) {
+        trie_free(parser->option_trie);
+    }
+
+    if (parser->family_trie) {
+        trie_free(parser->family_trie);
+    }
+
+    if (parser->option_vec) {
+        for (int i = 0; i < parser->option_vec->count; i++) {
+            if (parser->frozen_block) {
+                option_free_tables(parser->option_vec->entries[i]);
+            } else {
+                option_free(parser->option_vec->entries[i]);
+            }
+        }
+        vec_free(parser->option_vec);
+    }
+
+    free(parser->frozen_block);
+
+    if (parser->command_map) {
+        map_free(parser->command_map);
+    }
+
+    if (parser->command_trie) {
+        trie_free(parser->command_trie);
+    }
+
+    if (parser->command_vec) {
+        for (int i = 0; i < parser->command_vec->count; i++) {
+            ap_free(parser->command_vec->entries[i]);
+        }
+        vec_free(parser->command_vec);
+    }
+
+    if (parser->positional_args) {
+        vec_free(parser->positional_args);
+    }
+
+    free(parser->events);
+    free(parser);
+}
+
+
+static void ap_set_memory_error_flag(ArgParser* parser) {
+    parser->had_memory_error = true;
+
+    // A failure outside of a parse can leave the registered flags, options, and
+    // commands incomplete so, unlike a failure while parsing, it isn't cleared
+    // by ap_reset().
+    if (!parser->root_parser->in_parse) {
+        parser->root_parser->had_setup_memory_error = true;
+    }
+
+    ArgParser* parent = parser->parent;
+    while (parent) {
+        parent->had_memory_error = true;
+        parent = parent->parent;
+    }
+}
+
+
+// Frozen parsers are read-only. Attempting to modify one is a programming
+// error.
+static void ap_check_not_frozen(ArgParser* parser) {
+    if (parser->frozen_block) {
+        exit_with_error("cannot modify a frozen parser");
+    }
+}
+
+
+void ap_set_helptext(ArgParser* parser, const char* helptext) {
+    free(parser->helptext);
+    parser->helptext = NULL;
+
+    if (helptext) {
+        parser->helptext = str_dup(helptext);
+        if (!parser->helptext) {
+            ap_set_memory_error_flag(parser);
+        }
+    }
+}
+
+
+char* ap_get_helptext(ArgParser* parser) {
+    return parser->helptext;
+}
+
+
+void ap_set_version(ArgParser* parser, const char* version) {
+    free(parser->version);
+    parser->version = NULL;
+
+    if (version) {
+        parser->version = str_dup(version);
+        if (!parser->version) {
+            ap_set_memory_error_flag(parser);
+        }
+    }
+}
+
+
+char* ap_get_version(ArgParser* parser) {
+    return parser->version;
+}
+
+
+void ap_first_pos_arg_ends_option_parsing(ArgParser* parser) {
+    parser->first_pos_arg_ends_option_parsing = true;
+}
+
+
+void ap_all_args_as_pos_args(ArgParser* parser) {
+    parser->all_args_as_pos_args = true;
+}
+
+
+void ap_enable_abbreviations(ArgParser* parser, bool enable) {
+    parser->enable_abbreviations = enable;
+}
+
+
+void ap_bind_env_prefix(ArgParser* parser, const char* prefix) {
+    free(parser->env_prefix);
+    parser->env_prefix = NULL;
+
+    if (prefix != NULL) {
+        parser->env_prefix = str_dup(prefix);
+        if (!parser->env_prefix) {
+            ap_set_memory_error_flag(parser);
+        }
+    }
+}
+
+
+void ap_enable_exit_on_error(ArgParser* parser, bool enable) {
+    parser->root_parser->exit_on_error = enable;
+}
+
+
+void ap_enable_parse_order(ArgParser* parser, bool enable) {
+    parser->root_parser->record_parse_order = enable;
+}
+
+
+/* -------------------------------------- */
+/* ArgParser: register flags and options. */
+/* -------------------------------------- */
+
+
+// Returns false if the option couldn't be registered, in which case it has been
+// freed.
+static bool ap_register_option(ArgParser* parser, const char* name,
+    Option* opt) {
+    ap_check_not_frozen(parser);
+
+    if (!opt) {
+        ap_set_memory_error_flag(parser);
+        return false;
+    }
+
+    opt->index = parser->option_vec->count;
+
+    // A family's pattern isn't a name that can be typed, so it's kept out of
+    // the trie which serves abbreviations, completion, and name listings.
+    Trie* trie = opt->is_family ? NULL : parser->option_trie;
+
+    if (vec_add(parser->option_vec, opt)) {
+        if (index_splitkey(parser->option_map, trie, name, opt)) {
+            return true;
+        } else {
+            ap_set_memory_error_flag(parser);
+            parser->option_vec->count--;
+            option_free(opt);
+            return false;
+        }
+    } else {
+        ap_set_memory_error_flag(parser);
+        option_free(opt);
+        return false;
+    }
+}
+
+
+// Register a new flag.
+void ap_add_flag(ArgParser *parser, const char* name) {
+    Option* opt = option_new_flag();
+    ap_register_option(parser, name, opt);
+}
+
+
+// Register a new string-valued option.
+void ap_add_str_opt(ArgParser* parser, const char* name, const char* fallback) {
+    Option* opt = option_new_str((char*)fallback);
+    ap_register_option(parser, name, opt);
+}
+
+
+// Register a new greedy string-valued option.
+void ap_add_greedy_str_opt(ArgParser* parser, const char* name) {
+    Option* opt = option_new_str((char*)"");
+    if (opt) {
+        opt->is_greedy = true;
+    }
+    ap_register_option(parser, name, opt);
+}
+
+
+// Register a new integer-valued option.
+void ap_add_int_opt(ArgParser* parser, const char* name, int fallback) {
+    Option* opt = option_new_int(fallback);
+    ap_register_option(parser, name, opt);
+}
+
+
+// Register a new double-valued option.
+void ap_add_dbl_opt(ArgParser* parser, const char* name, double fallback) {
+    Option* opt = option_new_double(fallback);
+    ap_register_option(parser, name, opt);
+}
+
+
+// Register a new option whose value must be one of [choices]. The option's
+// value is the index of the matching name. The names are not copied and must
+// outlive the parser.
+void ap_add_choice_opt(ArgParser* parser, const char* name,
+    const char* choices[], int count, int fallback) {
+    int duplicate = choice_names_find_duplicate(choices, count);
+    if (duplicate != -1) {
+        exit_with_error("'%s' is registered more than once as a choice",
+            choices[duplicate]);
+    }
+    ChoiceSet* set = choice_set_new(choices, count);
+    Option* opt = set ? option_new_choice(set, fallback) : NULL;
+    ap_register_option(parser, name, opt);
+}
+
+
+// Shares a registered flag or option with all of the parser's descendant
+// commands. The commands look it up through their parent chain, so its values
+// accumulate in the single Option.
+void ap_set_global(ArgParser* parser, const char* name) {
+    ap_check_not_frozen(parser);
+    void* value;
+    if (!map_get(parser->option_map, name, &value)) {
+        exit_with_error("'%s' is not a registered flag or option name", name);
+    }
+    Option* opt = value;
+    if (!opt->is_global) {
+        opt->is_global = true;
+        parser->global_count++;
+    }
+}
+
+
+// Register a new set-valued option. Repeated values are only stored once.
+void ap_add_set_opt(ArgParser* parser, const char* name) {
+    Option* opt = option_new_indexed(OPT_SET);
+    ap_register_option(parser, name, opt);
+}
+
+
+// Register a new key-value option, e.g. '-D name=value'. If [reject_duplicates]
+// is true, defining the same key twice is an error; otherwise the last
+// definition wins.
+void ap_add_kv_opt(ArgParser* parser, const char* name,
+    bool reject_duplicates) {
+    Option* opt = option_new_indexed(OPT_KV);
+    if (opt) {
+        opt->rejects_duplicates = reject_duplicates;
+    }
+    ap_register_option(parser, name, opt);
+}
+
+
+// Adds [prefix] to the parser's family automaton. Returns false if memory
+// cannot be allocated.
+static bool ap_add_family_prefix(ArgParser* parser, const char* prefix,
+    Option* opt) {
+    if (!parser->family_trie) {
+        parser->family_trie = trie_new();
+        if (!parser->family_trie) {
+            return false;
+        }
+    }
+    return trie_set(parser->family_trie, prefix, opt);
+}
+
+
+// Register a family of string-valued options whose names match [pattern], e.g.
+// 'label-*'. The family is a key-value option keyed by the part of each name
+// matched by the '*'.
+void ap_add_str_family(ArgParser* parser, const char* pattern) {
+    size_t length = strlen(pattern);
+    if (length < 2 || pattern[length - 1] != '*' ||
+        strpbrk(pattern, " =") != NULL ||
+        strchr(pattern, '*') != pattern + length - 1) {
+        exit_with_error("'%s' is not a valid option family pattern", pattern);
+    }
+
+    Option* opt = option_new_indexed(OPT_KV);
+    if (opt) {
+        opt->is_family = true;
+    }
+    if (!ap_register_option(parser, pattern, opt)) {
+        return;
+    }
+
+    char* prefix = str_dup_n(pattern, length - 1);
+    if (!prefix || !ap_add_family_prefix(parser, prefix, opt)) {
+        ap_set_memory_error_flag(parser);
+    }
+    free(prefix);
+}
+
+
+// Returns the number of space-separated words in a key string.
+static int count_words(const char* key_string) {
+    int count = 0;
+    for (const char* c = key_string; *c != '\0'; c++) {
+        if (*c != ' ' && (c == key_string || *(c - 1) == ' ')) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+// Register an array of flags and options. The parser's tables are sized once up
+// front.
+void ap_add_options(ArgParser* parser, const ApOptionSpec specs[],
+    size_t count) {
+    int key_count = parser->option_map->count;
+    for (size_t i = 0; i < count; i++) {
+        key_count += count_words(specs[i].name);
+    }
+
+    if (!vec_reserve(parser->option_vec,
+        parser->option_vec->count + (int)count)) {
+        ap_set_memory_error_flag(parser);
+        return;
+    }
+
+    if (!map_reserve(parser->option_map, key_count)) {
+        ap_set_memory_error_flag(parser);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const ApOptionSpec* spec = &specs[i];
+        switch (spec->kind) {
+            case AP_FLAG:
+                ap_add_flag(parser, spec->name);
+                break;
+            case AP_STR_OPT:
+                ap_add_str_opt(parser, spec->name, spec->str_fallback);
+                break;
+            case AP_INT_OPT:
+                ap_add_int_opt(parser, spec->name, spec->int_fallback);
+                break;
+            case AP_DBL_OPT:
+                ap_add_dbl_opt(parser, spec->name, spec->dbl_fallback);
+                break;
+            case AP_GREEDY_STR_OPT:
+                ap_add_greedy_str_opt(parser, spec->name);
+                break;
+        }
+    }
+}
+
+
+// Reserves capacity in the parser's tables for the specified numbers of flags
+// and options, commands, and positional arguments.
+void ap_reserve(ArgParser* parser, int num_options, int num_commands,
+    int num_pos_args) {
+    bool ok = vec_reserve(parser->option_vec, num_options)
+        && map_reserve(parser->option_map, num_options)
+        && vec_reserve(parser->command_vec, num_commands)
+        && map_reserve(parser->command_map, num_commands)
+        && vec_reserve(parser->positional_args, num_pos_args);
+
+    if (!ok) {
+        ap_set_memory_error_flag(parser);
+    }
+}
+
+
+void ap_set_resolver(ArgParser* parser, ap_resolver_t resolver, void* context) {
+    parser->resolver = resolver;
+    parser->resolver_context = context;
+}
+
+
+/* ---------------------------------- */
+/* ArgParser: flag and option values. */
+/* ---------------------------------- */
+
+
+// Looks up the [name_len]-byte name among the global options registered on the
+// parser's ancestors. The nearest ancestor wins.
+static bool ap_find_global_opt(ArgParser* parser, const char* name,
+    size_t name_len, Option** option) {
+    for (ArgParser* ancestor = parser->parent; ancestor;
+        ancestor = ancestor->parent) {
+        if (ancestor->global_count > 0 &&
+            map_get_n(ancestor->option_map, name, name_len, (void**)option) &&
+            (*option)->is_global) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Looks up a flag or option name found in the arguments: the parser's own names
+// first, then the global options of its ancestors. A family's pattern, e.g.
+// 'label-*', only matches through the family itself so it isn't found here.
+static bool ap_find_arg_opt(ArgParser* parser, const char* name,
+    size_t name_len, Option** option) {
+    bool found =
+        map_get_n(parser->option_map, name, name_len, (void**)option) ||
+        ap_find_global_opt(parser, name, name_len, option);
+    return found && !(*option)->is_family;
+}
+
+
+// Returns true if any of the parser's ancestors has global options.
+static bool ap_inherits_globals(ArgParser* parser) {
+    for (ArgParser* ancestor = parser->parent; ancestor;
+        ancestor = ancestor->parent) {
+        if (ancestor->global_count > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static int compare_str_ptrs(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+// Appends the long-form names in scope for the parser that begin with
+// [prefix] to [names] in sorted order: its own names and the names of its
+// ancestors' global options. Each name is collected once and resolves as an
+// exact lookup would, so a global shadowed by a nearer name is skipped.
+// Returns false if memory cannot be allocated.
+static bool ap_collect_opt_names(ArgParser* parser, const char* prefix,
+    Vec* names) {
+    int start = names->count;
+    for (ArgParser* p = parser; p; p = p->parent) {
+        TrieNode* node = trie_find_prefix(p->option_trie, prefix);
+        if (!node || (p != parser && p->global_count == 0)) {
+            continue;
+        }
+
+        int first = names->count;
+        if (!trie_node_collect(node, names)) {
+            return false;
+        }
+
+        // Keep the names that resolve to an option and weren't already found.
+        int kept = first;
+        for (int i = first; i < names->count; i++) {
+            char* name = names->entries[i];
+            Option* opt;
+            if (!ap_find_arg_opt(parser, name, strlen(name), &opt)) {
+                continue;
+            }
+            bool seen = false;
+            for (int j = start; j < first && !seen; j++) {
+                seen = strcmp(names->entries[j], name) == 0;
+            }
+            if (!seen) {
+                names->entries[kept++] = name;
+            }
+        }
+        names->count = kept;
+    }
+
+    void** entries = names->entries + start;
+    qsort(entries, (size_t)(names->count - start), sizeof(char*),
+        compare_str_ptrs);
+    return true;
+}
+
+
+// Returns the option every name in [names] resolves to, or NULL if there are
+// no names or they resolve to more than one option.
+static Option* ap_common_opt(ArgParser* parser, Vec* names) {
+    Option* common = NULL;
+    for (int i = 0; i < names->count; i++) {
+        char* name = names->entries[i];
+        Option* opt;
+        ap_find_arg_opt(parser, name, strlen(name), &opt);
+        if (common && common != opt) {
+            return NULL;
+        }
+        common = opt;
+    }
+    return common;
+}
+
+
+// Returns the flag or option name closest to the misspelt [name_len]-byte
+// [name], or NULL. The parser's own names, the global options of its ancestors,
+// and --help and --version when enabled are all candidates. If [own_only] is
+// true, only the parser's own long-form names are.
+static const char* ap_suggest_opt_name(ArgParser* parser, const char* name,
+    size_t name_len, bool own_only) {
+    Suggester suggester;
+    if (!suggester_init(&suggester, name, name_len)) {
+        return NULL;
+    }
+
+    for (ArgParser* p = parser; p; p = own_only ? NULL : p->parent) {
+        if (p != parser && p->global_count == 0) {
+            continue;
+        }
+        for (int i = 0; i < p->option_map->capacity; i++) {
+            MapEntry* entry = &p->option_map->entries[i];
+            Option* opt = entry->value;
+            if (entry->key == NULL || opt->is_family ||
+                (p != parser && !opt->is_global) ||
+                (own_only && entry->key_len < 2)) {
+                continue;
+            }
+            suggester_consider(&suggester, entry->key, entry->key_len);
+        }
+    }
+
+    if (own_only) {
+        return suggester.best_key;
+    }
+    if (parser->helptext) {
+        suggester_consider(&suggester, "help", 4);
+    }
+    if (parser->version) {
+        suggester_consider(&suggester, "version", 7);
+    }
+
+    return suggester.best_key;
+}
+
+
+// Returns the dashes to print before a suggested name.
+static const char* opt_name_prefix(const char* name) {
+    return strlen(name) == 1 ? "-" : "--";
+}
+
+
+// Retrieve an Option instance by name.
+static Option* ap_get_opt(ArgParser* parser, const char* name) {
+    Option* opt;
+    if (!map_get(parser->option_map, name, (void**)&opt) &&
+        !ap_find_global_opt(parser, name, strlen(name), &opt)) {
+        exit_with_error("'%s' is not a registered flag or option name", name);
+    }
+    return opt;
+}
+
+
+// Returns the number of times the specified flag or option was found.
+int ap_count(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_opt(parser, name);
+    return opt->count;
+}
+
+
+// Returns true if the specified flag or option was found.
+bool ap_found(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_opt(parser, name);
+    return opt->count > 0;
+}
+
+
+// Returns true if the option's values can be read as [type]. Each type of
+// option stores its values in an array of its own element type, so a getter
+// for a different type would read the array at the wrong element size. Set,
+// key-value, and choice options can also be read as strings, and choice
+// options as integers.
+static bool option_is_readable_as(Option* opt, OptionType type) {
+    if (type == OPT_STR) {
+        return option_has_str_values(opt) || opt->type == OPT_CHOICE;
+    }
+    if (type == OPT_INT) {
+        return opt->type == OPT_INT || opt->type == OPT_CHOICE;
+    }
+    return opt->type == type;
+}
+
+
+// Returns the named option. Exits with an error if its values can't be read as
+// [type].
+static Option* ap_get_typed_opt(ArgParser* parser, const char* name,
+    OptionType type) {
+    Option* opt = ap_get_opt(parser, name);
+    if (!option_is_readable_as(opt, type)) {
+        exit_with_error("'%s' is not an option of the requested type", name);
+    }
+    return opt;
+}
+
+
+// Returns the value of the specified string option.
+char* ap_get_str_value(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_STR);
+    return (char*)option_get_str(opt);
+}
+
+
+// Returns the string value at the specified index.
+char* ap_get_str_value_at_index(ArgParser* parser, const char* name, int index) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_STR);
+    if (opt->type == OPT_CHOICE) {
+        return option_choice_name(opt, opt->values.int_vals[index]);
+    }
+    return opt->values.str_vals[index];
+}
+
+
+// Returns the value of the specified integer option.
+int ap_get_int_value(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_INT);
+    return option_get_int(opt);
+}
+
+
+// Returns the integer value at the specified index.
+int ap_get_int_value_at_index(ArgParser* parser, const char* name, int index) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_INT);
+    return opt->values.int_vals[index];
+}
+
+
+// Returns the value of the specified floating-point option.
+double ap_get_dbl_value(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_DBL);
+    return option_get_double(opt);
+}
+
+
+// Returns the floating-point value at the specified index.
+double ap_get_dbl_value_at_index(ArgParser* parser, const char* name, int index) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_DBL);
+    return opt->values.dbl_vals[index];
+}
+
+
+// Returns the index of the specified choice option's value in its list of
+// choices. Exits with an error if the option isn't a choice option.
+int ap_get_choice(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_opt(parser, name);
+    if (opt->type != OPT_CHOICE) {
+        exit_with_error("'%s' is not an option of the requested type", name);
+    }
+    return option_get_int(opt);
+}
+
+
+// Returns the choice index at the specified index. Exits with an error if the
+// option isn't a choice option.
+int ap_get_choice_at_index(ArgParser* parser, const char* name, int index) {
+    Option* opt = ap_get_opt(parser, name);
+    if (opt->type != OPT_CHOICE) {
+        exit_with_error("'%s' is not an option of the requested type", name);
+    }
+    return opt->values.int_vals[index];
+}
+
+
+// Returns the name of the specified choice option's value, or NULL if the
+// fallback index doesn't name a choice. Exits with an error if the option isn't
+// a choice option.
+const char* ap_get_choice_name(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_opt(parser, name);
+    if (opt->type != OPT_CHOICE) {
+        exit_with_error("'%s' is not an option of the requested type", name);
+    }
+    return option_get_str(opt);
+}
+
+
+// Returns true if [key] is one of the set option's values.
+bool ap_set_contains(ArgParser* parser, const char* name, const char* key) {
+    Option* opt = ap_get_opt(parser, name);
+    if (opt->type != OPT_SET) {
+        exit_with_error("'%s' is not an option of the requested type", name);
+    }
+    void* value;
+    return map_get(opt->lookup, key, &value);
+}
+
+
+// Returns the value defined for [key] by the key-value option, or NULL if [key]
+// wasn't defined.
+const char* ap_get_kv(ArgParser* parser, const char* name, const char* key) {
+    Option* opt = ap_get_opt(parser, name);
+    if (opt->type != OPT_KV) {
+        exit_with_error("'%s' is not an option of the requested type", name);
+    }
+    void* value;
+    return map_get(opt->lookup, key, &value) ? value : NULL;
+}
+
+
+// Returns an option's values as a freshly-allocated array of string pointers.
+// The array's memory is not affected by calls to ap_free().
+// Returns NULL if memory cannot be allocated for the array.
+char** ap_get_str_values(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_STR);
+    return (char**)option_get_str_list(opt);
+}
+
+
+// Returns an option's values as a freshly-allocated array of integers. The
+// array's memory is not affected by calls to ap_free().
+// Returns NULL if memory cannot be allocated for the array.
+int* ap_get_int_values(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_INT);
+    return option_get_int_list(opt);
+}
+
+
+// Returns an option's values as a freshly-allocated array of doubles. The
+// array's memory is not affected by calls to ap_free().
+// Returns NULL if memory cannot be allocated for the array.
+double* ap_get_dbl_values(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_typed_opt(parser, name, OPT_DBL);
+    return option_get_double_list(opt);
+}
+
+
+// Returns a pointer to the option's internal array of values and sets [count]
+// to its length. Exits with an error if the option isn't of type [type].
+static void* ap_view_values(ArgParser* parser, const char* name,
+    OptionType type, int* count) {
+    Option* opt = ap_get_opt(parser, name);
+    if (opt->type != type) {
+        exit_with_error("'%s' is not an option of the requested type", name);
+    }
+    *count = opt->count;
+    return opt->count > 0 ? opt->values.data : NULL;
+}
+
+
+// Returns a pointer to the string option's internal array of values without
+// copying.
+char** ap_view_str_values(ArgParser* parser, const char* name, int* count) {
+    return ap_view_values(parser, name, OPT_STR, count);
+}
+
+
+// Returns a pointer to the integer option's internal array of values without
+// copying.
+int* ap_view_int_values(ArgParser* parser, const char* name, int* count) {
+    return ap_view_values(parser, name, OPT_INT, count);
+}
+
+
+// Returns a pointer to the set option's internal array of distinct values
+// without copying.
+char** ap_view_set_values(ArgParser* parser, const char* name, int* count) {
+    return ap_view_values(parser, name, OPT_SET, count);
+}
+
+
+// Returns a pointer to the floating-point option's internal array of values
+// without copying.
+double* ap_view_dbl_values(ArgParser* parser, const char* name, int* count) {
+    return ap_view_values(parser, name, OPT_DBL, count);
+}
+
+
+// Returns the registered flag and option names in sorted order as a
+// freshly-allocated, NULL-terminated array of string pointers. Returns NULL if
+// memory cannot be allocated for the array.
+char** ap_get_opt_names(ArgParser* parser) {
+    return trie_get_keys(parser->option_trie, "");
+}
+
+
+/* ------------------------------ */
+/* ArgParser: option namespaces. */
+/* ------------------------------ */
+
+
+// A namespace caches the hash of its 'prefix.' so each lookup only hashes the
+// remaining name.
+ApNamespace ap_get_namespace(ArgParser* parser, const char* prefix) {
+    size_t prefix_len = strlen(prefix);
+    return (ApNamespace){
+        .parser = parser,
+        .prefix = prefix,
+        .prefix_len = prefix_len,
+        .prefix_hash = str_hash_extend(str_hash_n(prefix, prefix_len), ".", 1),
+    };
+}
+
+
+// Returns the option named '[prefix].[name]', exiting with an error if there's
+// no such option. Global options inherited from the parser's ancestors are
+// found as for ap_get_opt().
+static Option* ap_ns_get_opt(ApNamespace ns, const char* name) {
+    size_t name_len = strlen(name);
+    uint32_t key_hash = str_hash_extend(ns.prefix_hash, name, name_len);
+    for (ArgParser* parser = ns.parser; parser; parser = parser->parent) {
+        Map* map = parser->option_map;
+        if (map->count == 0 ||
+            (parser != ns.parser && parser->global_count == 0)) {
+            continue;
+        }
+        MapEntry* entry = map_find_dotted(map, ns.prefix, ns.prefix_len, name,
+            name_len, key_hash);
+        if (entry->key != NULL &&
+            (parser == ns.parser || ((Option*)entry->value)->is_global)) {
+            return entry->value;
+        }
+    }
+    exit_with_error("'%s.%s' is not a registered flag or option name",
+        ns.prefix, name);
+    return NULL;
+}
+
+
+// Returns the names in the namespace, at any depth, in sorted order. The option
+// trie is ordered so this only visits the namespace's own subtree. Inherited
+// global options in the namespace are merged in from their parsers' tries.
+char** ap_get_namespace_names(ApNamespace ns) {
+    char* prefix = str("%s.", ns.prefix);
+    if (!prefix) {
+        return NULL;
+    }
+    if (!ap_inherits_globals(ns.parser)) {
+        char** names = trie_get_keys(ns.parser->option_trie, prefix);
+        free(prefix);
+        return names;
+    }
+
+    Vec* names = vec_new();
+    bool ok = names && ap_collect_opt_names(ns.parser, prefix, names) &&
+        vec_add(names, NULL);
+    free(prefix);
+    if (!ok) {
+        vec_free(names);
+        return NULL;
+    }
+    char** keys = (char**)names->entries;
+    free(names);
+    return keys;
+}
+
+
+int ap_ns_count(ApNamespace ns, const char* name) {
+    return ap_ns_get_opt(ns, name)->count;
+}
+
+
+// Returns the option named '[prefix].[name]'. Exits with an error if its values
+// can't be read as [type].
+static Option* ap_ns_get_typed_opt(ApNamespace ns, const char* name,
+    OptionType type) {
+    Option* opt = ap_ns_get_opt(ns, name);
+    if (!option_is_readable_as(opt, type)) {
+        exit_with_error("'%s.%s' is not an option of the requested type",
+            ns.prefix, name);
+    }
+    return opt;
+}
+
+
+char* ap_ns_get_str_value(ApNamespace ns, const char* name) {
+    return option_get_str(ap_ns_get_typed_opt(ns, name, OPT_STR));
+}
+
+
+int ap_ns_get_int_value(ApNamespace ns, const char* name) {
+    return option_get_int(ap_ns_get_typed_opt(ns, name, OPT_INT));
+}
+
+
+double ap_ns_get_dbl_value(ApNamespace ns, const char* name) {
+    return option_get_double(ap_ns_get_typed_opt(ns, name, OPT_DBL));
+}
+
+
+/* -------------------------------- */
+/* ArgParser: positional arguments. */
+/* -------------------------------- */
+
+
+// Returns true if the parser has found one or more positional arguments.
+bool ap_has_args(ArgParser* parser) {
+    return parser->positional_args->count > 0;
+}
+
+
+// Returns the number of positional arguments.
+int ap_count_args(ArgParser* parser) {
+    return parser->positional_args->count;
+}
+
+
+// Returns the positional argument at the specified index.
+char* ap_get_arg_at_index(ArgParser* parser, int index) {
+    return (char*)parser->positional_args->entries[index];
+}
+
+
+// Returns the positional arguments as a freshly-allocated array of string
+// pointers. The memory occupied by the returned array is not affected by
+// calls to ap_free().
+// Returns NULL if memory cannot be allocated for the array.
+char** ap_get_args(ArgParser* parser) {
+    int count = ap_count_args(parser);
+    char** args = malloc(sizeof(char*) * count);
+    if (!args) {
+        return NULL;
+    }
+    memcpy(args, parser->positional_args->entries, sizeof(char*) * count);
+    return args;
+}
+
+
+// Returns a pointer to the parser's internal array of positional arguments
+// without copying.
+char** ap_view_args(ArgParser* parser, int* count) {
+    *count = parser->positional_args->count;
+    return *count > 0 ? (char**)parser->positional_args->entries : NULL;
+}
+
+
+// Attempts to parse and return the positional arguments as a freshly
+// allocated array of integers. Exits with an error message on failure. The
+// memory occupied by the returned array is not affected by calls to
+// ap_free().
+// Returns NULL if memory cannot be allocated for the array.
+int* ap_get_args_as_ints(ArgParser* parser) {
+    int count = ap_count_args(parser);
+    int* args = malloc(sizeof(int) * count);
+    if (!args) {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        *(args + i) = try_str_to_int(parser->positional_args->entries[i]);
+    }
+    return args;
+}
+
+
+// Attempts to parse and return the positional arguments as a freshly
+// allocated array of doubles. Exits with an error message on failure. The
+// memory occupied by the returned array is not affected by calls to
+// ap_free().
+// Returns NULL if memory cannot be allocated for the array.
+double* ap_get_args_as_doubles(ArgParser* parser) {
+    int count = ap_count_args(parser);
+    double *args = malloc(sizeof(double) * count);
+    if (!args) {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        *(args + i) = try_str_to_double(parser->positional_args->entries[i]);
+    }
+    return args;
+}
+
+
+/* -------------------- */
+/* ArgParser: commands. */
+/* -------------------- */
+
+
+ArgParser* ap_new_cmd(ArgParser* parent_parser, const char* name) {
+    ap_check_not_frozen(parent_parser);
+
+    ArgParser* cmd_parser = ap_new_parser();
+    if (!cmd_parser) {
+        return NULL;
+    }
+
+    cmd_parser->root_parser = parent_parser->root_parser;
+    cmd_parser->parent = parent_parser;
+
+    if (vec_add(parent_parser->command_vec, cmd_parser)) {
+        if (index_splitkey(parent_parser->command_map,
+            parent_parser->command_trie, name, cmd_parser)) {
+            parent_parser->enable_help_command = true;
+            return cmd_parser;
+        } else {
+            parent_parser->command_vec->count--;
+            ap_free(cmd_parser);
+            return NULL;
+        }
+    } else {
+        ap_free(cmd_parser);
+        return NULL;
+    }
+}
+
+
+void ap_set_cmd_callback(ArgParser* cmd_parser, ap_callback_t cmd_callback) {
+    cmd_parser->cmd_callback = cmd_callback;
+}
+
+
+bool ap_found_cmd(ArgParser* parent_parser) {
+    return parent_parser->cmd_name != NULL;
+}
+
+
+char* ap_get_cmd_name(ArgParser* parent_parser) {
+    return parent_parser->cmd_name;
+}
+
+
+ArgParser* ap_get_cmd_parser(ArgParser* parent_parser) {
+    return parent_parser->cmd_parser;
+}
+
+
+int ap_get_cmd_exit_code(ArgParser* parent_parser) {
+    return parent_parser->cmd_callback_exit_code;
+}
+
+
+void ap_enable_help_command(ArgParser* parent_parser, bool enable) {
+    parent_parser->enable_help_command = enable;
+}
+
+
+ArgParser* ap_get_parent(ArgParser* parser) {
+    return parser->parent;
+}
+
+
+void ap_enable_cmd_chaining(ArgParser* parent_parser, const char* separator) {
+    free(parent_parser->chain_separator);
+    parent_parser->chain_separator = NULL;
+
+    if (separator == NULL) {
+        return;
+    }
+
+    if (!parent_parser->chained_cmds) {
+        parent_parser->chained_cmds = vec_new();
+        if (!parent_parser->chained_cmds) {
+            ap_set_memory_error_flag(parent_parser);
+            return;
+        }
+    }
+
+    parent_parser->chain_separator = str_dup(separator);
+    if (!parent_parser->chain_separator) {
+        ap_set_memory_error_flag(parent_parser);
+    }
+}
+
+
+int ap_count_chained_cmds(ArgParser* parent_parser) {
+    return parent_parser->chained_cmds ? parent_parser->chained_cmds->count : 0;
+}
+
+
+char* ap_get_chained_cmd_name(ArgParser* parent_parser, int index) {
+    ChainedCmd* link = parent_parser->chained_cmds->entries[index];
+    return link->name;
+}
+
+
+ArgParser* ap_get_chained_cmd_parser(ArgParser* parent_parser, int index) {
+    ChainedCmd* link = parent_parser->chained_cmds->entries[index];
+    return link->parser;
+}
+
+
+int ap_get_chained_cmd_exit_code(ArgParser* parent_parser, int index) {
+    ChainedCmd* link = parent_parser->chained_cmds->entries[index];
+    return link->exit_code;
+}
+
+
+ArgParser* ap_lookup_cmd(ArgParser* parent_parser, const char* name) {
+    void* cmd_parser;
+    if (map_get(parent_parser->command_map, name, &cmd_parser)) {
+        return cmd_parser;
+    }
+    return NULL;
+}
+
+
+char** ap_get_cmd_names(ArgParser* parent_parser) {
+    return trie_get_keys(parent_parser->command_trie, "");
+}
+
+
+/* ------------------------------- */
+/* ArgParser: option constraints. */
+/* ------------------------------- */
+
+
+// Returns the parser's own flag or option with the specified name. The
+// constraint tables only cover the parser's own options, so a global option
+// inherited from an ancestor is rejected.
+static Option* ap_get_constraint_opt(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_opt(parser, name);
+    Vec* options = parser->option_vec;
+    if (opt->index >= options->count || options->entries[opt->index] != opt) {
+        exit_with_error("constraints cannot name '%s', a global option of a "
+            "parent parser", name);
+    }
+    return opt;
+}
+
+
+static void ap_add_constraint(ArgParser* parser, ConstraintKind kind,
+    const char* name, const char* other) {
+    ap_check_not_frozen(parser);
+
+    Option* opt = ap_get_constraint_opt(parser, name);
+    Option* other_opt = other ? ap_get_constraint_opt(parser, other) : opt;
+    ConstraintSet* constraints = &parser->constraints;
+
+    if (constraints->count == constraints->capacity) {
+        int new_capacity =
+            constraints->capacity < 4 ? 4 : constraints->capacity * 2;
+        Constraint* new_rules =
+            realloc(constraints->rules, sizeof(Constraint) * new_capacity);
+        if (!new_rules) {
+            ap_set_memory_error_flag(parser);
+            return;
+        }
+        constraints->rules = new_rules;
+        constraints->capacity = new_capacity;
+    }
+
+    constraints->rules[constraints->count++] =
+        (Constraint){kind, opt->index, other_opt->index};
+
+    // Any compiled tables are now stale.
+    free(constraints->required);
+    constraints->required = NULL;
+    constraints->words = 0;
+}
+
+
+void ap_set_required(ArgParser* parser, const char* name) {
+    ap_add_constraint(parser, CONSTRAINT_REQUIRED, name, NULL);
+}
+
+
+void ap_add_requires(ArgParser* parser, const char* name, const char* other) {
+    ap_add_constraint(parser, CONSTRAINT_REQUIRES, name, other);
+}
+
+
+void ap_add_conflicts(ArgParser* parser, const char* name, const char* other) {
+    ap_add_constraint(parser, CONSTRAINT_CONFLICTS, name, other);
+}
+
+
+// Compiles the rules into bitmasks. Every option with a requires- or
+// conflicts-rule gets a single row, however many rules name it. Returns false
+// if memory cannot be allocated.
+static bool ap_compile_constraints(ArgParser* parser) {
+    ConstraintSet* constraints = &parser->constraints;
+    int option_count = parser->option_vec->count;
+    int words = (option_count + 63) / 64;
+
+    int* rows_by_option =
+        malloc(sizeof(int) * (option_count > 0 ? option_count : 1));
+    if (!rows_by_option) {
+        return false;
+    }
+    for (int i = 0; i < option_count; i++) {
+        rows_by_option[i] = -1;
+    }
+
+    int row_count = 0;
+    for (int i = 0; i < constraints->count; i++) {
+        Constraint* rule = &constraints->rules[i];
+        if (rule->kind != CONSTRAINT_REQUIRED &&
+            rows_by_option[rule->index] == -1) {
+            rows_by_option[rule->index] = row_count++;
+        }
+    }
+
+    size_t mask_count = (size_t)2 + 2 * (size_t)row_count;
+    uint64_t* block = calloc(1, sizeof(uint64_t) * words * mask_count +
+        sizeof(int) * (row_count > 0 ? row_count : 1));
+    if (!block) {
+        free(rows_by_option);
+        return false;
+    }
+
+    constraints->words = words;
+    constraints->row_count = row_count;
+    constraints->required = block;
+    constraints->found = block + words;
+    constraints->rows = block + 2 * words;
+    constraints->row_index = (int*)(block + words * mask_count);
+
+    for (int i = 0; i < option_count; i++) {
+        if (rows_by_option[i] != -1) {
+            constraints->row_index[rows_by_option[i]] = i;
+        }
+    }
+
+    for (int i = 0; i < constraints->count; i++) {
+        Constraint* rule = &constraints->rules[i];
+        uint64_t bit = (uint64_t)1 << (rule->other % 64);
+        if (rule->kind == CONSTRAINT_REQUIRED) {
+            constraints->required[rule->other / 64] |= bit;
+        } else {
+            uint64_t* row = constraints->rows +
+                (size_t)2 * words * rows_by_option[rule->index];
+            if (rule->kind == CONSTRAINT_CONFLICTS) {
+                row += words;
+            }
+            row[rule->other / 64] |= bit;
+        }
+    }
+
+    free(rows_by_option);
+    return true;
+}
+
+
+/* --------------------------- */
+/* ArgParser: parse arguments. */
+/* --------------------------- */
+
+
+// Returns true if parsing has halted, i.e. if an error has been reported or if
+// the automatic --help or --version flag has been handled and exit-on-error is
+// disabled.
+static bool ap_halted(ArgParser* parser) {
+    return parser->root_parser->halted;
+}
+
+
+// Halts parsing. By default this simply exits. If exit-on-error has been
+// disabled, it sets a flag on the root parser instead and the argument stream
+// is abandoned.
+static void ap_halt(ArgParser* parser, int status) {
+    if (parser->root_parser->exit_on_error) {
+        exit(status);
+    }
+    parser->root_parser->halted = true;
+}
+
+
+// Reports an invalid argument. By default this prints an error message and
+// exits. If exit-on-error has been disabled, the message is stored on the root
+// parser instead and parsing halts. Only the first error is recorded.
+static void ap_error(ArgParser* parser, const char* format_string, ...) {
+    ArgParser* root = parser->root_parser;
+    if (root->halted) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format_string);
+    if (root->exit_on_error) {
+        fprintf(stderr, "error: ");
+        if (root->error_context) {
+            fprintf(stderr, "%.*s: ", root->error_context_len,
+                root->error_context);
+        }
+        vfprintf(stderr, format_string, args);
+        fprintf(stderr, "\n");
+        va_end(args);
+        exit(1);
+    }
+    root->error_message = vstr(format_string, args);
+    va_end(args);
+
+    // Prefix the message with the source of the value, e.g. the environment
+    // variable's name.
+    if (root->error_message && root->error_context) {
+        char* message = root->error_message;
+        root->error_message = str("%.*s: %s", root->error_context_len,
+            root->error_context, message);
+        free(message);
+    }
+
+    if (!root->error_message) {
+        ap_set_memory_error_flag(parser);
+    }
+    root->halted = true;
+}
+
+
+// Appends an event to the parser's event log if parse order is being recorded.
+// [opt] is NULL for a positional argument.
+static void ap_record_event(ArgParser* parser, Option* opt, char* value,
+    int argv_index) {
+    if (!parser->root_parser->record_parse_order) {
+        return;
+    }
+
+    if (parser->event_count == parser->event_capacity) {
+        int new_capacity =
+            parser->event_capacity < 16 ? 16 : parser->event_capacity * 2;
+        ParseEvent* new_events =
+            realloc(parser->events, sizeof(ParseEvent) * new_capacity);
+        if (!new_events) {
+            ap_set_memory_error_flag(parser);
+            return;
+        }
+        parser->events = new_events;
+        parser->event_capacity = new_capacity;
+    }
+
+    // A global option belongs to one of the parser's ancestors.
+    int depth = 0;
+    if (opt && opt->is_global) {
+        ArgParser* owner = parser;
+        while (opt->index >= owner->option_vec->count ||
+            owner->option_vec->entries[opt->index] != opt) {
+            owner = owner->parent;
+            depth++;
+        }
+    }
+
+    parser->events[parser->event_count++] =
+        (ParseEvent){value, opt ? opt->index : -1, depth, argv_index};
+}
+
+
+// Appends a positional argument which has just been read from the stream.
+static void ap_add_pos_arg(ArgParser* parser, char* arg, ArgStream* stream) {
+    if (!vec_add(parser->positional_args, arg)) {
+        ap_set_memory_error_flag(parser);
+        return;
+    }
+    ap_record_event(parser, NULL, arg, stream->offset + stream->index - 1);
+}
+
+
+// Attempts to convert [arg] to the option's type and append it to the option's
+// list of values. Returns false if the value is invalid or memory allocation
+// fails.
+static bool ap_try_set_opt(ArgParser* parser, Option* opt, char* arg) {
+    OptionValue value;
+    const char* error = NULL;
+
+    if (opt->type == OPT_STR || opt->type == OPT_SET) {
+        value.str_val = arg;
+    } else if (opt->type == OPT_KV) {
+        value.str_val = arg;
+        void* existing;
+        if (opt->rejects_duplicates &&
+            map_get_n(opt->lookup, arg, kv_key_len(arg), &existing)) {
+            ap_error(parser, "'%.*s' is defined more than once",
+                (int)kv_key_len(arg), arg);
+            return false;
+        }
+    } else if (opt->type == OPT_INT) {
+        error = str_to_int(arg, &value.int_val);
+    } else if (opt->type == OPT_DBL) {
+        error = str_to_double(arg, &value.dbl_val);
+    } else if (opt->type == OPT_CHOICE) {
+        value.int_val = choice_set_find(opt->choices, arg);
+        if (value.int_val == -1) {
+            char* list = choice_set_list(opt->choices);
+            if (list) {
+                ap_error(parser,
+                    "'%s' is not a valid choice; expected one of: %s", arg,
+                    list);
+                free(list);
+            } else {
+                ap_set_memory_error_flag(parser);
+            }
+            return false;
+        }
+    } else {
+        assert(false);
+    }
+
+    if (error) {
+        ap_error(parser, error, arg);
+        return false;
+    }
+
+    if (!option_append_value(opt, value)) {
+        ap_set_memory_error_flag(parser);
+        return false;
+    }
+    return true;
+}
+
+
+// Sets an option from a value which has just been read from the stream and
+// records the event.
+static void ap_set_opt_from_stream(ArgParser* parser, Option* opt, char* arg,
+    ArgStream* stream) {
+    if (ap_try_set_opt(parser, opt, arg)) {
+        ap_record_event(parser, opt, arg, stream->offset + stream->index - 1);
+    }
+}
+
+
+// Reports an ambiguous abbreviation, listing the NULL-terminated [candidates]
+// if not NULL.
+static void ap_ambiguous_error(ArgParser* parser, const char* prefix,
+    const char* name, char** candidates) {
+    if (!candidates) {
+        ap_error(parser, "%s%s is ambiguous", prefix, name);
+        return;
+    }
+
+    char* list = str_dup("");
+    for (int i = 0; list && candidates[i]; i++) {
+        char* old_list = list;
+        list = str(i == 0 ? "%s%s%s" : "%s, %s%s", old_list, prefix,
+            candidates[i]);
+        free(old_list);
+    }
+
+    ap_error(parser, "%s%s is ambiguous, could be: %s", prefix, name,
+        list ? list : "");
+    free(list);
+}
+
+
+// Resolves [name] as an abbreviation, i.e. as a unique prefix of a key in
+// [trie]. Returns the matching value and sets [key] to the full key, or returns
+// NULL if no key begins with [name]. Reports an error listing the candidates if
+// the abbreviation is ambiguous.
+static void* ap_resolve_abbreviation(ArgParser* parser, Trie* trie,
+    const char* prefix, const char* name, char** key) {
+    TrieNode* node = trie_find_prefix(trie, name);
+    if (!node || !node->subtree_value) {
+        return NULL;
+    }
+
+    if (node->subtree_value != TRIE_AMBIGUOUS) {
+        while (!node->key) {
+            node = node->children[0];
+        }
+        *key = node->key;
+        return node->subtree_value;
+    }
+
+    char** candidates = trie_get_keys(trie, name);
+    ap_ambiguous_error(parser, prefix, name, candidates);
+    free(candidates);
+    return NULL;
+}
+
+
+// Resolves [name] as an abbreviation of a long-form flag or option name.
+// Inherited global options are candidates alongside the parser's own names.
+// Without any globals in scope this is a single lookup in the parser's trie.
+// Each candidate name resolves as an exact lookup would, so a global shadowed
+// by a nearer name isn't counted separately. Returns NULL if no name in scope
+// begins with [name]; reports an error listing the candidates if the
+// abbreviation is ambiguous.
+static Option* ap_resolve_opt_abbreviation(ArgParser* parser,
+    const char* name) {
+    char* key;
+    if (!ap_inherits_globals(parser)) {
+        return ap_resolve_abbreviation(parser, parser->option_trie, "--", name,
+            &key);
+    }
+
+    Vec* keys = vec_new();
+    if (!keys) {
+        ap_set_memory_error_flag(parser);
+        return NULL;
+    }
+
+    if (!ap_collect_opt_names(parser, name, keys)) {
+        vec_free(keys);
+        ap_set_memory_error_flag(parser);
+        return NULL;
+    }
+
+    Option* match = ap_common_opt(parser, keys);
+    if (!match && keys->count > 0) {
+        char** candidates = vec_add(keys, NULL) ? (char**)keys->entries : NULL;
+        ap_ambiguous_error(parser, "--", name, candidates);
+    }
+
+    vec_free(keys);
+    return match;
+}
+
+
+// Passes an unrecognised flag or option name to the parser's resolver, if it
+// has one, then looks the name up again in case the resolver registered it.
+// [name] must be a terminated string.
+static bool ap_resolve_opt(ArgParser* parser, const char* name,
+    Option** option) {
+    // A frozen parser can't register names, so its resolver is skipped rather
+    // than left to exit.
+    if (!parser->resolver || parser->frozen_block) {
+        return false;
+    }
+    parser->resolver(parser, name, parser->resolver_context);
+    return ap_find_arg_opt(parser, name, strlen(name), option);
+}
+
+
+// Looks up a long-form flag or option name. If the name isn't registered, the
+// parser's resolver gets a chance to register it. If abbreviations are enabled,
+// [name] can be any unique prefix of a registered name.
+static bool ap_find_long_opt(ArgParser* parser, const char* name,
+    Option** option) {
+    if (ap_find_arg_opt(parser, name, strlen(name), option)) {
+        return true;
+    }
+
+    // The automatic --help and --version flags take precedence over
+    // abbreviations.
+    if (strcmp(name, "help") == 0 && parser->helptext != NULL) {
+        return false;
+    }
+    if (strcmp(name, "version") == 0 && parser->version != NULL) {
+        return false;
+    }
+
+    if (ap_resolve_opt(parser, name, option)) {
+        return true;
+    }
+
+    if (parser->enable_abbreviations) {
+        *option = ap_resolve_opt_abbreviation(parser, name);
+        return *option != NULL;
+    }
+
+    return false;
+}
+
+
+// Looks up a command name. If abbreviations are enabled, [name] can be any
+// unique prefix of a registered command name, in which case [name] is updated
+// to point to the full name.
+static bool ap_find_cmd(ArgParser* parser, char** name,
+    ArgParser** cmd_parser) {
+    if (map_get(parser->command_map, *name, (void**)cmd_parser)) {
+        return true;
+    }
+
+    // The automatic 'help' command takes precedence over abbreviations.
+    if (strcmp(*name, "help") == 0 && parser->enable_help_command) {
+        return false;
+    }
+
+    if (parser->enable_abbreviations) {
+        *cmd_parser = ap_resolve_abbreviation(parser, parser->command_trie, "",
+            *name, name);
+        return *cmd_parser != NULL;
+    }
+
+    return false;
+}
+
+
+// Matches [arg] -- a long-form name, possibly followed by '=value' -- against
+// the parser's option families. The name's longest matching family prefix is
+// found in a single pass over the name. The remainder of the argument, e.g.
+// 'env=prod' for '--label-env=prod', is stored as a key-value definition.
+// Returns false if no family matches. The pattern itself, e.g. '--label-*',
+// doesn't match.
+static bool ap_handle_family_opt(ArgParser* parser, const char* arg,
+    int arg_index) {
+    size_t name_len = kv_key_len(arg);
+    size_t prefix_len = 0;
+    Option* family =
+        trie_match_longest(parser->family_trie, arg, name_len, &prefix_len);
+    if (!family || prefix_len == name_len ||
+        (prefix_len + 1 == name_len && arg[prefix_len] == '*')) {
+        return false;
+    }
+    option_set_argv_source(family, arg_index);
+    if (ap_try_set_opt(parser, family, (char*)arg + prefix_len)) {
+        ap_record_event(parser, family, (char*)arg + prefix_len, arg_index);
+    }
+    return true;
+}
+
+
+// Parse an option of the form --name=value or -n=value.
+static void ap_handle_equals_opt(ArgParser* parser, const char* prefix, const char* arg, ArgStream* stream) {
+    const char* separator = strchr(arg, '=');
+    int name_len = (int)(separator - arg);
+    char* value = (char*)separator + 1;
+
+    // The name is looked up in place. Only the resolver and abbreviations need
+    // a terminated copy.
+    Option* option;
+    bool found = ap_find_arg_opt(parser, arg, (size_t)name_len, &option);
+
+    // Exact names take precedence over families, and families over resolved
+    // names and abbreviations.
+    if (!found && strcmp(prefix, "--") == 0 && parser->family_trie) {
+        if (ap_handle_family_opt(parser, arg,
+            stream->offset + stream->index - 1)) {
+            return;
+        }
+    }
+
+    bool is_long = strcmp(prefix, "--") == 0;
+    if (!found &&
+        (parser->resolver || (is_long && parser->enable_abbreviations))) {
+        char* name = str_dup_n(arg, name_len);
+        if (!name) {
+            ap_set_memory_error_flag(parser);
+            return;
+        }
+        found = is_long ? ap_find_long_opt(parser, name, &option) :
+            ap_resolve_opt(parser, name, &option);
+        free(name);
+    }
+
+    const char* suggestion = NULL;
+    if (!found && strcmp(prefix, "--") == 0) {
+        suggestion = ap_suggest_opt_name(parser, arg, name_len, false);
+    }
+
+    if (!found && suggestion) {
+        ap_error(parser,
+            "%s%.*s is not a recognised option name; did you mean %s%s?",
+            prefix, name_len, arg, opt_name_prefix(suggestion), suggestion);
+    } else if (!found) {
+        ap_error(parser, "%s%.*s is not a recognised option name", prefix,
+            name_len, arg);
+    } else if (option->type == OPT_FLAG) {
+        ap_error(parser, "flag %s%.*s does not accept an argument", prefix,
+            name_len, arg);
+    } else if (strlen(value) == 0) {
+        ap_error(parser, "missing argument for %s%.*s", prefix, name_len, arg);
+    } else {
+        option_set_argv_source(option, stream->offset + stream->index - 1);
+        ap_set_opt_from_stream(parser, option, value, stream);
+        if (option->is_greedy) {
+            while (argstream_has_next(stream) && !ap_halted(parser)) {
+                ap_set_opt_from_stream(parser, option, argstream_next(stream),
+                    stream);
+            }
+        }
+    }
+}
+
+
+// Parse a long-form option, i.e. an option beginning with a double dash.
+static void ap_handle_long_opt(ArgParser* parser, const char* arg, ArgStream* stream) {
+    Option* option;
+
+    // Exact names, including inherited globals, take precedence over families,
+    // and families over abbreviations.
+    if (parser->family_trie &&
+        !ap_find_arg_opt(parser, arg, strlen(arg), &option)) {
+        if (ap_handle_family_opt(parser, arg,
+            stream->offset + stream->index - 1)) {
+            return;
+        }
+    }
+
+    if (ap_find_long_opt(parser, arg, &option)) {
+        option_set_argv_source(option, stream->offset + stream->index - 1);
+
+        if (option->type == OPT_FLAG) {
+            option->count++;
+            ap_record_event(parser, option, NULL,
+                stream->offset + stream->index - 1);
+            return;
+        }
+
+        if (argstream_has_next(stream) && option->is_greedy) {
+            while (argstream_has_next(stream) && !ap_halted(parser)) {
+                ap_set_opt_from_stream(parser, option, argstream_next(stream),
+                    stream);
+            }
+            return;
+        }
+
+        if (argstream_has_next(stream)) {
+            ap_set_opt_from_stream(parser, option, argstream_next(stream),
+                stream);
+            return;
+        }
+
+        ap_error(parser, "missing argument for --%s", arg);
+        return;
+    }
+
+    if (strcmp(arg, "help") == 0 && parser->helptext != NULL) {
+        puts(parser->helptext);
+        ap_halt(parser, 0);
+        return;
+    }
+
+    if (strcmp(arg, "version") == 0 && parser->version != NULL) {
+        puts(parser->version);
+        ap_halt(parser, 0);
+        return;
+    }
+
+    const char* suggestion =
+        ap_suggest_opt_name(parser, arg, strlen(arg), false);
+    if (suggestion) {
+        ap_error(parser,
+            "--%s is not a recognised flag or option name; did you mean %s%s?",
+            arg, opt_name_prefix(suggestion), suggestion);
+    } else {
+        ap_error(parser, "--%s is not a recognised flag or option name", arg);
+    }
+}
+
+
+// Parse a short-form option, i.e. an option beginning with a single dash.
+static void ap_handle_short_opt(ArgParser* parser, const char* arg, ArgStream* stream) {
+    int arg_index = stream->offset + stream->index - 1;
+
+    for (size_t i = 0; i < strlen(arg) && !ap_halted(parser); i++) {
+        char keystr[] = {arg[i], 0};
+        Option* option;
+
+        bool found = map_get(parser->option_map, keystr, (void**)&option) ||
+            ap_find_global_opt(parser, keystr, 1, &option);
+        if (!found && !(arg[i] == 'h' && parser->helptext) &&
+            !(arg[i] == 'v' && parser->version)) {
+            found = ap_resolve_opt(parser, keystr, &option);
+        }
+        if (!found) {
+            if (arg[i] == 'h' && parser->helptext != NULL) {
+                puts(parser->helptext);
+                ap_halt(parser, 0);
+                return;
+            }
+            if (arg[i] == 'v' && parser->version != NULL) {
+                puts(parser->version);
+                ap_halt(parser, 0);
+                return;
+            }
+            if (strlen(arg) > 1) {
+                ap_error(parser,
+                    "'%c' in -%s is not a recognised flag or option name",
+                    arg[i], arg);
+                return;
+            }
+            ap_error(parser, "-%s is not a recognised flag or option name",
+                arg);
+            return;
+        }
+
+        option_set_argv_source(option, arg_index);
+
+        if (option->type == OPT_FLAG) {
+            option->count++;
+            ap_record_event(parser, option, NULL, arg_index);
+            continue;
+        }
+
+        if (argstream_has_next(stream) && option->is_greedy) {
+            while (argstream_has_next(stream) && !ap_halted(parser)) {
+                ap_set_opt_from_stream(parser, option, argstream_next(stream),
+                    stream);
+            }
+            continue;
+        }
+
+        if (argstream_has_next(stream)) {
+            ap_set_opt_from_stream(parser, option, argstream_next(stream),
+                stream);
+            continue;
+        }
+
+        if (strlen(arg) > 1) {
+            ap_error(parser, "missing argument for '%c' in -%s", arg[i], arg);
+            return;
+        }
+
+        ap_error(parser, "missing argument for -%s", arg);
+    }
+}
+
+
+// Parse a stream of string arguments.
+static void ap_parse_stream(ArgParser* parser, ArgStream* stream);
+
+
+// Check the parser's constraints once its arguments have been parsed.
+static void ap_validate_options(ArgParser* parser);
+
+
+// Returns true if [value] is a recognised truthy or falsy string for a flag,
+// setting [is_set].
+static bool str_to_flag(const char* value, bool* is_set) {
+    static const char* truthy[] = {"1", "true", "yes", "on"};
+    static const char* falsy[] = {"", "0", "false", "no", "off"};
+    for (size_t i = 0; i < sizeof(truthy) / sizeof(truthy[0]); i++) {
+        if (strcmp(value, truthy[i]) == 0) {
+            *is_set = true;
+            return true;
+        }
+    }
+    for (size_t i = 0; i < sizeof(falsy) / sizeof(falsy[0]); i++) {
+        if (strcmp(value, falsy[i]) == 0) {
+            *is_set = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Normalizes the first [length] bytes of a flag or option name -- or of an
+// environment variable name -- for matching: letters are upper-cased and dashes
+// replaced by underscores.
+static void env_normalize_name(const char* name, size_t length, char* out) {
+    for (size_t i = 0; i < length; i++) {
+        out[i] = name[i] == '-' ? '_' : (char)toupper((unsigned char)name[i]);
+    }
+}
+
+
+// Builds a map from the parser's normalized flag and option names to their
+// options. Single-character shortcuts aren't bound. Returns NULL if memory
+// allocation fails.
+static Map* ap_new_env_name_map(ArgParser* parser) {
+    Map* names = map_new();
+    if (!names) {
+        return NULL;
+    }
+
+    char key[256];
+    for (int i = 0; i < parser->option_map->capacity; i++) {
+        MapEntry* entry = &parser->option_map->entries[i];
+        if (entry->key == NULL || entry->key_len < 2 ||
+            entry->key_len >= sizeof(key) ||
+            ((Option*)entry->value)->is_family) {
+            continue;
+        }
+        env_normalize_name(entry->key, entry->key_len, key);
+        if (!map_set_n(names, key, entry->key_len, entry->value)) {
+            map_free(names);
+            return NULL;
+        }
+    }
+
+    return names;
+}
+
+
+// Sets options that weren't found on the command line from environment
+// variables named with the parser's prefix, e.g. PREFIX_THREAD_COUNT for
+// --thread-count. Names are matched ignoring case, with dashes and underscores
+// equivalent. The environment is scanned once and each matching variable is
+// looked up in a map of normalized names, rather than calling getenv() for
+// every option.
+static void ap_apply_env(ArgParser* parser) {
+    ArgParser* root = parser->root_parser;
+    size_t prefix_len = strlen(parser->env_prefix);
+    Map* names = NULL;
+
+    for (char** var = environ; *var != NULL && !ap_halted(parser); var++) {
+        if (strncmp(*var, parser->env_prefix, prefix_len) != 0) {
+            continue;
+        }
+
+        const char* name = *var + prefix_len;
+        const char* separator = strchr(name, '=');
+        size_t name_len = separator ? (size_t)(separator - name) : 0;
+
+        // Single-character shortcuts aren't bound. Names too long for the
+        // buffer can't match.
+        char key[256];
+        if (name_len < 2 || name_len >= sizeof(key)) {
+            continue;
+        }
+        env_normalize_name(name, name_len, key);
+
+        // The map is only built once a candidate variable has been found.
+        if (!names && !(names = ap_new_env_name_map(parser))) {
+            ap_set_memory_error_flag(parser);
+            return;
+        }
+
+        Option* opt;
+        if (!map_get_n(names, key, name_len, (void**)&opt) ||
+            opt->source != AP_SOURCE_FALLBACK) {
+            continue;
+        }
+
+        // Errors name the variable, e.g. 'PREFIX_THREAD_COUNT: cannot
+        // parse...'.
+        char* value = (char*)separator + 1;
+        option_set_source(opt, AP_SOURCE_ENV, *var, separator - *var, -1);
+        root->error_context = *var;
+        root->error_context_len = (int)(separator - *var);
+        if (opt->type == OPT_FLAG) {
+            bool is_set;
+            if (!str_to_flag(value, &is_set)) {
+                ap_error(parser, "invalid value '%s' for flag", value);
+            } else if (is_set) {
+                opt->count = 1;
+            }
+        } else {
+            ap_try_set_opt(parser, opt, value);
+        }
+        root->error_context = NULL;
+    }
+
+    map_free(names);
+}
+
+
+// Reports an unrecognised command name, suggesting the closest registered name
+// if any.
+static void ap_unknown_cmd_error(ArgParser* parser, const char* name) {
+    const char* suggestion =
+        map_suggest_key(parser->command_map, name, strlen(name), 1);
+    if (suggestion) {
+        ap_error(parser, "'%s' is not a recognised command; did you mean '%s'?",
+            name, suggestion);
+    } else {
+        ap_error(parser, "'%s' is not a recognised command", name);
+    }
+}
+
+
+// Points a cloned command parser and its subparsers at the real root parser so
+// errors and settings are shared with the rest of the tree.
+static void ap_set_root_parser(ArgParser* parser, ArgParser* root) {
+    parser->root_parser = root;
+    for (int i = 0; i < parser->command_vec->count; i++) {
+        ap_set_root_parser(parser->command_vec->entries[i], root);
+    }
+}
+
+
+// Appends a command to the parent's chain, cloning the command parser if it
+// already appears earlier in the chain. Returns NULL if memory cannot be
+// allocated.
+static ChainedCmd* ap_add_chained_cmd(ArgParser* parent, char* name,
+    ArgParser* cmd_parser) {
+    ChainedCmd* link = malloc(sizeof(ChainedCmd));
+    if (!link) {
+        return NULL;
+    }
+
+    link->name = name;
+    link->parser = cmd_parser;
+    link->exit_code = 0;
+    link->is_clone = false;
+
+    for (int i = 0; i < parent->chained_cmds->count; i++) {
+        ChainedCmd* other = parent->chained_cmds->entries[i];
+        if (other->parser == cmd_parser) {
+            link->parser = ap_clone(cmd_parser);
+            link->is_clone = true;
+            break;
+        }
+    }
+
+    if (!link->parser || !vec_add(parent->chained_cmds, link)) {
+        if (link->is_clone) {
+            ap_free(link->parser);
+        }
+        free(link);
+        return NULL;
+    }
+
+    if (link->is_clone) {
+        ap_set_root_parser(link->parser, parent->root_parser);
+        link->parser->parent = parent;
+    }
+
+    return link;
+}
+
+
+// Parses a chained invocation, e.g. 'fetch a b + index c + report'. Each
+// segment runs up to the next separator and is parsed by its own command
+// parser. Callbacks are deferred until the whole chain has been parsed
+// successfully, then called in order.
+static void ap_parse_chain(ArgParser* parser, char* name, ArgParser* cmd_parser,
+    ArgStream* stream) {
+    ap_clear_chained_cmds(parser);
+    parser->cmd_name = name;
+    parser->cmd_parser = cmd_parser;
+
+    while (true) {
+        ChainedCmd* link = ap_add_chained_cmd(parser, name, cmd_parser);
+        if (!link) {
+            ap_set_memory_error_flag(parser);
+            return;
+        }
+
+        int end = stream->index;
+        while (end < stream->count &&
+            strcmp(stream->args[end], parser->chain_separator) != 0) {
+            end++;
+        }
+
+        ArgStream segment = {
+            .count = end - stream->index,
+            .index = 0,
+            .args = stream->args + stream->index,
+            .offset = stream->offset + stream->index,
+        };
+        ap_parse_stream(link->parser, &segment);
+        stream->index = end;
+
+        if (parser->had_memory_error || ap_halted(parser) ||
+            !argstream_has_next(stream)) {
+            break;
+        }
+
+        argstream_next(stream);
+        if (!argstream_has_next(stream)) {
+            ap_error(parser, "expected a command after '%s'",
+                parser->chain_separator);
+            return;
+        }
+
+        name = argstream_next(stream);
+        if (!ap_find_cmd(parser, &name, &cmd_parser)) {
+            ap_unknown_cmd_error(parser, name);
+            return;
+        }
+    }
+
+    ap_validate_options(parser);
+    if (parser->had_memory_error || ap_halted(parser)) {
+        return;
+    }
+
+    for (int i = 0; i < parser->chained_cmds->count; i++) {
+        ChainedCmd* link = parser->chained_cmds->entries[i];
+        if (link->parser->cmd_callback) {
+            link->exit_code =
+                link->parser->cmd_callback(link->name, link->parser);
+            if (parser->cmd_callback_exit_code == 0) {
+                parser->cmd_callback_exit_code = link->exit_code;
+            }
+        }
+    }
+}
+
+
+// Applies the entries loaded from the parser's config file to any options that
+// weren't set from the command line or the environment. An option listed more
+// than once collects every value. If [staged] is not NULL, values are written
+// to the copy of each option at its index in [staged] rather than to the option
+// itself.
+static void ap_apply_config(ArgParser* parser, Option* staged) {
+    ConfigSource* config = &parser->config;
+
+    for (int i = 0; i < config->count && !ap_halted(parser); i++) {
+        ConfigEntry* entry = &config->entries[i];
+        Option* opt = staged ? &staged[entry->opt->index] : entry->opt;
+        if (opt->source != AP_SOURCE_FALLBACK &&
+            opt->source != AP_SOURCE_CONFIG) {
+            continue;
+        }
+
+        option_set_source(opt, AP_SOURCE_CONFIG, config->path,
+            strlen(config->path), entry->line);
+        if (opt->type == OPT_FLAG) {
+            bool is_set;
+            if (!str_to_flag(entry->value, &is_set)) {
+                ap_error(parser, "%s:%d: invalid value '%s' for flag",
+                    config->path, entry->line, entry->value);
+            } else {
+                opt->count = is_set ? 1 : 0;
+            }
+        } else {
+            ap_try_set_opt(parser, opt, entry->value);
+        }
+    }
+}
+
+
+// Returns the option's longest registered name. Ties are broken alphabetically.
+static const char* ap_get_opt_long_name(ArgParser* parser, Option* opt) {
+    const char* name = NULL;
+    for (int i = 0; i < parser->option_map->capacity; i++) {
+        MapEntry* entry = &parser->option_map->entries[i];
+        if (entry->key == NULL || entry->value != opt) {
+            continue;
+        }
+        if (!name || strlen(entry->key) > strlen(name) ||
+            (strlen(entry->key) == strlen(name) &&
+            strcmp(entry->key, name) < 0)) {
+            name = entry->key;
+        }
+    }
+    return name;
+}
+
+
+// Returns the option's display name for error messages, e.g. '--output' or
+// '-o'.
+static char* ap_constraint_opt_name(ArgParser* parser, int index) {
+    const char* name =
+        ap_get_opt_long_name(parser, parser->option_vec->entries[index]);
+    return str("%s%s", strlen(name) > 1 ? "--" : "-", name);
+}
+
+
+// Appends a violation message to the list. Returns false if memory cannot be
+// allocated.
+static bool ap_add_violation(ArgParser* parser, char** message,
+    const char* format, int index, int other) {
+    char* name = ap_constraint_opt_name(parser, index);
+    char* other_name = ap_constraint_opt_name(parser, other);
+    char* violation = name && other_name ? str(format, name, other_name) : NULL;
+    free(name);
+    free(other_name);
+    if (!violation) {
+        return false;
+    }
+
+    char* old_message = *message;
+    *message = old_message ? str("%s; %s", old_message, violation) : violation;
+    if (old_message) {
+        free(old_message);
+        free(violation);
+    }
+    return *message != NULL;
+}
+
+
+// Appends a message for each set bit in [mask], which covers the option indexes
+// beginning at [base]. Returns false if memory cannot be allocated.
+static bool ap_add_violations(ArgParser* parser, char** message,
+    const char* format, int index, uint64_t mask, int base) {
+    for (int bit = 0; mask != 0; bit++, mask >>= 1) {
+        if ((mask & 1) && !ap_add_violation(parser, message, format,
+            index < 0 ? base + bit : index, base + bit)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Checks every constraint against the set of options that were found. The found
+// options are gathered into a bitset so each rule is checked a word at a time.
+// All violations are reported together in a single error.
+static void ap_check_constraints(ArgParser* parser) {
+    ConstraintSet* constraints = &parser->constraints;
+    if (constraints->words == 0 && !ap_compile_constraints(parser)) {
+        ap_set_memory_error_flag(parser);
+        return;
+    }
+
+    int words = constraints->words;
+    uint64_t* found = constraints->found;
+    for (int w = 0; w < words; w++) {
+        found[w] = 0;
+    }
+    for (int i = 0; i < words * 64 && i < parser->option_vec->count; i++) {
+        Option* opt = parser->option_vec->entries[i];
+        if (opt->count > 0) {
+            found[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+
+    bool violated = false;
+    for (int w = 0; w < words; w++) {
+        violated = violated || (constraints->required[w] & ~found[w]);
+    }
+    for (int r = 0; r < constraints->row_count; r++) {
+        int index = constraints->row_index[r];
+        if (!(found[index / 64] & ((uint64_t)1 << (index % 64)))) {
+            continue;
+        }
+        uint64_t* row = constraints->rows + (size_t)2 * words * r;
+        for (int w = 0; w < words; w++) {
+            violated = violated || (row[w] & ~found[w]) ||
+                (row[words + w] & found[w]);
+        }
+    }
+
+    if (!violated) {
+        return;
+    }
+
+    // We only get here if there's an error to report, so the messages are
+    // assembled in a second pass rather than slowing down the common case.
+    char* message = NULL;
+    bool ok = true;
+    for (int w = 0; w < words && ok; w++) {
+        ok = ap_add_violations(parser, &message, "%s is required", -1,
+            constraints->required[w] & ~found[w], w * 64);
+    }
+    for (int r = 0; r < constraints->row_count && ok; r++) {
+        int index = constraints->row_index[r];
+        if (!(found[index / 64] & ((uint64_t)1 << (index % 64)))) {
+            continue;
+        }
+        uint64_t* row = constraints->rows + (size_t)2 * words * r;
+        for (int w = 0; w < words && ok; w++) {
+            ok = ap_add_violations(parser, &message, "%s requires %s", index,
+                    row[w] & ~found[w], w * 64) &&
+                ap_add_violations(parser, &message, "%s conflicts with %s",
+                    index, row[words + w] & found[w], w * 64);
+        }
+    }
+
+    if (ok) {
+        ap_error(parser, "%s", message);
+    } else {
+        ap_set_memory_error_flag(parser);
+    }
+    free(message);
+}
+
+
+// Sets any flags and options that weren't found on the command line from the
+// parser's lower precedence sources. Called once the parser's own arguments
+// have been consumed.
+static void ap_resolve_unset_options(ArgParser* parser) {
+    if (parser->had_memory_error || ap_halted(parser)) {
+        return;
+    }
+    if (parser->env_prefix) {
+        ap_apply_env(parser);
+    }
+    if (parser->config.count > 0) {
+        ap_apply_config(parser, NULL);
+    }
+}
+
+
+// Checks the parser's constraints. A parser with commands is checked once its
+// command has been parsed, as the command can set the parser's global options.
+static void ap_validate_options(ArgParser* parser) {
+    if (parser->constraints.count > 0 && !parser->had_memory_error &&
+        !ap_halted(parser)) {
+        ap_check_constraints(parser);
+    }
+}
+
+
+static void ap_parse_stream(ArgParser* parser, ArgStream* stream) {
+    if (parser->had_memory_error) {
+        return;
+    }
+
+    if (parser->all_args_as_pos_args) {
+        while (argstream_has_next(stream)) {
+            ap_add_pos_arg(parser, argstream_next(stream), stream);
+        }
+        ap_resolve_unset_options(parser);
+        ap_validate_options(parser);
+        return;
+    }
+
+    while (argstream_has_next(stream) && !ap_halted(parser)) {
+        ArgParser* cmd_parser;
+        char* arg = argstream_next(stream);
+
+        // If we encounter a '--' argument, turn off option-parsing.
+        if (strcmp(arg, "--") == 0) {
+            while (argstream_has_next(stream)) {
+                ap_add_pos_arg(parser, argstream_next(stream), stream);
+            }
+        }
+
+        // Is the argument a long-form option or flag?
+        else if (strncmp(arg, "--", 2) == 0) {
+            if (strstr(arg, "=") != NULL) {
+                ap_handle_equals_opt(parser, "--", arg + 2, stream);
+            } else {
+                ap_handle_long_opt(parser, arg + 2, stream);
+            }
+        }
+
+        // Is the argument a short-form option or flag?
+        else if (arg[0] == '-') {
+            if (strlen(arg) == 1 || isdigit(arg[1])) {
+                ap_add_pos_arg(parser, arg, stream);
+            } else if (strstr(arg, "=") != NULL) {
+                ap_handle_equals_opt(parser, "-", arg + 1, stream);
+            } else {
+                ap_handle_short_opt(parser, arg + 1, stream);
+            }
+        }
+
+        // Is the argument a registered command?
+        else if (parser->positional_args->count == 0 &&
+            ap_find_cmd(parser, &arg, &cmd_parser)) {
+            ap_resolve_unset_options(parser);
+            if (parser->chain_separator) {
+                ap_parse_chain(parser, arg, cmd_parser, stream);
+            } else {
+                parser->cmd_name = arg;
+                parser->cmd_parser = cmd_parser;
+                ap_parse_stream(cmd_parser, stream);
+                ap_validate_options(parser);
+                if (cmd_parser->cmd_callback && !parser->had_memory_error &&
+                    !ap_halted(parser)) {
+                    parser->cmd_callback_exit_code =
+                        cmd_parser->cmd_callback(arg, cmd_parser);
+                }
+            }
+        }
+
+        // Is the argument the automatic 'help' command?
+        else if (parser->positional_args->count == 0 && parser->enable_help_command && strcmp(arg, "help") == 0) {
+            if (argstream_has_next(stream)) {
+                char* name = argstream_next(stream);
+                if (ap_find_cmd(parser, &name, &cmd_parser)) {
+                    if (cmd_parser->helptext) {
+                        puts(cmd_parser->helptext);
+                    }
+                    ap_halt(parser, 0);
+                } else {
+                    ap_unknown_cmd_error(parser, name);
+                }
+            } else {
+                ap_error(parser, "the 'help' command requires an argument");
+            }
+        }
+
+        // Otherwise add the argument to our list of positionals.
+        else {
+            ap_add_pos_arg(parser, arg, stream);
+            if (parser->first_pos_arg_ends_option_parsing) {
+                while (argstream_has_next(stream)) {
+                    ap_add_pos_arg(parser, argstream_next(stream), stream);
+                }
+            }
+        }
+    }
+
+    // If a command was found, its parent's options were resolved before parsing
+    // the command.
+    if (!parser->cmd_name) {
+        ap_resolve_unset_options(parser);
+        ap_validate_options(parser);
+    }
+}
+
+
+// Starts a parse. Each parse begins with a clean error state, so an error
+// reported by an earlier parse or by ap_load_config() doesn't halt it. Returns
+// false if the parser can't be used.
+static bool ap_begin_parse(ArgParser* parser) {
+    ap_check_not_frozen(parser);
+
+    if (parser->had_memory_error) {
+        return false;
+    }
+
+    ArgParser* root = parser->root_parser;
+    root->halted = false;
+    free(root->error_message);
+    root->error_message = NULL;
+    root->in_parse = true;
+    return true;
+}
+
+
+// Ends a parse started by ap_begin_parse(). Returns true if the parse
+// succeeded.
+static bool ap_end_parse(ArgParser* parser) {
+    parser->root_parser->in_parse = false;
+    return !parser->had_memory_error && !ap_halted(parser);
+}
+
+
+// Parse an array of string arguments. We assume that [argc] and [argv] are the arguments passed to
+// main(), i.e. we ignore the first element in the array. In some situations [argv] can be empty,
+// i.e. [argc == 0], which can lead to security vulnerabilities if not explicitly handled.
+bool ap_parse(ArgParser* parser, int argc, char** argv) {
+    if (!ap_begin_parse(parser)) {
+        return false;
+    }
+
+    if (argc == 0) {
+        return ap_end_parse(parser);
+    }
+
+    parser->zeroth_root_arg = argv[0];
+
+    // If the AP_COMPLETE environment variable is set we've been invoked by a
+    // shell completion script. Print the candidates for the final argument and
+    // exit.
+    if (getenv("AP_COMPLETE") != NULL) {
+        char** completions = ap_get_completions(parser, argc, argv);
+        if (!completions) {
+            ap_end_parse(parser);
+            return false;
+        }
+        for (int i = 0; completions[i]; i++) {
+            puts(completions[i]);
+        }
+        free(completions);
+        exit(0);
+    }
+
+    ArgStream* stream = argstream_new(argc - 1 , argv + 1);
+    if (!stream) {
+        ap_set_memory_error_flag(parser);
+        return ap_end_parse(parser);
+    }
+    stream->offset = 1;
+
+    ap_parse_stream(parser, stream);
+    argstream_free(stream);
+
+    return ap_end_parse(parser);
+}
+
+
+static bool is_shell_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+        c == '\f';
+}
+
+
+// Splits [line] into tokens in place using POSIX shell quoting rules:
+// whitespace separates tokens, single quotes preserve everything literally,
+// double quotes preserve everything except backslash escapes of [$`"\] and line
+// continuations, and an unquoted backslash escapes the following character.
+// Each token is compacted towards the start of its original position and
+// NUL-terminated. Pointers to the tokens are written to [tokens], which must
+// have room for (strlen(line) + 1) / 2 entries. Returns the token count or -1
+// if a quote is unterminated.
+static int tokenize_in_place(char* line, char** tokens) {
+    char* read = line;
+    char* write = line;
+    int count = 0;
+
+    while (true) {
+        while (is_shell_space(*read) || (read[0] == '\\' && read[1] == '\n')) {
+            read += read[0] == '\\' ? 2 : 1;
+        }
+        if (*read == '\0') {
+            return count;
+        }
+
+        tokens[count++] = write;
+
+        while (*read != '\0' && !is_shell_space(*read)) {
+            char c = *read++;
+            if (c == '\'') {
+                while (*read != '\'') {
+                    if (*read == '\0') {
+                        return -1;
+                    }
+                    *write++ = *read++;
+                }
+                read++;
+            } else if (c == '"') {
+                while (*read != '"') {
+                    if (*read == '\0') {
+                        return -1;
+                    }
+                    if (*read == '\\' && read[1] == '\n') {
+                        read += 2;
+                    } else if (*read == '\\' && read[1] != '\0' &&
+                        strchr("$`\"\\", read[1])) {
+                        read++;
+                        *write++ = *read++;
+                    } else {
+                        *write++ = *read++;
+                    }
+                }
+                read++;
+            } else if (c == '\\' && *read == '\n') {
+                read++;
+            } else if (c == '\\' && *read != '\0') {
+                *write++ = *read++;
+            } else {
+                *write++ = c;
+            }
+        }
+
+        // The write cursor never overtakes the read cursor so it's safe to
+        // terminate the token once we've stepped past the separator.
+        bool at_end = *read == '\0';
+        if (!at_end) {
+            read++;
+        }
+        *write++ = '\0';
+        if (at_end) {
+            return count;
+        }
+    }
+}
+
+
+// Parses a complete command line supplied as a single string, e.g. a line read
+// by a REPL. The string is tokenized in place so it must remain valid while the
+// results are in use.
+bool ap_parse_string(ArgParser* parser, char* line) {
+    if (!ap_begin_parse(parser)) {
+        return false;
+    }
+
+    char** tokens = malloc(sizeof(char*) * ((strlen(line) + 1) / 2 + 1));
+    if (!tokens) {
+        ap_set_memory_error_flag(parser);
+        return ap_end_parse(parser);
+    }
+
+    int count = tokenize_in_place(line, tokens);
+    if (count < 0) {
+        ap_error(parser, "unterminated quote in command string");
+    } else {
+        ArgStream stream = {.count = count, .index = 0, .args = tokens};
+        ap_parse_stream(parser, &stream);
+    }
+
+    free(tokens);
+    return ap_end_parse(parser);
+}
+
+
+// Parses an array of length-delimited arguments. The parsed values have to
+// outlive the caller's buffer and the rest of the library expects
+// NUL-terminated strings, so the arguments are packed into a single reusable
+// buffer: an array of pointers followed by the terminated strings. Once the
+// buffer is large enough, parsing requires no further allocations. The string
+// values point into the buffer so it can't be reused until the results have
+// been cleared by ap_reset().
+bool ap_parse_spans(ArgParser* parser, const ApSpan* args, size_t count) {
+    if (!ap_begin_parse(parser)) {
+        return false;
+    }
+
+    // Reusing the buffer would invalidate the previous call's results, which
+    // the caller may still hold. This is reported like any other parse error
+    // so an embedded or network caller can recover from it.
+    if (parser->span_buffer_in_use) {
+        ap_error(parser,
+            "ap_parse_spans() requires a call to ap_reset() before the "
+            "parser's next call");
+        return ap_end_parse(parser);
+    }
+
+    if (count > INT_MAX) {
+        ap_error(parser, "too many arguments");
+        return ap_end_parse(parser);
+    }
+
+    size_t size = sizeof(char*) * count;
+    for (size_t i = 0; i < count; i++) {
+        size += args[i].length + 1;
+    }
+
+    if (size > parser->span_buffer_size) {
+        char* new_buffer = realloc(parser->span_buffer, size);
+        if (!new_buffer) {
+            ap_set_memory_error_flag(parser);
+            return ap_end_parse(parser);
+        }
+        parser->span_buffer = new_buffer;
+        parser->span_buffer_size = size;
+    }
+
+    parser->span_buffer_in_use = true;
+    char** pointers = (char**)parser->span_buffer;
+    char* cursor = parser->span_buffer + sizeof(char*) * count;
+    for (size_t i = 0; i < count; i++) {
+        pointers[i] = cursor;
+        if (args[i].length > 0) {
+            memcpy(cursor, args[i].data, args[i].length);
+        }
+        cursor[args[i].length] = '\0';
+        cursor += args[i].length + 1;
+    }
+
+    ArgStream stream = {.count = (int)count, .index = 0, .args = pointers};
+    ap_parse_stream(parser, &stream);
+
+    return ap_end_parse(parser);
+}
+
+
+// Clears the results of a previous call to ap_parse(), preserving the
+// registered flags, options, commands, and settings. Capacity allocated for
+// values and positionals is retained. Errors are recorded on the root parser so
+// its error state is cleared even if [parser] is a command parser.
+void ap_reset(ArgParser* parser) {
+    ap_check_not_frozen(parser);
+
+    ArgParser* root = parser->root_parser;
+    root->halted = false;
+    free(root->error_message);
+    root->error_message = NULL;
+
+    if (!root->had_setup_memory_error) {
+        for (ArgParser* ancestor = parser; ancestor;
+            ancestor = ancestor->parent) {
+            ancestor->had_memory_error = false;
+        }
+    }
+
+    for (int i = 0; i < parser->option_vec->count; i++) {
+        Option* opt = parser->option_vec->entries[i];
+        option_clear_values(opt);
+        option_set_source(opt, AP_SOURCE_FALLBACK, NULL, 0, -1);
+    }
+
+    parser->positional_args->count = 0;
+    parser->event_count = 0;
+    parser->span_buffer_in_use = false;
+    parser->cmd_name = NULL;
+    parser->cmd_parser = NULL;
+    parser->cmd_callback_exit_code = 0;
+    parser->zeroth_root_arg = NULL;
+
+    if (parser->chained_cmds) {
+        ap_clear_chained_cmds(parser);
+    }
+
+    for (int i = 0; i < parser->command_vec->count; i++) {
+        ap_reset(parser->command_vec->entries[i]);
+    }
+}
+
+
+/* ----------------------- */
+/* ArgParser: parse order. */
+/* ----------------------- */
+
+
+bool ap_iter_in_order(ArgParser* parser, int* cursor, ApEvent* event) {
+    if (*cursor < 0 || *cursor >= parser->event_count) {
+        return false;
+    }
+
+    ParseEvent* entry = &parser->events[(*cursor)++];
+    event->name = NULL;
+    if (entry->option >= 0) {
+        ArgParser* owner = parser;
+        for (int i = 0; i < entry->depth; i++) {
+            owner = owner->parent;
+        }
+        event->name = ap_get_opt_long_name(owner,
+            owner->option_vec->entries[entry->option]);
+    }
+    event->value = entry->value;
+    event->argv_index = entry->argv_index;
+    return true;
+}
 
 
-static ArgStream* argstream_new(int count, char** args) {
-    ArgStream* stream = malloc(sizeof(ArgStream));
-    if (!stream) {
+/* ---------------------------- */
+/* ArgParser: shell completion. */
+/* ---------------------------- */
+
+
+// Looks up a flag or option name while completing. Unlike the parser proper
+// this never exits -- an unrecognised or ambiguous name simply returns NULL.
+static Option* ap_complete_find_opt(ArgParser* parser, const char* name) {
+    Option* option;
+    if (ap_find_arg_opt(parser, name, strlen(name), &option)) {
+        return option;
+    }
+    if (!parser->enable_abbreviations || strlen(name) < 2) {
         return NULL;
     }
-    stream->count = count;
-    stream->index = 0;
-    stream->args = args;
-    return stream;
+    if (!ap_inherits_globals(parser)) {
+        TrieNode* node = trie_find_prefix(parser->option_trie, name);
+        if (node && node->subtree_value &&
+            node->subtree_value != TRIE_AMBIGUOUS) {
+            return node->subtree_value;
+        }
+        return NULL;
+    }
+
+    Vec* names = vec_new();
+    if (names && ap_collect_opt_names(parser, name, names)) {
+        option = ap_common_opt(parser, names);
+    } else {
+        option = NULL;
+    }
+    vec_free(names);
+    return option;
 }
 
 
-static void argstream_free(ArgStream* stream) {
-    free(stream);
+// Looks up a command name while completing. Returns NULL if the name is
+// unrecognised or ambiguous.
+static ArgParser* ap_complete_find_cmd(ArgParser* parser, const char* name) {
+    ArgParser* cmd_parser;
+    if (map_get(parser->command_map, name, (void**)&cmd_parser)) {
+        return cmd_parser;
+    }
+    if (parser->enable_abbreviations && strlen(name) > 0) {
+        TrieNode* node = trie_find_prefix(parser->command_trie, name);
+        if (node && node->subtree_value &&
+            node->subtree_value != TRIE_AMBIGUOUS) {
+            return node->subtree_value;
+        }
+    }
+    return NULL;
 }
 
 
-static char* argstream_next(ArgStream* stream) {
-    return stream->args[stream->index++];
+// Skips over the argument(s) consumed by a value-taking option. Returns true if
+// the cursor word is one of the option's values, i.e. if we've reached the end
+// of the completed arguments.
+static bool ap_complete_skip_value(Option* option, int* index, int argc,
+    Option** value_option) {
+    if (option->is_greedy || *index >= argc - 1) {
+        *value_option = option;
+        return true;
+    }
+    (*index)++;
+    return false;
 }
 
 
-static bool argstream_has_next(ArgStream* stream) {
-    return stream->index < stream->count;
+// Appends a candidate to the list. Each candidate is stored as a pair of
+// entries -- a prefix and a key -- which get concatenated when the list is
+// assembled.
+static bool ap_complete_add(Vec* candidates, const char* prefix,
+    const char* key) {
+    return vec_add(candidates, (void*)prefix) &&
+        vec_add(candidates, (void*)key);
 }
 
 
-/* ----------------- */
-/* ArgParser: setup. */
-/* ----------------- */
-
+// Appends the keys in [trie] beginning with [word] to the list of candidates.
+// Single-character keys are skipped if [long_only] is true.
+static bool ap_complete_add_keys(Vec* candidates, Trie* trie,
+    const char* prefix, const char* word, bool long_only) {
+    char** keys = trie_get_keys(trie, word);
+    if (!keys) {
+        return false;
+    }
+    for (int i = 0; keys[i]; i++) {
+        if (long_only && strlen(keys[i]) < 2) {
+            continue;
+        }
+        if (!ap_complete_add(candidates, prefix, keys[i])) {
+            free(keys);
+            return false;
+        }
+    }
+    free(keys);
+    return true;
+}
 
-struct ArgParser {
-    char* helptext;
-    char* version;
-    Vec* option_vec;
-    Map* option_map;
-    Vec* command_vec;
-    Map* command_map;
-    Vec* positional_args;
-    ap_callback_t cmd_callback;
-    int cmd_callback_exit_code;
-    char* cmd_name;
-    struct ArgParser* cmd_parser;
-    struct ArgParser* root_parser;
-    bool enable_help_command;
-    bool had_memory_error;
-    struct ArgParser* parent;
-    bool first_pos_arg_ends_option_parsing;
-    bool all_args_as_pos_args;
-    char* zeroth_root_arg;
-};
 
+// Appends the long-form flag and option names in scope for the parser that
+// begin with [word] to the list of candidates, including inherited globals.
+static bool ap_complete_add_opt_names(Vec* candidates, ArgParser* parser,
+    const char* word) {
+    if (!ap_inherits_globals(parser)) {
+        return ap_complete_add_keys(candidates, parser->option_trie, "--", word,
+            true);
+    }
 
-ArgParser* ap_new_parser(void) {
-    ArgParser *parser = malloc(sizeof(ArgParser));
-    if (!parser) {
-        return NULL;
+    Vec* names = vec_new();
+    bool ok = names && ap_collect_opt_names(parser, word, names);
+    for (int i = 0; ok && i < names->count; i++) {
+        if (strlen(names->entries[i]) > 1) {
+            ok = ap_complete_add(candidates, "--", names->entries[i]);
+        }
     }
+    vec_free(names);
+    return ok;
+}
 
-    parser->helptext = NULL;
-    parser->version = NULL;
-    parser->cmd_callback = NULL;
-    parser->cmd_callback_exit_code = 0;
-    parser->cmd_name = NULL;
-    parser->cmd_parser = NULL;
-    parser->enable_help_command = false;
-    parser->had_memory_error = false;
-    parser->parent = NULL;
-    parser->first_pos_arg_ends_option_parsing = false;
-    parser->all_args_as_pos_args = false;
-    parser->option_vec = NULL;
-    parser->option_map = NULL;
-    parser->command_vec = NULL;
-    parser->command_map = NULL;
-    parser->positional_args = NULL;
-    parser->root_parser = parser;
-    parser->zeroth_root_arg = NULL;
 
-    parser->option_vec = vec_new();
-    if (!parser->option_vec) {
-        ap_free(parser);
-        return NULL;
+// Adds an automatic flag or command to the list of candidates if it begins with
+// [word].
+static bool ap_complete_add_builtin(Vec* candidates, Map* map,
+    const char* prefix, const char* name, const char* word) {
+    void* value;
+    if (strncmp(name, word, strlen(word)) != 0 || map_get(map, name, &value)) {
+        return true;
     }
+    return ap_complete_add(candidates, prefix, name);
+}
 
-    parser->option_map = map_new();
-    if (!parser->option_map) {
-        ap_free(parser);
-        return NULL;
+
+// Appends the names in the choice set beginning with [word] to the list of
+// candidates.
+static bool ap_complete_add_choices(Vec* candidates, ChoiceSet* choices,
+    const char* word) {
+    size_t length = strlen(word);
+    for (int i = 0; i < choices->count; i++) {
+        if (strncmp(choices->names[i], word, length) == 0 &&
+            !ap_complete_add(candidates, "", choices->names[i])) {
+            return false;
+        }
     }
+    return true;
+}
 
-    parser->command_vec = vec_new();
-    if (!parser->command_vec) {
-        ap_free(parser);
-        return NULL;
+
+// Concatenates the candidate pairs into a single allocation holding both the
+// NULL-terminated array of pointers and the strings themselves.
+static char** ap_complete_assemble(Vec* candidates) {
+    int count = candidates->count / 2;
+    size_t size = sizeof(char*) * (count + 1);
+    for (int i = 0; i < candidates->count; i++) {
+        size += strlen(candidates->entries[i]);
     }
+    size += count;
 
-    parser->command_map = map_new();
-    if (!parser->command_map) {
-        ap_free(parser);
+    char** completions = malloc(size);
+    if (!completions) {
         return NULL;
     }
 
-    parser->positional_args = vec_new();
-    if (!parser->positional_args) {
-        ap_free(parser);
-        return NULL;
+    char* cursor = (char*)(completions + count + 1);
+    for (int i = 0; i < count; i++) {
+        char* prefix = candidates->entries[2 * i];
+        char* key = candidates->entries[2 * i + 1];
+        size_t prefix_length = strlen(prefix);
+        size_t key_length = strlen(key);
+        completions[i] = cursor;
+        memcpy(cursor, prefix, prefix_length);
+        memcpy(cursor + prefix_length, key, key_length + 1);
+        cursor += prefix_length + key_length + 1;
     }
+    completions[count] = NULL;
 
-    return parser;
+    return completions;
 }
 
 
-void ap_free(ArgParser* parser) {
-    if (!parser) {
-        return;
+// Returns the completion candidates for the final argument in [argv].
+char** ap_get_completions(ArgParser* parser, int argc, char** argv) {
+    Vec* candidates = vec_new();
+    if (!candidates) {
+        return NULL;
     }
 
-    free(parser->helptext);
-    free(parser->version);
+    // Walk the arguments preceding the cursor word to find the active command
+    // parser. We don't convert or store any values -- we only need to know
+    // which arguments are consumed.
+    ArgParser* active = parser;
+    Option* value_option = NULL;
+    bool options_ended = false;
+    int pos_arg_count = 0;
+    int index = 1;
+
+    while (index < argc - 1 && !value_option) {
+        char* arg = argv[index++];
+        Option* option;
+        ArgParser* cmd_parser;
 
-    if (parser->option_map) {
-        map_free(parser->option_map);
-    }
+        if (options_ended || active->all_args_as_pos_args) {
+            continue;
+        }
 
-    if (parser->option_vec) {
-        for (int i = 0; i < parser->option_vec->count; i++) {
-            option_free(parser->option_vec->entries[i]);
+        if (strcmp(arg, "--") == 0) {
+            options_ended = true;
+        } else if (strncmp(arg, "--", 2) == 0) {
+            if (strchr(arg, '=') == NULL &&
+                (option = ap_complete_find_opt(active, arg + 2))) {
+                if (option->type != OPT_FLAG) {
+                    ap_complete_skip_value(option, &index, argc, &value_option);
+                }
+            }
+        } else if (arg[0] == '-' && arg[1] != '\0' && !isdigit(arg[1])) {
+            if (strchr(arg, '=') != NULL) {
+                continue;
+            }
+            for (size_t i = 1; arg[i] != '\0' && !value_option; i++) {
+                char keystr[] = {arg[i], 0};
+                if (ap_find_arg_opt(active, keystr, 1, &option) &&
+                    option->type != OPT_FLAG) {
+                    ap_complete_skip_value(option, &index, argc, &value_option);
+                }
+            }
+        } else if (pos_arg_count == 0 &&
+            (cmd_parser = ap_complete_find_cmd(active, arg))) {
+            active = cmd_parser;
+        } else {
+            pos_arg_count++;
+            if (active->first_pos_arg_ends_option_parsing) {
+                options_ended = true;
+            }
         }
-        vec_free(parser->option_vec);
     }
 
-    if (parser->command_map) {
-        map_free(parser->command_map);
+    char* word = argc > 1 ? argv[argc - 1] : "";
+    bool ok = true;
+
+    if (value_option && value_option->type == OPT_CHOICE) {
+        ok = ap_complete_add_choices(candidates, value_option->choices, word);
+    } else if (value_option || options_ended || active->all_args_as_pos_args) {
+        // We're completing an option value or a positional argument.
+    } else if (strncmp(word, "--", 2) == 0) {
+        if (strchr(word, '=') == NULL) {
+            ok = ap_complete_add_opt_names(candidates, active, word + 2);
+            if (ok && active->helptext) {
+                ok = ap_complete_add_builtin(candidates, active->option_map,
+                    "--", "help", word + 2);
+            }
+            if (ok && active->version) {
+                ok = ap_complete_add_builtin(candidates, active->option_map,
+                    "--", "version", word + 2);
+            }
+        }
+    } else if (word[0] != '-' && pos_arg_count == 0) {
+        ok = ap_complete_add_keys(candidates, active->command_trie, "", word,
+            false);
+        if (ok && active->enable_help_command) {
+            ok = ap_complete_add_builtin(candidates, active->command_map, "",
+                "help", word);
+        }
     }
 
-    if (parser->command_vec) {
-        for (int i = 0; i < parser->command_vec->count; i++) {
-            ap_free(parser->command_vec->entries[i]);
+    char** completions = ok ? ap_complete_assemble(candidates) : NULL;
+    vec_free(candidates);
+    return completions;
+}
+
+
+/* ------------------------------------ */
+/* ArgParser: serialized parse results. */
+/* ------------------------------------ */
+
+
+// A serialized result begins with this magic number followed by the blob's
+// total size.
+#define RESULT_MAGIC 0x31525041 // "APR1"
+
+
+// Each parser's record consists of its option values in registration order, its
+// positional arguments, and -- if a command was found -- the command's index,
+// name, exit code, and record.
+static void ap_write_result(ArgParser* parser, BlobWriter* writer) {
+    blob_write_u32(writer, (uint32_t)parser->option_vec->count);
+    for (int i = 0; i < parser->option_vec->count; i++) {
+        Option* opt = parser->option_vec->entries[i];
+        blob_write_u32(writer, (uint32_t)opt->type);
+        blob_write_u32(writer, (uint32_t)opt->count);
+        for (int j = 0; j < opt->count && opt->type != OPT_FLAG; j++) {
+            if (option_has_str_values(opt)) {
+                blob_write_str(writer, opt->values.str_vals[j]);
+            } else if (opt->type == OPT_INT || opt->type == OPT_CHOICE) {
+                blob_write_i32(writer, opt->values.int_vals[j]);
+            } else if (opt->type == OPT_DBL) {
+                blob_write_dbl(writer, opt->values.dbl_vals[j]);
+            }
         }
-        vec_free(parser->command_vec);
     }
 
-    if (parser->positional_args) {
-        vec_free(parser->positional_args);
+    blob_write_u32(writer, (uint32_t)parser->positional_args->count);
+    for (int i = 0; i < parser->positional_args->count; i++) {
+        blob_write_str(writer, parser->positional_args->entries[i]);
     }
 
-    free(parser);
-}
-
-
-static void ap_set_memory_error_flag(ArgParser* parser) {
-    parser->had_memory_error = true;
+    int cmd_index = -1;
+    for (int i = 0; i < parser->command_vec->count; i++) {
+        if (parser->command_vec->entries[i] == parser->cmd_parser) {
+            cmd_index = i;
+            break;
+        }
+    }
 
-    ArgParser* parent = parser->parent;
-    while (parent) {
-        parent->had_memory_error = true;
-        parent = parent->parent;
+    blob_write_i32(writer, cmd_index);
+    if (cmd_index >= 0) {
+        blob_write_str(writer, parser->cmd_name);
+        blob_write_i32(writer, parser->cmd_callback_exit_code);
+        ap_write_result(parser->cmd_parser, writer);
     }
 }
 
 
-void ap_set_helptext(ArgParser* parser, const char* helptext) {
-    free(parser->helptext);
-    parser->helptext = NULL;
+size_t ap_serialize_result(ArgParser* parser, void* buf, size_t size) {
+    BlobWriter writer = {buf, size, 0};
+    blob_write_u32(&writer, RESULT_MAGIC);
+    blob_write_u32(&writer, 0);
+    blob_write_str(&writer, parser->zeroth_root_arg);
+    ap_write_result(parser, &writer);
 
-    if (helptext) {
-        parser->helptext = str_dup(helptext);
-        if (!parser->helptext) {
-            ap_set_memory_error_flag(parser);
-        }
+    // Backfill the total size now that we know it.
+    if (buf && writer.pos <= size) {
+        uint32_t total = (uint32_t)writer.pos;
+        memcpy((uint8_t*)buf + sizeof(uint32_t), &total, sizeof(uint32_t));
     }
+
+    return writer.pos;
 }
 
 
-char* ap_get_helptext(ArgParser* parser) {
-    return parser->helptext;
-}
+// Reads a parser's record. Returns false if the record is malformed or doesn't
+// match the parser's registered options and commands.
+static bool ap_read_result(ArgParser* parser, BlobReader* reader) {
+    if (blob_read_u32(reader) != (uint32_t)parser->option_vec->count) {
+        return false;
+    }
 
+    for (int i = 0; i < parser->option_vec->count; i++) {
+        Option* opt = parser->option_vec->entries[i];
+        uint32_t type = blob_read_u32(reader);
+        uint32_t count = blob_read_u32(reader);
+        if (!reader->ok || type != (uint32_t)opt->type || count > INT_MAX) {
+            return false;
+        }
 
-void ap_set_version(ArgParser* parser, const char* version) {
-    free(parser->version);
-    parser->version = NULL;
+        if (opt->type == OPT_FLAG) {
+            opt->count = (int)count;
+            continue;
+        }
 
-    if (version) {
-        parser->version = str_dup(version);
-        if (!parser->version) {
-            ap_set_memory_error_flag(parser);
+        for (uint32_t j = 0; j < count && reader->ok; j++) {
+            OptionValue value;
+            if (option_has_str_values(opt)) {
+                value.str_val = blob_read_str(reader);
+            } else if (opt->type == OPT_INT || opt->type == OPT_CHOICE) {
+                value.int_val = blob_read_i32(reader);
+            } else {
+                value.dbl_val = blob_read_dbl(reader);
+            }
+            if (reader->ok && !option_append_value(opt, value)) {
+                ap_set_memory_error_flag(parser);
+                return false;
+            }
         }
     }
-}
 
+    uint32_t pos_arg_count = blob_read_u32(reader);
+    for (uint32_t i = 0; i < pos_arg_count && reader->ok; i++) {
+        char* arg = blob_read_str(reader);
+        if (reader->ok && !vec_add(parser->positional_args, arg)) {
+            ap_set_memory_error_flag(parser);
+            return false;
+        }
+    }
 
-char* ap_get_version(ArgParser* parser) {
-    return parser->version;
-}
+    int32_t cmd_index = blob_read_i32(reader);
+    if (!reader->ok || cmd_index < -1 ||
+        cmd_index >= parser->command_vec->count) {
+        return false;
+    }
 
+    if (cmd_index >= 0) {
+        parser->cmd_name = blob_read_str(reader);
+        parser->cmd_callback_exit_code = blob_read_i32(reader);
+        parser->cmd_parser = parser->command_vec->entries[cmd_index];
+        return reader->ok && ap_read_result(parser->cmd_parser, reader);
+    }
 
-void ap_first_pos_arg_ends_option_parsing(ArgParser* parser) {
-    parser->first_pos_arg_ends_option_parsing = true;
+    return reader->ok;
 }
 
 
-void ap_all_args_as_pos_args(ArgParser* parser) {
-    parser->all_args_as_pos_args = true;
-}
+bool ap_load_result(ArgParser* parser, const void* buf, size_t size) {
+    ap_check_not_frozen(parser);
 
+    BlobReader reader = {buf, size, 0, true};
+    ap_reset(parser);
 
-/* -------------------------------------- */
-/* ArgParser: register flags and options. */
-/* -------------------------------------- */
+    if (blob_read_u32(&reader) != RESULT_MAGIC ||
+        blob_read_u32(&reader) != size) {
+        return false;
+    }
 
+    parser->zeroth_root_arg = blob_read_str(&reader);
 
-static void ap_register_option(ArgParser* parser, const char* name, Option* opt) {
-    if (!opt) {
-        ap_set_memory_error_flag(parser);
-        return;
-    }
+    parser->root_parser->in_parse = true;
+    bool ok = ap_read_result(parser, &reader) && reader.pos == size;
+    parser->root_parser->in_parse = false;
 
-    if (vec_add(parser->option_vec, opt)) {
-        if (map_set_splitkey(parser->option_map, name, opt)) {
-            return;
-        } else {
-            ap_set_memory_error_flag(parser);
-            parser->option_vec->count--;
-            option_free(opt);
-            return;
-        }
-    } else {
-        ap_set_memory_error_flag(parser);
-        option_free(opt);
-        return;
+    if (!ok) {
+        ap_reset(parser);
+        return false;
     }
-}
 
-
-// Register a new flag.
-void ap_add_flag(ArgParser *parser, const char* name) {
-    Option* opt = option_new_flag();
-    ap_register_option(parser, name, opt);
+    return true;
 }
 
 
-// Register a new string-valued option.
-void ap_add_str_opt(ArgParser* parser, const char* name, const char* fallback) {
-    Option* opt = option_new_str((char*)fallback);
-    ap_register_option(parser, name, opt);
-}
+/* ------------------------------- */
+/* ArgParser: spec snapshot files. */
+/* ------------------------------- */
+
+
+// A spec file begins with this magic number followed by the file's total size.
+#define SPEC_MAGIC 0x31535041 // "APS1"
+
+
+// Each parser's record consists of its helptext, version, and settings; its
+// options in registration order; its option names, each with the index of its
+// option; its command records in registration order; and its command names,
+// each with the index of its command.
+static void ap_write_spec(ArgParser* parser, BlobWriter* writer) {
+    blob_write_str(writer, parser->helptext);
+    blob_write_str(writer, parser->version);
+    blob_write_u32(writer, parser->enable_help_command);
+    blob_write_u32(writer, parser->first_pos_arg_ends_option_parsing);
+    blob_write_u32(writer, parser->all_args_as_pos_args);
+    blob_write_u32(writer, parser->enable_abbreviations);
+    blob_write_str(writer, parser->chain_separator);
+    blob_write_str(writer, parser->env_prefix);
+
+    blob_write_u32(writer, (uint32_t)parser->option_vec->count);
+    for (int i = 0; i < parser->option_vec->count; i++) {
+        Option* opt = parser->option_vec->entries[i];
+        blob_write_u32(writer, (uint32_t)opt->type);
+        blob_write_u32(writer, opt->is_greedy);
+        blob_write_u32(writer, opt->is_global);
+        blob_write_u32(writer, opt->is_family);
+        if (opt->type == OPT_STR) {
+            blob_write_str(writer, opt->fallback.str_val);
+        } else if (opt->type == OPT_INT) {
+            blob_write_i32(writer, opt->fallback.int_val);
+        } else if (opt->type == OPT_DBL) {
+            blob_write_dbl(writer, opt->fallback.dbl_val);
+        } else if (opt->type == OPT_CHOICE) {
+            blob_write_i32(writer, opt->fallback.int_val);
+            blob_write_u32(writer, (uint32_t)opt->choices->count);
+            for (int j = 0; j < opt->choices->count; j++) {
+                blob_write_str(writer, opt->choices->names[j]);
+            }
+        } else if (opt->type == OPT_KV) {
+            blob_write_u32(writer, opt->rejects_duplicates);
+        }
+    }
 
+    blob_write_u32(writer, (uint32_t)parser->option_map->count);
+    for (int i = 0; i < parser->option_map->capacity; i++) {
+        MapEntry* entry = &parser->option_map->entries[i];
+        if (entry->key != NULL) {
+            blob_write_str(writer, entry->key);
+            blob_write_u32(writer, (uint32_t)((Option*)entry->value)->index);
+        }
+    }
 
-// Register a new greedy string-valued option.
-void ap_add_greedy_str_opt(ArgParser* parser, const char* name) {
-    Option* opt = option_new_str((char*)"");
-    if (opt) {
-        opt->is_greedy = true;
+    blob_write_u32(writer, (uint32_t)parser->constraints.count);
+    for (int i = 0; i < parser->constraints.count; i++) {
+        Constraint* rule = &parser->constraints.rules[i];
+        blob_write_u32(writer, (uint32_t)rule->kind);
+        blob_write_u32(writer, (uint32_t)rule->index);
+        blob_write_u32(writer, (uint32_t)rule->other);
     }
-    ap_register_option(parser, name, opt);
-}
 
+    blob_write_u32(writer, (uint32_t)parser->command_vec->count);
+    for (int i = 0; i < parser->command_vec->count; i++) {
+        ap_write_spec(parser->command_vec->entries[i], writer);
+    }
 
-// Register a new integer-valued option.
-void ap_add_int_opt(ArgParser* parser, const char* name, int fallback) {
-    Option* opt = option_new_int(fallback);
-    ap_register_option(parser, name, opt);
+    blob_write_u32(writer, (uint32_t)parser->command_map->count);
+    for (int i = 0; i < parser->command_map->capacity; i++) {
+        MapEntry* entry = &parser->command_map->entries[i];
+        if (entry->key != NULL) {
+            uint32_t cmd_index = 0;
+            while (parser->command_vec->entries[cmd_index] != entry->value) {
+                cmd_index++;
+            }
+            blob_write_str(writer, entry->key);
+            blob_write_u32(writer, cmd_index);
+        }
+    }
 }
 
 
-// Register a new double-valued option.
-void ap_add_dbl_opt(ArgParser* parser, const char* name, double fallback) {
-    Option* opt = option_new_double(fallback);
-    ap_register_option(parser, name, opt);
-}
+// Serializes the parser's spec into a freshly-allocated image and sets [size]
+// to its length. Returns NULL if memory cannot be allocated for the image.
+static uint8_t* ap_spec_to_image(ArgParser* parser, size_t* size) {
+    BlobWriter writer = {NULL, 0, 0};
+    blob_write_u32(&writer, SPEC_MAGIC);
+    blob_write_u32(&writer, 0);
+    ap_write_spec(parser, &writer);
 
+    *size = writer.pos;
+    uint8_t* buf = malloc(*size);
+    if (!buf) {
+        return NULL;
+    }
 
-/* ---------------------------------- */
-/* ArgParser: flag and option values. */
-/* ---------------------------------- */
+    writer = (BlobWriter){buf, *size, 0};
+    blob_write_u32(&writer, SPEC_MAGIC);
+    blob_write_u32(&writer, (uint32_t)*size);
+    ap_write_spec(parser, &writer);
+    return buf;
+}
 
 
-// Retrieve an Option instance by name.
-static Option* ap_get_opt(ArgParser* parser, const char* name) {
-    void* opt;
-    if (!map_get(parser->option_map, name, &opt)) {
-        exit_with_error("'%s' is not a registered flag or option name", name);
+bool ap_save_spec(ArgParser* parser, const char* path) {
+    size_t size;
+    uint8_t* buf = ap_spec_to_image(parser, &size);
+    if (!buf) {
+        return false;
     }
-    return (Option*)opt;
-}
 
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        free(buf);
+        return false;
+    }
 
-// Returns the number of times the specified flag or option was found.
-int ap_count(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return opt->count;
+    bool ok = fwrite(buf, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    free(buf);
+    return ok;
 }
 
 
-// Returns true if the specified flag or option was found.
-bool ap_found(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return opt->count > 0;
-}
+// Reads a choice option's fallback and names. The names point into the image.
+static Option* ap_read_choice_opt(BlobReader* reader) {
+    int fallback = blob_read_i32(reader);
+    uint32_t count = blob_read_u32(reader);
+    if (!reader->ok ||
+        count > (reader->size - reader->pos) / sizeof(uint32_t)) {
+        return NULL;
+    }
 
+    const char** names = malloc(sizeof(const char*) * (count > 0 ? count : 1));
+    if (!names) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        names[i] = blob_read_str(reader);
+        if (!names[i]) {
+            free(names);
+            return NULL;
+        }
+    }
 
-// Returns the value of the specified string option.
-char* ap_get_str_value(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return (char*)option_get_str(opt);
+    // A corrupt image can repeat a name; reject it rather than exiting.
+    ChoiceSet* set = choice_names_find_duplicate(names, (int)count) == -1 ?
+        choice_set_new(names, (int)count) : NULL;
+    free(names);
+    return set ? option_new_choice(set, fallback) : NULL;
 }
 
 
-// Returns the string value at the specified index.
-char* ap_get_str_value_at_index(ArgParser* parser, const char* name, int index) {
-    Option* opt = ap_get_opt(parser, name);
-    return opt->values[index].str_val;
-}
+// Reads a parser's record into a freshly-initialized parser. Returns false if
+// the record is malformed or if memory allocation fails.
+static bool ap_read_spec(ArgParser* parser, BlobReader* reader) {
+    ap_set_helptext(parser, blob_read_str(reader));
+    ap_set_version(parser, blob_read_str(reader));
+    parser->enable_help_command = blob_read_u32(reader);
+    parser->first_pos_arg_ends_option_parsing = blob_read_u32(reader);
+    parser->all_args_as_pos_args = blob_read_u32(reader);
+    parser->enable_abbreviations = blob_read_u32(reader);
+    ap_enable_cmd_chaining(parser, blob_read_str(reader));
+    ap_bind_env_prefix(parser, blob_read_str(reader));
+
+    uint32_t option_count = blob_read_u32(reader);
+    if (!reader->ok || option_count > INT_MAX ||
+        !vec_reserve(parser->option_vec, (int)option_count)) {
+        return false;
+    }
 
+    for (uint32_t i = 0; i < option_count && reader->ok; i++) {
+        uint32_t type = blob_read_u32(reader);
+        bool is_greedy = blob_read_u32(reader);
+        bool is_global = blob_read_u32(reader);
+        bool is_family = blob_read_u32(reader);
+        Option* opt;
+        if (type == OPT_FLAG) {
+            opt = option_new_flag();
+        } else if (type == OPT_STR) {
+            opt = option_new_str(blob_read_str(reader));
+        } else if (type == OPT_INT) {
+            opt = option_new_int(blob_read_i32(reader));
+        } else if (type == OPT_DBL) {
+            opt = option_new_double(blob_read_dbl(reader));
+        } else if (type == OPT_CHOICE) {
+            opt = ap_read_choice_opt(reader);
+        } else if (type == OPT_SET) {
+            opt = option_new_indexed(OPT_SET);
+        } else if (type == OPT_KV) {
+            opt = option_new_indexed(OPT_KV);
+            if (opt) {
+                opt->rejects_duplicates = blob_read_u32(reader);
+            }
+        } else {
+            return false;
+        }
+        if (!opt) {
+            return false;
+        }
+        opt->is_greedy = is_greedy;
+        opt->is_global = is_global;
+        opt->is_family = is_family;
+        parser->global_count += is_global;
+        opt->index = parser->option_vec->count;
+        if (!vec_add(parser->option_vec, opt)) {
+            option_free(opt);
+            return false;
+        }
+    }
 
-// Returns the value of the specified integer option.
-int ap_get_int_value(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return option_get_int(opt);
-}
+    uint32_t option_key_count = blob_read_u32(reader);
+    if (!reader->ok || option_key_count > INT_MAX ||
+        !map_reserve(parser->option_map, (int)option_key_count)) {
+        return false;
+    }
 
+    for (uint32_t i = 0; i < option_key_count && reader->ok; i++) {
+        char* key = blob_read_str(reader);
+        uint32_t index = blob_read_u32(reader);
+        if (!key || index >= (uint32_t)parser->option_vec->count) {
+            return false;
+        }
+        Option* opt = parser->option_vec->entries[index];
+        if (!map_set(parser->option_map, key, opt) ||
+            (!opt->is_family && !trie_set(parser->option_trie, key, opt))) {
+            return false;
+        }
+        if (opt->is_family) {
+            char* prefix = str_dup_n(key, strlen(key) - 1);
+            bool ok = prefix && ap_add_family_prefix(parser, prefix, opt);
+            free(prefix);
+            if (!ok) {
+                return false;
+            }
+        }
+    }
 
-// Returns the integer value at the specified index.
-int ap_get_int_value_at_index(ArgParser* parser, const char* name, int index) {
-    Option* opt = ap_get_opt(parser, name);
-    return opt->values[index].int_val;
-}
+    uint32_t rule_count = blob_read_u32(reader);
+    if (!reader->ok ||
+        rule_count > (reader->size - reader->pos) / (3 * sizeof(uint32_t))) {
+        return false;
+    }
 
+    ConstraintSet* constraints = &parser->constraints;
+    constraints->rules =
+        malloc(sizeof(Constraint) * (rule_count > 0 ? rule_count : 1));
+    if (!constraints->rules) {
+        return false;
+    }
+    constraints->capacity = (int)(rule_count > 0 ? rule_count : 1);
+
+    for (uint32_t i = 0; i < rule_count; i++) {
+        uint32_t kind = blob_read_u32(reader);
+        uint32_t index = blob_read_u32(reader);
+        uint32_t other = blob_read_u32(reader);
+        uint32_t option_count = (uint32_t)parser->option_vec->count;
+        if (kind > CONSTRAINT_CONFLICTS || index >= option_count ||
+            other >= option_count) {
+            return false;
+        }
+        constraints->rules[constraints->count++] =
+            (Constraint){(ConstraintKind)kind, (int)index, (int)other};
+    }
 
-// Returns the value of the specified floating-point option.
-double ap_get_dbl_value(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return option_get_double(opt);
-}
+    uint32_t command_count = blob_read_u32(reader);
+    if (!reader->ok || command_count > INT_MAX ||
+        !vec_reserve(parser->command_vec, (int)command_count)) {
+        return false;
+    }
 
+    for (uint32_t i = 0; i < command_count && reader->ok; i++) {
+        ArgParser* cmd_parser = ap_new_parser();
+        if (!cmd_parser) {
+            return false;
+        }
+        cmd_parser->root_parser = parser->root_parser;
+        cmd_parser->parent = parser;
+        if (!vec_add(parser->command_vec, cmd_parser)) {
+            ap_free(cmd_parser);
+            return false;
+        }
+        if (!ap_read_spec(cmd_parser, reader)) {
+            return false;
+        }
+    }
 
-// Returns the floating-point value at the specified index.
-double ap_get_dbl_value_at_index(ArgParser* parser, const char* name, int index) {
-    Option* opt = ap_get_opt(parser, name);
-    return opt->values[index].dbl_val;
-}
+    uint32_t command_key_count = blob_read_u32(reader);
+    if (!reader->ok || command_key_count > INT_MAX ||
+        !map_reserve(parser->command_map, (int)command_key_count)) {
+        return false;
+    }
 
+    for (uint32_t i = 0; i < command_key_count && reader->ok; i++) {
+        char* key = blob_read_str(reader);
+        uint32_t index = blob_read_u32(reader);
+        if (!key || index >= (uint32_t)parser->command_vec->count) {
+            return false;
+        }
+        ArgParser* cmd_parser = parser->command_vec->entries[index];
+        if (!map_set(parser->command_map, key, cmd_parser) ||
+            !trie_set(parser->command_trie, key, cmd_parser)) {
+            return false;
+        }
+    }
 
-// Returns an option's values as a freshly-allocated array of string pointers.
-// The array's memory is not affected by calls to ap_free().
-// Returns NULL if memory cannot be allocated for the array.
-char** ap_get_str_values(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return (char**)option_get_str_list(opt);
+    return reader->ok && !parser->had_memory_error;
 }
 
 
-// Returns an option's values as a freshly-allocated array of integers. The
-// array's memory is not affected by calls to ap_free().
-// Returns NULL if memory cannot be allocated for the array.
-int* ap_get_int_values(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return option_get_int_list(opt);
-}
+ArgParser* ap_load_spec(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
 
+    uint32_t header[2];
+    if (fread(header, sizeof(uint32_t), 2, file) != 2 ||
+        header[0] != SPEC_MAGIC || header[1] < sizeof(header)) {
+        fclose(file);
+        return NULL;
+    }
 
-// Returns an option's values as a freshly-allocated array of doubles. The
-// array's memory is not affected by calls to ap_free().
-// Returns NULL if memory cannot be allocated for the array.
-double* ap_get_dbl_values(ArgParser* parser, const char* name) {
-    Option* opt = ap_get_opt(parser, name);
-    return option_get_double_list(opt);
-}
+    size_t size = header[1];
+    char* image = malloc(size);
+    if (!image) {
+        fclose(file);
+        return NULL;
+    }
 
+    memcpy(image, header, sizeof(header));
+    size_t body_size = size - sizeof(header);
+    bool ok = fread(image + sizeof(header), 1, body_size, file) == body_size;
+    fclose(file);
 
-/* -------------------------------- */
-/* ArgParser: positional arguments. */
-/* -------------------------------- */
+    ArgParser* parser = ok ? ap_new_parser() : NULL;
+    if (!parser) {
+        free(image);
+        return NULL;
+    }
 
+    // The parser owns the image. String fallback values point directly into it.
+    parser->spec_image = image;
 
-// Returns true if the parser has found one or more positional arguments.
-bool ap_has_args(ArgParser* parser) {
-    return parser->positional_args->count > 0;
+    BlobReader reader = {(uint8_t*)image, size, sizeof(header), true};
+    if (!ap_read_spec(parser, &reader) || reader.pos != size) {
+        ap_free(parser);
+        return NULL;
+    }
+
+    return parser;
 }
 
 
-// Returns the number of positional arguments.
-int ap_count_args(ArgParser* parser) {
-    return parser->positional_args->count;
-}
+// Copies the parser's loaded config file into [dst], pointing each entry at the
+// option with the same index in [dst]. Only the part of the file holding values
+// is copied. Returns false if memory cannot be allocated.
+static bool ap_copy_config(ArgParser* src, ArgParser* dst) {
+    ConfigSource* config = &src->config;
+    if (config->count == 0) {
+        return true;
+    }
+
+    size_t size = 0;
+    for (int i = 0; i < config->count; i++) {
+        char* value = config->entries[i].value;
+        size_t end = (size_t)(value - config->image) + strlen(value) + 1;
+        size = end > size ? end : size;
+    }
 
+    ConfigSource* copy = &dst->config;
+    copy->path = str_dup(config->path);
+    copy->image = malloc(size);
+    copy->entries = malloc(sizeof(ConfigEntry) * config->count);
+    if (!copy->path || !copy->image || !copy->entries) {
+        config_source_free(copy);
+        return false;
+    }
 
-// Returns the positional argument at the specified index.
-char* ap_get_arg_at_index(ArgParser* parser, int index) {
-    return (char*)parser->positional_args->entries[index];
+    memcpy(copy->image, config->image, size);
+    for (int i = 0; i < config->count; i++) {
+        ConfigEntry* entry = &config->entries[i];
+        copy->entries[i] = (ConfigEntry){
+            dst->option_vec->entries[entry->opt->index],
+            copy->image + (entry->value - config->image),
+            entry->line,
+        };
+    }
+    copy->count = config->count;
+    copy->capacity = config->count;
+    return true;
 }
 
 
-// Returns the positional arguments as a freshly-allocated array of string
-// pointers. The memory occupied by the returned array is not affected by
-// calls to ap_free().
-// Returns NULL if memory cannot be allocated for the array.
-char** ap_get_args(ArgParser* parser) {
-    int count = ap_count_args(parser);
-    char** args = malloc(sizeof(char*) * count);
-    if (!args) {
-        return NULL;
+// Copies the settings that aren't part of a spec image, including any loaded
+// config files. Command parsers are stored in the same order in both trees.
+// Returns false if memory cannot be allocated.
+static bool ap_copy_unsaved_settings(ArgParser* src, ArgParser* dst) {
+    dst->cmd_callback = src->cmd_callback;
+    dst->resolver = src->resolver;
+    dst->resolver_context = src->resolver_context;
+    if (!ap_copy_config(src, dst)) {
+        return false;
     }
-    memcpy(args, parser->positional_args->entries, sizeof(char*) * count);
-    return args;
+    for (int i = 0; i < src->command_vec->count; i++) {
+        ArgParser* src_cmd = src->command_vec->entries[i];
+        ArgParser* dst_cmd = dst->command_vec->entries[i];
+        if (!ap_copy_unsaved_settings(src_cmd, dst_cmd)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 
-// Attempts to parse and return the positional arguments as a freshly
-// allocated array of integers. Exits with an error message on failure. The
-// memory occupied by the returned array is not affected by calls to
-// ap_free().
-// Returns NULL if memory cannot be allocated for the array.
-int* ap_get_args_as_ints(ArgParser* parser) {
-    int count = ap_count_args(parser);
-    int* args = malloc(sizeof(int) * count);
-    if (!args) {
+// Creates an independent copy of the parser's registered flags, options,
+// commands, and settings by round-tripping the parser through an in-memory spec
+// image. Callbacks and loaded config files aren't part of the image so they're
+// copied separately. Parse results aren't copied.
+ArgParser* ap_clone(ArgParser* parser) {
+    size_t size;
+    uint8_t* image = ap_spec_to_image(parser, &size);
+    if (!image) {
         return NULL;
     }
-    for (int i = 0; i < count; i++) {
-        *(args + i) = try_str_to_int(parser->positional_args->entries[i]);
+
+    ArgParser* clone = ap_new_parser();
+    if (!clone) {
+        free(image);
+        return NULL;
     }
-    return args;
-}
 
+    clone->spec_image = (char*)image;
 
-// Attempts to parse and return the positional arguments as a freshly
-// allocated array of doubles. Exits with an error message on failure. The
-// memory occupied by the returned array is not affected by calls to
-// ap_free().
-// Returns NULL if memory cannot be allocated for the array.
-double* ap_get_args_as_doubles(ArgParser* parser) {
-    int count = ap_count_args(parser);
-    double *args = malloc(sizeof(double) * count);
-    if (!args) {
+    BlobReader reader = {image, size, 2 * sizeof(uint32_t), true};
+    if (!ap_read_spec(clone, &reader) || clone->had_memory_error) {
+        ap_free(clone);
         return NULL;
     }
-    for (int i = 0; i < count; i++) {
-        *(args + i) = try_str_to_double(parser->positional_args->entries[i]);
+
+    if (!ap_copy_unsaved_settings(parser, clone)) {
+        ap_free(clone);
+        return NULL;
     }
-    return args;
+    clone->exit_on_error = parser->root_parser->exit_on_error;
+    clone->record_parse_order = parser->root_parser->record_parse_order;
+    return clone;
 }
 
 
-/* -------------------- */
-/* ArgParser: commands. */
-/* -------------------- */
+/* ------------------------- */
+/* ArgParser: batch parsing. */
+/* ------------------------- */
 
 
-ArgParser* ap_new_cmd(ArgParser* parent_parser, const char* name) {
-    ArgParser* cmd_parser = ap_new_parser();
-    if (!cmd_parser) {
-        return NULL;
+bool ap_parse_batch(ArgParser* parser, char* manifest,
+    ap_batch_callback_t callback, void* context) {
+    ap_check_not_frozen(parser);
+
+    // Find the longest record so a single token array can be reused for every
+    // record.
+    size_t max_length = 0;
+    for (char* line = manifest; *line != '\0';) {
+        char* end = strchr(line, '\n');
+        size_t length = end ? (size_t)(end - line) : strlen(line);
+        if (length > max_length) {
+            max_length = length;
+        }
+        line += end ? length + 1 : length;
     }
 
-    cmd_parser->root_parser = parent_parser->root_parser;
+    char** tokens = malloc(sizeof(char*) * ((max_length + 1) / 2 + 1));
+    if (!tokens) {
+        ap_set_memory_error_flag(parser);
+        return false;
+    }
 
-    if (vec_add(parent_parser->command_vec, cmd_parser)) {
-        if (map_set_splitkey(parent_parser->command_map, name, cmd_parser)) {
-            parent_parser->enable_help_command = true;
-            return cmd_parser;
+    ArgParser* root = parser->root_parser;
+    bool exit_on_error = root->exit_on_error;
+    root->exit_on_error = false;
+    root->in_parse = true;
+
+    size_t record = 0;
+    for (char* line = manifest; *line != '\0' && !parser->had_memory_error;
+        record++) {
+        char* end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+
+        ap_reset(parser);
+        int count = tokenize_in_place(line, tokens);
+        if (count < 0) {
+            ap_error(parser, "unterminated quote in command string");
         } else {
-            parent_parser->command_vec--;
-            ap_free(cmd_parser);
-            return NULL;
+            ArgStream stream = {.count = count, .index = 0, .args = tokens};
+            ap_parse_stream(parser, &stream);
         }
-    } else {
-        ap_free(cmd_parser);
+
+        if (!parser->had_memory_error) {
+            callback(parser, record, context);
+        }
+
+        line = end ? end + 1 : line + strlen(line);
+    }
+
+    root->exit_on_error = exit_on_error;
+    root->in_parse = false;
+    free(tokens);
+    return !parser->had_memory_error;
+}
+
+
+/* ------------------------ */
+/* ArgParser: config files. */
+/* ------------------------ */
+
+
+// Reads the file at [path] into a freshly-allocated, NUL-terminated buffer.
+// Returns NULL if the file cannot be read or memory cannot be allocated.
+static char* read_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
         return NULL;
     }
-}
 
+    char* buf = NULL;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 &&
+        fseek(file, 0, SEEK_SET) == 0) {
+        buf = malloc((size_t)size + 1);
+    }
+
+    if (buf && fread(buf, 1, (size_t)size, file) != (size_t)size) {
+        free(buf);
+        buf = NULL;
+    }
 
-void ap_set_cmd_callback(ArgParser* cmd_parser, ap_callback_t cmd_callback) {
-    cmd_parser->cmd_callback = cmd_callback;
+    fclose(file);
+    if (buf) {
+        buf[size] = '\0';
+    }
+    return buf;
 }
 
 
-bool ap_found_cmd(ArgParser* parent_parser) {
-    return parent_parser->cmd_name != NULL;
+static bool is_config_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
 }
 
 
-char* ap_get_cmd_name(ArgParser* parent_parser) {
-    return parent_parser->cmd_name;
+static bool config_add_entry(ConfigSource* config, Option* opt, char* value,
+    int line) {
+    if (config->count == config->capacity) {
+        int new_capacity = config->capacity < 16 ? 16 : config->capacity * 2;
+        ConfigEntry* new_entries =
+            realloc(config->entries, sizeof(ConfigEntry) * new_capacity);
+        if (!new_entries) {
+            return false;
+        }
+        config->entries = new_entries;
+        config->capacity = new_capacity;
+    }
+    config->entries[config->count++] = (ConfigEntry){opt, value, line};
+    return true;
 }
 
 
-ArgParser* ap_get_cmd_parser(ArgParser* parent_parser) {
-    return parent_parser->cmd_parser;
-}
+// Parses the 'key = value' lines of a config file in place. Keys are looked up
+// without being copied or terminated; values are trimmed and terminated within
+// the buffer.
+static bool ap_parse_config(ArgParser* parser, ConfigSource* config) {
+    int line_number = 0;
 
+    for (char* line = config->image; *line != '\0';) {
+        line_number++;
+        char* end = strchr(line, '\n');
+        char* next = end ? end + 1 : line + strlen(line);
+        if (end) {
+            *end = '\0';
+        }
 
-int ap_get_cmd_exit_code(ArgParser* parent_parser) {
-    return parent_parser->cmd_callback_exit_code;
-}
+        while (is_config_space(*line)) {
+            line++;
+        }
 
+        if (*line == '\0' || *line == '#' || *line == ';') {
+            line = next;
+            continue;
+        }
 
-void ap_enable_help_command(ArgParser* parent_parser, bool enable) {
-    parent_parser->enable_help_command = enable;
-}
+        char* equals = strchr(line, '=');
+        if (!equals) {
+            ap_error(parser, "%s:%d: expected 'key = value'", config->path,
+                line_number);
+            return false;
+        }
 
+        char* key_end = equals;
+        while (key_end > line && is_config_space(key_end[-1])) {
+            key_end--;
+        }
+        size_t key_len = key_end - line;
 
-ArgParser* ap_get_parent(ArgParser* parser) {
-    return parser->parent;
+        char* value = equals + 1;
+        while (is_config_space(*value)) {
+            value++;
+        }
+        char* value_end = value + strlen(value);
+        while (value_end > value && is_config_space(value_end[-1])) {
+            value_end--;
+        }
+        if (value_end - value >= 2 && *value == '"' && value_end[-1] == '"') {
+            value++;
+            value_end--;
+        }
+        *value_end = '\0';
+
+        Option* opt;
+        if (!map_get_n(parser->option_map, line, key_len, (void**)&opt) ||
+            opt->is_family) {
+            const char* suggestion =
+                ap_suggest_opt_name(parser, line, key_len, true);
+            if (suggestion) {
+                ap_error(parser,
+                    "%s:%d: '%.*s' is not a recognised option name; did you "
+                    "mean '%s'?",
+                    config->path, line_number, (int)key_len, line, suggestion);
+            } else {
+                ap_error(parser,
+                    "%s:%d: '%.*s' is not a recognised option name",
+                    config->path, line_number, (int)key_len, line);
+            }
+            return false;
+        }
+
+        if (!config_add_entry(config, opt, value, line_number)) {
+            ap_set_memory_error_flag(parser);
+            return false;
+        }
+
+        line = next;
+    }
+
+    return true;
 }
 
 
-/* --------------------------- */
-/* ArgParser: parse arguments. */
-/* --------------------------- */
+// Reads and parses the config file at [path] into [config].
+static bool ap_read_config(ArgParser* parser, const char* path,
+    ConfigSource* config) {
+    *config = (ConfigSource){NULL, NULL, NULL, 0, 0};
 
+    config->image = read_file(path);
+    if (!config->image) {
+        return false;
+    }
 
-// Parse an option of the form --name=value or -n=value.
-static void ap_handle_equals_opt(ArgParser* parser, const char* prefix, const char* arg, ArgStream* stream) {
-    char* array = str_dup(arg);
-    if (!array) {
+    config->path = str_dup(path);
+    if (!config->path) {
+        config_source_free(config);
         ap_set_memory_error_flag(parser);
-        return;
+        return false;
+    }
+
+    if (!ap_parse_config(parser, config)) {
+        config_source_free(config);
+        return false;
     }
 
-    *strchr(array, '=') = '\0';
-    char* name = array;
-    char* value = strchr(arg, '=') + 1;
+    return true;
+}
 
-    Option* option;
-    bool found = map_get(parser->option_map, name, (void**)&option);
 
-    if (!found) {
-        free(array);
-        exit_with_error("%s%s is not a recognised option name", prefix, name);
-    }
+// Errors are recorded for ap_get_error() rather than reported, whatever the
+// exit-on-error setting, so the caller can decide whether a bad file is fatal.
+// Parsing isn't halted.
+bool ap_load_config(ArgParser* parser, const char* path) {
+    ap_check_not_frozen(parser);
 
-    if (option->type == OPT_FLAG) {
-        free(array);
-        exit_with_error("flag %s%s does not accept an argument", prefix, name);
-    }
+    ArgParser* root = parser->root_parser;
+    bool exit_on_error = root->exit_on_error;
+    root->exit_on_error = false;
+    free(root->error_message);
+    root->error_message = NULL;
 
-    if (strlen(value) == 0) {
-        free(array);
-        exit_with_error("missing argument for %s%s", prefix, name);
+    ConfigSource config;
+    bool ok = ap_read_config(parser, path, &config);
+    if (!ok && !root->error_message && !parser->had_memory_error) {
+        ap_error(parser, "cannot read config file '%s'", path);
     }
 
-    if (!option_try_set(option, value)) {
-        ap_set_memory_error_flag(parser);
+    root->exit_on_error = exit_on_error;
+    root->halted = false;
+    if (!ok) {
+        return false;
     }
 
-    if (option->is_greedy) {
-        while (argstream_has_next(stream)) {
-            if (!option_try_set(option, argstream_next(stream))) {
-                ap_set_memory_error_flag(parser);
+    config_source_free(&parser->config);
+    parser->config = config;
+    return true;
+}
+
+
+// Returns true if the two options hold the same values. Flags store no values
+// so only their counts are compared.
+static bool option_values_equal(Option* a, Option* b) {
+    if (a->count != b->count) {
+        return false;
+    }
+    if (option_has_str_values(a)) {
+        for (int i = 0; i < a->count; i++) {
+            if (strcmp(a->values.str_vals[i], b->values.str_vals[i]) != 0) {
+                return false;
             }
         }
+        return true;
     }
+    size_t size = option_value_size(a) * (size_t)a->count;
+    return size == 0 || memcmp(a->values.data, b->values.data, size) == 0;
+}
+
 
-    free(array);
+// Exchanges the state of an option and its staged copy. The swap only moves
+// pointers and counts.
+static void option_swap(Option* a, Option* b) {
+    Option tmp = *a;
+    *a = *b;
+    *b = tmp;
 }
 
 
-// Parse a long-form option, i.e. an option beginning with a double dash.
-static void ap_handle_long_opt(ArgParser* parser, const char* arg, ArgStream* stream) {
-    Option* option;
+// Returns true if the option's values can come from the config file.
+static bool option_is_reloadable(Option* opt) {
+    return opt->source == AP_SOURCE_FALLBACK || opt->source == AP_SOURCE_CONFIG;
+}
 
-    if (map_get(parser->option_map, arg, (void**)&option)) {
-        if (option->type == OPT_FLAG) {
-            option->count++;
-            return;
-        }
 
-        if (argstream_has_next(stream) && option->is_greedy) {
-            while (argstream_has_next(stream)) {
-                if (!option_try_set(option, argstream_next(stream))) {
-                    ap_set_memory_error_flag(parser);
-                }
-            }
-            return;
+// Frees the values and lookup table of each reloadable option's staged copy.
+static void ap_free_staged(Option* staged, int count) {
+    for (int i = 0; i < count; i++) {
+        if (option_is_reloadable(&staged[i])) {
+            free(staged[i].values.data);
+            map_free(staged[i].lookup);
         }
+    }
+    free(staged);
+}
 
-        if (argstream_has_next(stream)) {
-            if (!option_try_set(option, argstream_next(stream))) {
-                ap_set_memory_error_flag(parser);
-            }
-            return;
-        }
 
-        exit_with_error("missing argument for --%s", arg);
-    }
+// Re-reads the config file and applies the difference to the options that
+// didn't come from the command line or the environment. The new values are
+// built in staged copies of the affected options while the live options keep
+// their current values. The copies are then swapped in and the parser's
+// constraints are checked; on failure they're swapped back out, so callers only
+// ever see the complete old state or the complete new one. After a successful
+// swap the copies hold the old values, so they can be compared with the new
+// ones without copying.
+bool ap_reload_config(ArgParser* parser, ap_reload_callback_t callback,
+    void* context) {
+    ap_check_not_frozen(parser);
 
-    if (strcmp(arg, "help") == 0 && parser->helptext != NULL) {
-        puts(parser->helptext);
-        exit(0);
+    if (!parser->config.path) {
+        return false;
     }
 
-    if (strcmp(arg, "version") == 0 && parser->version != NULL) {
-        puts(parser->version);
-        exit(0);
+    ArgParser* root = parser->root_parser;
+    root->halted = false;
+    free(root->error_message);
+    root->error_message = NULL;
+    root->in_parse = true;
+
+    ConfigSource config;
+    if (!ap_read_config(parser, parser->config.path, &config)) {
+        root->in_parse = false;
+        return false;
     }
 
-    exit_with_error("--%s is not a recognised flag or option name", arg);
-}
+    int count = parser->option_vec->count;
+    Option* staged = malloc(sizeof(Option) * (count > 0 ? count : 1));
+    if (!staged) {
+        config_source_free(&config);
+        ap_set_memory_error_flag(parser);
+        root->in_parse = false;
+        return false;
+    }
 
+    // Options set from the command line or the environment are copied as they
+    // are and skipped.
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        Option* opt = parser->option_vec->entries[i];
+        staged[i] = *opt;
+        if (!option_is_reloadable(opt)) {
+            continue;
+        }
+        staged[i].count = 0;
+        staged[i].capacity = 0;
+        staged[i].values.data = NULL;
+        option_set_source(&staged[i], AP_SOURCE_FALLBACK, NULL, 0, -1);
+        if (opt->lookup) {
+            staged[i].lookup = ok ? map_new() : NULL;
+            if (staged[i].lookup) {
+                staged[i].lookup->owns_keys = false;
+            } else {
+                ok = false;
+            }
+        }
+    }
 
-// Parse a short-form option, i.e. an option beginning with a single dash.
-static void ap_handle_short_opt(ArgParser* parser, const char* arg, ArgStream* stream) {
-    for (size_t i = 0; i < strlen(arg); i++) {
-        char keystr[] = {arg[i], 0};
-        Option* option;
+    if (!ok) {
+        ap_free_staged(staged, count);
+        config_source_free(&config);
+        ap_set_memory_error_flag(parser);
+        root->in_parse = false;
+        return false;
+    }
 
-        bool found = map_get(parser->option_map, keystr, (void**)&option);
-        if (!found) {
-            if (arg[i] == 'h' && parser->helptext != NULL) {
-                puts(parser->helptext);
-                exit(0);
+    ConfigSource old_config = parser->config;
+    parser->config = config;
+    ap_apply_config(parser, staged);
+    ok = !parser->had_memory_error && !ap_halted(parser);
+
+    // Publish the new values, then check that the parser's constraints still
+    // hold.
+    if (ok) {
+        for (int i = 0; i < count; i++) {
+            if (option_is_reloadable(&staged[i])) {
+                option_swap(parser->option_vec->entries[i], &staged[i]);
             }
-            if (arg[i] == 'v' && parser->version != NULL) {
-                puts(parser->version);
-                exit(0);
-            }
-            if (strlen(arg) > 1) {
-                exit_with_error("'%c' in -%s is not a recognised flag or option name", arg[i], arg);
-            }
-            exit_with_error("-%s is not a recognised flag or option name", arg);
         }
-
-        if (option->type == OPT_FLAG) {
-            option->count++;
-            continue;
+        if (parser->constraints.count > 0) {
+            ap_check_constraints(parser);
+            ok = !parser->had_memory_error && !ap_halted(parser);
         }
-
-        if (argstream_has_next(stream) && option->is_greedy) {
-            while (argstream_has_next(stream)) {
-                if (!option_try_set(option, argstream_next(stream))) {
-                    ap_set_memory_error_flag(parser);
+        if (!ok) {
+            for (int i = 0; i < count; i++) {
+                if (option_is_reloadable(&staged[i])) {
+                    option_swap(parser->option_vec->entries[i], &staged[i]);
                 }
             }
-            continue;
         }
+    }
 
-        if (argstream_has_next(stream)) {
-            if (!option_try_set(option, argstream_next(stream))) {
-                ap_set_memory_error_flag(parser);
+    if (ok && callback) {
+        for (int i = 0; i < count; i++) {
+            Option* opt = parser->option_vec->entries[i];
+            if (!option_is_reloadable(&staged[i]) ||
+                option_values_equal(&staged[i], opt)) {
+                continue;
             }
-            continue;
+            ApChange change = {
+                .name = ap_get_opt_long_name(parser, opt),
+                .old_count = staged[i].count,
+                .old_values =
+                    staged[i].type == OPT_FLAG ? NULL : staged[i].values.data,
+                .new_count = opt->count,
+                .new_values = opt->type == OPT_FLAG ? NULL : opt->values.data,
+            };
+            callback(parser, &change, context);
         }
+    }
 
-        if (strlen(arg) > 1) {
-            exit_with_error("missing argument for '%c' in -%s", arg[i], arg);
-        }
+    ap_free_staged(staged, count);
 
-        exit_with_error("missing argument for -%s", arg);
+    if (ok) {
+        config_source_free(&old_config);
+    } else {
+        config_source_free(&parser->config);
+        parser->config = old_config;
     }
+
+    root->in_parse = false;
+    return ok;
 }
 
 
-// Parse a stream of string arguments.
-static void ap_parse_stream(ArgParser* parser, ArgStream* stream) {
-    if (parser->had_memory_error) {
-        return;
-    }
+ApSource ap_get_source(ArgParser* parser, const char* name) {
+    Option* opt = ap_get_opt(parser, name);
+    return (ApSource){
+        .kind = opt->source,
+        .name = opt->source_name,
+        .name_len = opt->source_name_len,
+        .index = opt->source_index,
+    };
+}
 
-    if (parser->all_args_as_pos_args) {
-        while (argstream_has_next(stream)) {
-            if (!vec_add(parser->positional_args, argstream_next(stream))) {
-                ap_set_memory_error_flag(parser);
-            }
-        }
-        return;
+
+/* ------------------------- */
+/* ArgParser: frozen layout. */
+/* ------------------------- */
+
+
+// Updates the Option pointers cached in a trie after the options have been
+// moved.
+static void ap_remap_trie_node(TrieNode* node, Option** moved) {
+    if (node->value) {
+        node->value = moved[((Option*)node->value)->index];
+    }
+    if (node->subtree_value && node->subtree_value != TRIE_AMBIGUOUS) {
+        node->subtree_value = moved[((Option*)node->subtree_value)->index];
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        ap_remap_trie_node(node->children[i], moved);
     }
+}
 
-    while (argstream_has_next(stream)) {
-        ArgParser* cmd_parser;
-        char* arg = argstream_next(stream);
 
-        // If we encounter a '--' argument, turn off option-parsing.
-        if (strcmp(arg, "--") == 0) {
-            while (argstream_has_next(stream)) {
-                if (!vec_add(parser->positional_args, argstream_next(stream))) {
-                    ap_set_memory_error_flag(parser);
-                }
-            }
-        }
+// Returns the number of bytes the option's values occupy in a frozen block,
+// padded so the next option stays suitably aligned.
+static size_t ap_frozen_values_size(Option* opt) {
+    size_t size = option_value_size(opt) * (size_t)opt->count;
+    size_t alignment = sizeof(OptionValue);
+    return (size + alignment - 1) / alignment * alignment;
+}
 
-        // Is the argument a long-form option or flag?
-        else if (strncmp(arg, "--", 2) == 0) {
-            if (strstr(arg, "=") != NULL) {
-                ap_handle_equals_opt(parser, "--", arg + 2, stream);
-            } else {
-                ap_handle_long_opt(parser, arg + 2, stream);
-            }
-        }
 
-        // Is the argument a short-form option or flag?
-        else if (arg[0] == '-') {
-            if (strlen(arg) == 1 || isdigit(arg[1])) {
-                if (!vec_add(parser->positional_args, arg)) {
-                    ap_set_memory_error_flag(parser);
-                }
-            } else if (strstr(arg, "=") != NULL) {
-                ap_handle_equals_opt(parser, "-", arg + 1, stream);
-            } else {
-                ap_handle_short_opt(parser, arg + 1, stream);
-            }
-        }
+// Moves the parser's options, their values, and its option names into a single
+// block of memory. Each option is immediately followed by its values; the names
+// are stored after the options.
+static bool ap_freeze_parser(ArgParser* parser) {
+    Vec* options = parser->option_vec;
+    Map* map = parser->option_map;
 
-        // Is the argument a registered command?
-        else if (parser->positional_args->count == 0 && map_get(parser->command_map, arg, (void**)&cmd_parser)) {
-            parser->cmd_name = arg;
-            parser->cmd_parser = cmd_parser;
-            ap_parse_stream(cmd_parser, stream);
-            if (cmd_parser->cmd_callback && !parser->had_memory_error) {
-                parser->cmd_callback_exit_code = cmd_parser->cmd_callback(arg, cmd_parser);
-            }
+    size_t size = 0;
+    for (int i = 0; i < options->count; i++) {
+        Option* opt = options->entries[i];
+        size += sizeof(Option) + ap_frozen_values_size(opt);
+    }
+    for (int i = 0; i < map->capacity; i++) {
+        if (map->entries[i].key != NULL) {
+            size += strlen(map->entries[i].key) + 1;
         }
+    }
 
-        // Is the argument the automatic 'help' command?
-        else if (parser->positional_args->count == 0 && parser->enable_help_command && strcmp(arg, "help") == 0) {
-            if (argstream_has_next(stream)) {
-                char* name = argstream_next(stream);
-                if (map_get(parser->command_map, name, (void**)&cmd_parser)) {
-                    if (cmd_parser->helptext) {
-                        puts(cmd_parser->helptext);
-                    }
-                    exit(0);
-                } else {
-                    exit_with_error("'%s' is not a recognised command", name);
-                }
-            } else {
-                exit_with_error("the 'help' command requires an argument");
-            }
+    char* block = malloc(size > 0 ? size : 1);
+    Option** moved =
+        malloc(sizeof(Option*) * (options->count > 0 ? options->count : 1));
+    if (!block || !moved) {
+        free(block);
+        free(moved);
+        return false;
+    }
+
+    char* cursor = block;
+    for (int i = 0; i < options->count; i++) {
+        Option* opt = options->entries[i];
+        size_t values_size = ap_frozen_values_size(opt);
+        Option* new_opt = (Option*)cursor;
+        *new_opt = *opt;
+        new_opt->capacity = values_size > 0 ? opt->count : 0;
+        new_opt->values.data = values_size > 0 ? cursor + sizeof(Option) : NULL;
+        if (values_size > 0) {
+            memcpy(new_opt->values.data, opt->values.data,
+                option_value_size(opt) * opt->count);
         }
+        moved[i] = new_opt;
+        cursor += sizeof(Option) + values_size;
+    }
 
-        // Otherwise add the argument to our list of positionals.
-        else {
-            if (!vec_add(parser->positional_args, arg)) {
-                ap_set_memory_error_flag(parser);
-            }
-            if (parser->first_pos_arg_ends_option_parsing) {
-                while (argstream_has_next(stream)) {
-                    if (!vec_add(parser->positional_args, argstream_next(stream))) {
-                        ap_set_memory_error_flag(parser);
-                    }
-                }
+    for (int i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->key != NULL) {
+            size_t length = strlen(entry->key) + 1;
+            memcpy(cursor, entry->key, length);
+            if (map->owns_keys) {
+                free(entry->key);
             }
+            entry->key = cursor;
+            entry->value = moved[((Option*)entry->value)->index];
+            cursor += length;
         }
     }
-}
+    map->owns_keys = false;
 
+    ap_remap_trie_node(parser->option_trie->root, moved);
+    if (parser->family_trie) {
+        ap_remap_trie_node(parser->family_trie->root, moved);
+    }
 
-// Parse an array of string arguments. We assume that [argc] and [argv] are the arguments passed to
-// main(), i.e. we ignore the first element in the array. In some situations [argv] can be empty,
-// i.e. [argc == 0], which can lead to security vulnerabilities if not explicitly handled.
-bool ap_parse(ArgParser* parser, int argc, char** argv) {
-    if (parser->had_memory_error) {
-        return false;
+    for (int i = 0; i < options->count; i++) {
+        Option* old_opt = options->entries[i];
+        old_opt->choices = NULL;
+        old_opt->lookup = NULL;
+        option_free(old_opt);
+        options->entries[i] = moved[i];
     }
 
-    if (argc == 0) {
+    free(moved);
+    parser->frozen_block = block;
+    return true;
+}
+
+
+bool ap_freeze(ArgParser* parser) {
+    if (parser->frozen_block) {
         return true;
     }
 
-    parser->zeroth_root_arg = argv[0];
-
-    ArgStream* stream = argstream_new(argc - 1 , argv + 1);
-    if (!stream) {
+    if (!ap_freeze_parser(parser)) {
+        ap_set_memory_error_flag(parser);
         return false;
     }
 
-    ap_parse_stream(parser, stream);
-    argstream_free(stream);
+    for (int i = 0; i < parser->command_vec->count; i++) {
+        if (!ap_freeze(parser->command_vec->entries[i])) {
+            return false;
+        }
+    }
 
-    return !parser->had_memory_error;
+    for (int i = 0; i < ap_count_chained_cmds(parser); i++) {
+        ChainedCmd* link = parser->chained_cmds->entries[i];
+        if (link->is_clone && !ap_freeze(link->parser)) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 
@@ -1377,6 +6151,11 @@ bool ap_had_memory_error(ArgParser* parser) {
 }
 
 
+char* ap_get_error(ArgParser* parser) {
+    return parser->root_parser->error_message;
+}
+
+
 void ap_print(ArgParser* parser) {
     puts("Flags/Options:");
     if (parser->option_map->count > 0) {
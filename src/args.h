@@ -7,6 +7,8 @@
 #define args_h
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // -----------------------------------------------------------------------------
 // Types.
@@ -15,10 +17,114 @@
 // An ArgParser instance stores registered flags, options and commands.
 typedef struct ArgParser ArgParser;
 
+// Identifies the kind of flag or option described by an ApOptionSpec.
+typedef enum {
+    AP_FLAG,
+    AP_STR_OPT,
+    AP_INT_OPT,
+    AP_DBL_OPT,
+    AP_GREEDY_STR_OPT,
+} ApOptionKind;
+
+// Describes a flag or option for bulk registration using ap_add_options().
+// Only the fallback field matching [kind] is used.
+typedef struct {
+    ApOptionKind kind;
+    const char* name;
+    const char* str_fallback;
+    int int_fallback;
+    double dbl_fallback;
+} ApOptionSpec;
+
+// An argument supplied as a pointer/length pair for ap_parse_spans(). The
+// data needn't be NUL-terminated.
+typedef struct {
+    const char* data;
+    size_t length;
+} ApSpan;
+
+// Identifies where a flag or option's value came from.
+typedef enum {
+    AP_SOURCE_FALLBACK,
+    AP_SOURCE_ARGV,
+    AP_SOURCE_ENV,
+    AP_SOURCE_CONFIG,
+} ApSourceKind;
+
+// Describes where a flag or option's value came from, as returned by
+// ap_get_source().
+// - AP_SOURCE_FALLBACK: the option wasn't found; [name] is NULL and [index] is
+//   -1.
+// - AP_SOURCE_ARGV: [index] is the position in the argument array of the
+//   argument naming the option; [name] is NULL.
+// - AP_SOURCE_ENV: [name] points to the environment variable's name, which is
+//   [name_len] bytes long and not NUL-terminated; [index] is -1.
+// - AP_SOURCE_CONFIG: [name] is the config file's path and [index] is the
+//   line number.
+typedef struct {
+    ApSourceKind kind;
+    const char* name;
+    size_t name_len;
+    int index;
+} ApSource;
+
+// Describes a flag or option whose value was changed by ap_reload_config().
+// [old_values] and [new_values] point to arrays of char*, int, or double to
+// match the option's type, or are NULL for flags; the counts give their
+// lengths. For a flag, the counts are the number of times it was set.
+typedef struct {
+    const char* name;
+    int old_count;
+    const void* old_values;
+    int new_count;
+    const void* new_values;
+} ApChange;
+
+// A flag, option value, or positional argument found while parsing, as
+// returned by ap_iter_in_order(). [name] is the longest name of the flag or
+// option, or NULL for a positional argument. [value] is the argument's
+// unconverted value, or NULL for a flag. [argv_index] is the position in the
+// argument array of the argument the value was read from.
+typedef struct {
+    const char* name;
+    const char* value;
+    int argv_index;
+} ApEvent;
+
+// A handle for the options named '[prefix].*', e.g. the namespace 'db.pool'
+// holds --db.pool.size and --db.pool.timeout. The handle caches the hash of
+// its prefix so lookups only hash the remainder of each name. [prefix] isn't
+// copied and must outlive the handle.
+typedef struct {
+    ArgParser* parser;
+    const char* prefix;
+    size_t prefix_len;
+    uint32_t prefix_hash;
+} ApNamespace;
+
+// A reload callback is called by ap_reload_config() for each changed flag or
+// option. It receives the parser, the change, and the context pointer
+// supplied to ap_reload_config(). The change is only valid during the call.
+typedef void (*ap_reload_callback_t)(ArgParser* parser, const ApChange* change,
+    void* context);
+
 // A callback function should accept two arguments: the command's name and the
 // command's ArgParser instance. It should return an integer status code.
 typedef int (*ap_callback_t)(char* cmd_name, ArgParser* cmd_parser);
 
+// A batch callback is called by ap_parse_batch() after each record has been
+// parsed. It receives the parser holding the record's results, the record's
+// zero-based index, and the context pointer supplied to ap_parse_batch().
+typedef void (*ap_batch_callback_t)(ArgParser* parser, size_t record,
+    void* context);
+
+// A resolver is called while parsing when a flag or option name isn't
+// recognised. It receives the parser, the name without its leading dashes,
+// and the context pointer supplied to ap_set_resolver(). It can register the
+// name, e.g. by loading the plugin which owns it, before parsing continues.
+typedef void (*ap_resolver_t)(ArgParser* parser, const char* name,
+    void* context);
+
 // -----------------------------------------------------------------------------
 // Initialization, parsing, teardown.
 // -----------------------------------------------------------------------------
@@ -58,9 +164,51 @@ char* ap_get_version(ArgParser* parser);
 //   allocated.
 bool ap_parse(ArgParser* parser, int argc, char** argv);
 
+// Parses a complete command line supplied as a single string, e.g. a line
+// read by a REPL. The string is split into arguments in place using POSIX
+// shell quoting rules (whitespace, single quotes, double quotes, and
+// backslash escapes) so it must be writable and must remain valid while
+// the results are in use. Unlike ap_parse(), the first argument is not
+// treated as the binary name. An unterminated quote is an error. Returns
+// false if parsing stopped because of an error or sufficient memory could
+// not be allocated.
+bool ap_parse_string(ArgParser* parser, char* line);
+
+// Parses an array of [count] length-delimited arguments, e.g. arguments
+// pointing into a network receive buffer. Unlike ap_parse(), the first
+// argument is not treated as the binary name. The rest of the library works
+// with NUL-terminated strings, so the arguments are copied into a single
+// buffer owned by the parser and the source memory can be released as soon as
+// this function returns. String values and positional arguments point into
+// this buffer and remain valid until the parser is reset or freed. The buffer
+// is reused by the next call, so ap_reset() must be called before calling
+// this function again on the same parser; otherwise the call is reported as a
+// parse error, i.e. it exits with an error message or, if exit-on-error is
+// disabled, returns false with the message available from ap_get_error().
+// Returns false if parsing stopped because of an error or sufficient memory
+// could not be allocated.
+bool ap_parse_spans(ArgParser* parser, const ApSpan* args, size_t count);
+
+// Clears the results of a previous call to ap_parse() so the parser can be
+// reused to parse a new set of arguments. The registered flags, options,
+// commands, and settings are preserved. Resets any command parsers
+// recursively. The error state is cleared too, even if [parser] is a command
+// parser, as is a memory error reported while parsing. A memory error
+// reported while registering flags, options, or commands isn't cleared as the
+// parser may be incomplete.
+void ap_reset(ArgParser* parser);
+
 // Frees the memory associated with the parser and any subparsers.
 void ap_free(ArgParser* parser);
 
+// Compacts a parsed parser and any subparsers into a read-only layout. Each
+// parser's options, their values, and its option names are moved into a single
+// contiguous block of memory with each option's values stored immediately
+// after it. A frozen parser can't be parsed, reset, or modified, but any
+// number of threads can safely query it concurrently. Returns false if memory
+// allocation fails.
+bool ap_freeze(ArgParser* parser);
+
 // -----------------------------------------------------------------------------
 // Parsing modes.
 // -----------------------------------------------------------------------------
@@ -72,6 +220,66 @@ void ap_first_pos_arg_ends_option_parsing(ArgParser* parser);
 // If set, all arguments will be treated as positionals.
 void ap_all_args_as_pos_args(ArgParser* parser);
 
+// If enabled, long-form flag and option names and command names can be
+// abbreviated to any unique prefix, e.g. --verb for --verbose. Exits with an
+// error message listing the candidates if an abbreviation is ambiguous.
+// Defaults to false.
+void ap_enable_abbreviations(ArgParser* parser, bool enable);
+
+// Binds the parser's flags and options to environment variables named with
+// [prefix], e.g. with the prefix "MYTOOL_" the option --thread-count can be
+// set by MYTOOL_THREAD_COUNT. Names are matched ignoring case, with dashes and
+// underscores equivalent, so --dry_run and --logLevel can be set by
+// MYTOOL_DRY_RUN and MYTOOL_LOGLEVEL. Variables are only used for flags and
+// options that weren't found on the command line. Values are converted
+// exactly as if they had been found on the command line, and error messages
+// begin with the variable's name; flags accept 1/true/yes/on and
+// 0/false/no/off. String values point into the environment so it shouldn't
+// be modified while the results are in use. Applies to this parser only, not
+// to its command parsers. Passing NULL removes the binding.
+void ap_bind_env_prefix(ArgParser* parser, const char* prefix);
+
+// Loads a config file of 'key = value' lines supplying values for the
+// parser's flags and options. Config values are only used for flags and
+// options that weren't found on the command line or in the environment. Keys
+// are long-form option names; blank lines and lines beginning with '#' or ';'
+// are ignored; surrounding whitespace and double quotes are stripped from
+// values. An option listed more than once receives every value. The file is
+// read into a single buffer owned by the parser and string values point into
+// it. Loading a new file replaces the previous one. Returns false if the file
+// cannot be read, is invalid, or memory allocation fails, in which case any
+// previously loaded file is kept. Errors never exit, whatever the parser's
+// exit-on-error setting; ap_get_error() returns a message naming the file and
+// line, e.g. for an unrecognised key, until the next parse.
+bool ap_load_config(ArgParser* parser, const char* path);
+
+// Re-reads the config file loaded by ap_load_config() after a parse and applies
+// the changes to the flags and options that didn't come from the command line
+// or the environment. [callback], if not NULL, is called for each flag or
+// option whose values changed. The new values are built aside and swapped in
+// together once the parser's constraints have been checked against them. If the
+// new file is invalid or breaks a constraint, an error is reported like an
+// invalid argument and every value is left unchanged, and no callbacks are
+// called. Any error from a previous reload is cleared first; disable
+// exit-on-error to keep running after an invalid file. The caller decides when
+// to reload, e.g. when a file watcher reports a change. Returns false if the
+// file cannot be read, is invalid, or memory allocation fails.
+bool ap_reload_config(ArgParser* parser, ap_reload_callback_t callback,
+    void* context);
+
+// Returns where the specified flag or option's value came from.
+ApSource ap_get_source(ArgParser* parser, const char* name);
+
+// If disabled, invalid arguments don't cause the program to exit. Instead,
+// parsing stops, ap_parse() returns false, and ap_get_error() returns the error
+// message. Each parse starts with a clean error state, so an error from an
+// earlier parse doesn't stop the next one. The automatic --help and --version
+// flags print their output as usual but also stop parsing without exiting;
+// ap_parse() returns false with no error message. Defaults to true. This
+// setting applies to the whole command tree and can be called on the root
+// parser or any command parser.
+void ap_enable_exit_on_error(ArgParser* parser, bool enable);
+
 // -----------------------------------------------------------------------------
 // Register flags and options.
 // -----------------------------------------------------------------------------
@@ -88,9 +296,90 @@ void ap_add_int_opt(ArgParser* parser, const char* name, int fallback);
 // Registers a new double-valued option.
 void ap_add_dbl_opt(ArgParser* parser, const char* name, double fallback);
 
+// Registers a new option whose value must be one of the [count] names in
+// [choices]. The option's value is the index of the matching name; [fallback]
+// is returned if the option isn't found. Invalid values are reported as
+// errors listing the valid choices. The names are not copied and must outlive
+// the parser.
+void ap_add_choice_opt(ArgParser* parser, const char* name,
+    const char* choices[], int count, int fallback);
+
+// Registers a new set-valued option. Each distinct value is stored once, in
+// order of first appearance, and indexed in a hash table for constant-time
+// membership queries.
+void ap_add_set_opt(ArgParser* parser, const char* name);
+
+// Registers a new key-value option, e.g. '-D name=value'. Each argument is
+// split on its first '=' without copying and indexed by key. If
+// [reject_duplicates] is true, defining the same key twice is an error;
+// otherwise the last definition wins. An argument without an '=' defines its
+// key with an empty value.
+void ap_add_kv_opt(ArgParser* parser, const char* name, bool reject_duplicates);
+
+// Registers a family of string-valued options whose long-form names match
+// [pattern], e.g. 'label-*' matches --label-env=prod. The pattern is a prefix
+// followed by a single trailing '*'. A member's value follows an '='; a member
+// given without one, e.g. --feature-x, has an empty value. The family is a
+// key-value option keyed by the part of the name matched by the '*', i.e.
+// ap_get_kv(parser, "label-*", "env") returns "prod". Registered names,
+// including inherited global options, take precedence over families; if
+// several families match, the longest prefix wins. The pattern itself isn't
+// accepted as an option name and isn't offered by abbreviations, completion,
+// suggestions, or ap_get_opt_names().
+void ap_add_str_family(ArgParser* parser, const char* pattern);
+
 // Registers a new greedy string-valued option.
 void ap_add_greedy_str_opt(ArgParser* parser, const char* name);
 
+// Makes a registered flag or option global, i.e. it's also accepted by all
+// of the parser's descendant commands. The option is registered once and
+// found through the commands' parent chain, so its values accumulate in a
+// single shared option which can be read from any parser in the tree,
+// including through a namespace. Global options are also candidates for a
+// command's abbreviations.
+void ap_set_global(ArgParser* parser, const char* name);
+
+// Registers an array of [count] flags and options in a single pass. The
+// parser's internal tables are sized once up front rather than grown
+// incrementally.
+void ap_add_options(ArgParser* parser, const ApOptionSpec specs[],
+    size_t count);
+
+// Reserves capacity in the parser's internal tables for the specified numbers
+// of flag and option names, command names, and positional arguments. These
+// are hints only -- the tables still grow as required.
+void ap_reserve(ArgParser* parser, int num_options, int num_commands,
+    int num_pos_args);
+
+// Registers a resolver which is called with any flag or option name the
+// parser doesn't recognise while parsing. If the resolver registers the name,
+// parsing continues as if it had been registered up front; otherwise the name
+// is reported as unrecognised. Registered names, global options, families,
+// and the automatic --help and --version flags are matched before the
+// resolver is called; abbreviations are matched after. The resolver is called
+// once for each unrecognised argument and applies to this parser only, not to
+// its command parsers. A frozen parser can't register names so its resolver
+// isn't called. Passing NULL removes the resolver.
+void ap_set_resolver(ArgParser* parser, ap_resolver_t resolver, void* context);
+
+// -----------------------------------------------------------------------------
+// Option constraints.
+// -----------------------------------------------------------------------------
+
+// The named flags and options must already be registered on the parser itself;
+// a global option inherited from a parent parser can't be named. Constraints
+// are checked once the parser's arguments and any environment or config values
+// have been applied. All violations are reported together in a single error.
+
+// Marks the specified flag or option as mandatory.
+void ap_set_required(ArgParser* parser, const char* name);
+
+// Registers a rule: if [name] is found, [other] must also be found.
+void ap_add_requires(ArgParser* parser, const char* name, const char* other);
+
+// Registers a rule: [name] and [other] cannot both be found.
+void ap_add_conflicts(ArgParser* parser, const char* name, const char* other);
+
 // -----------------------------------------------------------------------------
 // Inspect flags and options.
 // -----------------------------------------------------------------------------
@@ -101,7 +390,12 @@ int ap_count(ArgParser* parser, const char* name);
 // Returns true if the specified flag or option was found.
 bool ap_found(ArgParser* parser, const char* name);
 
-// Returns the value of a string option.
+// The value getters below exit with an error if the option's values aren't of
+// the requested type. Set, key-value, and choice options can be read as
+// strings and choice options as integers.
+
+// Returns the value of a string option. For a choice option, returns the name
+// of its choice.
 char* ap_get_str_value(ArgParser* parser, const char* name);
 
 // Returns the string value at the specified index.
@@ -119,6 +413,28 @@ double ap_get_dbl_value(ArgParser* parser, const char* name);
 // Returns the floating-point value at the specified index.
 double ap_get_dbl_value_at_index(ArgParser* parser, const char* name, int index);
 
+// Returns the value of a choice option, i.e. the index of its name in the
+// option's list of choices. Exits with an error if the option isn't a choice
+// option.
+int ap_get_choice(ArgParser* parser, const char* name);
+
+// Returns the choice index at the specified index. Exits with an error if the
+// option isn't a choice option.
+int ap_get_choice_at_index(ArgParser* parser, const char* name, int index);
+
+// Returns the name of a choice option's value. Returns NULL if the option
+// wasn't found and its fallback isn't a valid index.
+const char* ap_get_choice_name(ArgParser* parser, const char* name);
+
+// Returns true if [key] is one of a set option's values. Exits with an error
+// if the option isn't a set option.
+bool ap_set_contains(ArgParser* parser, const char* name, const char* key);
+
+// Returns the value defined for [key] by a key-value option, or NULL if [key]
+// wasn't defined. The value points into the parsed argument. Exits with an
+// error if the option isn't a key-value option.
+const char* ap_get_kv(ArgParser* parser, const char* name, const char* key);
+
 // Returns an option's values as a freshly-allocated array of string
 // pointers. The array's memory is not affected by calls to ap_free().
 // Returns NULL if memory allocation fails.
@@ -134,6 +450,46 @@ int* ap_get_int_values(ArgParser* parser, const char* name);
 // Returns NULL if memory allocation fails.
 double* ap_get_dbl_values(ArgParser* parser, const char* name);
 
+// Returns a pointer to an option's values without copying them and sets
+// [count] to the number of values. Returns NULL if the option has no values.
+// The array is owned by the parser and remains valid until the parser is
+// freed, reset, or used to parse again. Exits with an error if the option
+// isn't of the matching type.
+char** ap_view_str_values(ArgParser* parser, const char* name, int* count);
+int* ap_view_int_values(ArgParser* parser, const char* name, int* count);
+double* ap_view_dbl_values(ArgParser* parser, const char* name, int* count);
+char** ap_view_set_values(ArgParser* parser, const char* name, int* count);
+
+// Returns the registered flag and option names (including aliases and
+// shortcuts) in sorted order as a freshly-allocated, NULL-terminated array of
+// string pointers. The array's memory is not affected by calls to ap_free() but
+// the strings themselves are owned by the parser.
+// Returns NULL if memory allocation fails.
+char** ap_get_opt_names(ArgParser* parser);
+
+// -----------------------------------------------------------------------------
+// Option namespaces.
+// -----------------------------------------------------------------------------
+
+// Returns a handle for the options named '[prefix].*'. Namespaces can be
+// nested to any depth, e.g. 'db' contains 'db.pool'.
+ApNamespace ap_get_namespace(ArgParser* parser, const char* prefix);
+
+// Returns the full names of the options in the namespace, at any depth, in
+// sorted order as a freshly-allocated, NULL-terminated array of string
+// pointers. Global options inherited from the parser's ancestors are
+// included. The cost is proportional to the size of the namespace, not the
+// number of registered options. The array's memory is not affected by calls
+// to ap_free() but the strings themselves are owned by the parser.
+// Returns NULL if memory allocation fails.
+char** ap_get_namespace_names(ApNamespace ns);
+
+// Like ap_count(), ap_get_str_value(), etc. for the option '[prefix].[name]'.
+int ap_ns_count(ApNamespace ns, const char* name);
+char* ap_ns_get_str_value(ApNamespace ns, const char* name);
+int ap_ns_get_int_value(ApNamespace ns, const char* name);
+double ap_ns_get_dbl_value(ApNamespace ns, const char* name);
+
 // -----------------------------------------------------------------------------
 // Positional arguments.
 // -----------------------------------------------------------------------------
@@ -152,6 +508,12 @@ char* ap_get_arg_at_index(ArgParser* parser, int index);
 // calls to ap_free(). Returns NULL if memory allocation fails.
 char** ap_get_args(ArgParser* parser);
 
+// Returns a pointer to the positional arguments without copying them and sets
+// [count] to the number of arguments. Returns NULL if there are no arguments.
+// The array is owned by the parser and remains valid until the parser is
+// freed, reset, or used to parse again.
+char** ap_view_args(ArgParser* parser, int* count);
+
 // Attempts to parse and return the positional arguments as a freshly allocated
 // array of integers. Exits with an error message on failure. The memory
 // occupied by the returned array is not affected by calls to ap_free().
@@ -164,6 +526,30 @@ int* ap_get_args_as_ints(ArgParser* parser);
 // Returns NULL if memory allocation fails.
 double* ap_get_args_as_doubles(ArgParser* parser);
 
+// -----------------------------------------------------------------------------
+// Parse order.
+// -----------------------------------------------------------------------------
+
+// If enabled, the parser also records each flag, option value, and positional
+// argument in an event log so that ap_iter_in_order() can return them in the
+// order they were found. The log is kept alongside the per-option values, so
+// each value costs an extra append. Defaults to false. This setting applies to
+// the whole command tree and can be called on the root parser or any command
+// parser.
+void ap_enable_parse_order(ArgParser* parser, bool enable);
+
+// Iterates over the flags, option values, and positional arguments found on
+// the command line in the order they were found, e.g. to interleave
+// --include and --exclude patterns. Set [cursor] to zero before the first
+// call. Each call fills in [event] and advances [cursor]; returns false once
+// every event has been returned. Each value of a multivalued option is a
+// separate event; values from the environment or a config file aren't
+// included. The events of a command's arguments are held by the command's
+// parser. Values point into the argument array and remain valid until the
+// parser is freed, reset, or used to parse again. Returns false at once unless
+// parse order was enabled with ap_enable_parse_order().
+bool ap_iter_in_order(ArgParser* parser, int* cursor, ApEvent* event);
+
 // -----------------------------------------------------------------------------
 // Commands.
 // -----------------------------------------------------------------------------
@@ -199,6 +585,114 @@ void ap_enable_help_command(ArgParser* parent_parser, bool enable);
 // its parent, otherwise NULL.
 ArgParser* ap_get_parent(ArgParser* parser);
 
+// Enables chained invocations of [parent_parser]'s commands, e.g.
+// 'fetch a b + index c + report' with the separator "+". Each segment is
+// parsed by its own command parser; a command that appears more than once is
+// parsed into a copy of its parser. Callbacks are deferred until the whole
+// chain has been parsed and are then called in order. ap_get_cmd_name() and
+// ap_get_cmd_parser() return the first command in the chain and
+// ap_get_cmd_exit_code() returns the first non-zero exit code. Callers that
+// want to run independent commands concurrently can leave the callbacks unset
+// and dispatch the chained parsers themselves. Passing NULL disables chaining.
+void ap_enable_cmd_chaining(ArgParser* parent_parser, const char* separator);
+
+// Returns the number of commands found in a chained invocation.
+int ap_count_chained_cmds(ArgParser* parent_parser);
+
+// Returns the name, parser, or callback exit code of the chained command at
+// the specified index. The parser holds that segment's parse results.
+char* ap_get_chained_cmd_name(ArgParser* parent_parser, int index);
+ArgParser* ap_get_chained_cmd_parser(ArgParser* parent_parser, int index);
+int ap_get_chained_cmd_exit_code(ArgParser* parent_parser, int index);
+
+// Returns the ArgParser instance registered on [parent_parser] for the command
+// [name], or NULL if no such command has been registered.
+ArgParser* ap_lookup_cmd(ArgParser* parent_parser, const char* name);
+
+// Returns the registered command names (including aliases) in sorted order as
+// a freshly-allocated, NULL-terminated array of string pointers. The array's
+// memory is not affected by calls to ap_free() but the strings themselves are
+// owned by the parser.
+// Returns NULL if memory allocation fails.
+char** ap_get_cmd_names(ArgParser* parent_parser);
+
+// -----------------------------------------------------------------------------
+// Shell completion.
+// -----------------------------------------------------------------------------
+
+// Returns the completion candidates for the final argument in [argv] as a
+// freshly-allocated, NULL-terminated array of strings. The parameters follow
+// the same conventions as ap_parse(); the final argument is the (possibly
+// empty) word under the cursor. The array and its strings occupy a single
+// block of memory which should be freed by the caller using free(). The
+// memory is not affected by calls to ap_free().
+// Returns NULL if memory allocation fails.
+//
+// If the AP_COMPLETE environment variable is set, ap_parse() prints these
+// candidates to stdout, one per line, and exits.
+char** ap_get_completions(ArgParser* parser, int argc, char** argv);
+
+// -----------------------------------------------------------------------------
+// Serialized parse results.
+// -----------------------------------------------------------------------------
+
+// Serializes the results of a parse -- the found command path, flag counts,
+// option values, and positional arguments -- into a flat, position-independent
+// blob that can be copied, written to a file, or shared between processes.
+// Writes at most [size] bytes to [buf] and returns the number of bytes
+// required, so [buf] can be NULL to query the size. The output is only valid
+// if the return value is less than or equal to [size].
+size_t ap_serialize_result(ArgParser* parser, void* buf, size_t size);
+
+// Loads parse results serialized by ap_serialize_result() into [parser], which
+// must have the same registered flags, options, and commands as the parser
+// that produced them. Any existing results are cleared first. No arguments are
+// parsed and no callbacks are called. String values point directly into [buf]
+// so [buf] must remain valid and unmodified for as long as the results are in
+// use. Returns false if [buf] is malformed or doesn't match the parser's
+// registrations, or if memory allocation fails.
+bool ap_load_result(ArgParser* parser, const void* buf, size_t size);
+
+// -----------------------------------------------------------------------------
+// Spec snapshot files.
+// -----------------------------------------------------------------------------
+
+// Saves the parser's registered flags, options, commands, helptexts, versions,
+// and settings to a binary spec file. Callbacks are not saved. Returns false if
+// the file cannot be written or if memory allocation fails.
+bool ap_save_spec(ArgParser* parser, const char* path);
+
+// Loads a spec file saved by ap_save_spec() and returns a new ArgParser
+// instance equivalent to the original, ready for parsing. The file's contents
+// are read into a single block of memory owned by the parser; string fallback
+// values point directly into this block. Callbacks must be registered again,
+// e.g. using ap_lookup_cmd(). Returns NULL if the file cannot be read, if it
+// isn't a valid spec file, or if memory allocation fails.
+ArgParser* ap_load_spec(const char* path);
+
+// Returns a new ArgParser instance with a deep copy of the parser's registered
+// flags, options, commands, callbacks, settings, and loaded config files. Parse
+// results are not copied. The copy is independent of the original, e.g. each
+// worker thread can parse using its own copy. Returns NULL if memory allocation
+// fails.
+ArgParser* ap_clone(ArgParser* parser);
+
+// -----------------------------------------------------------------------------
+// Batch parsing.
+// -----------------------------------------------------------------------------
+
+// Parses a manifest of command lines, one record per line, reusing the parser
+// for each record. Each line is tokenized in place as for ap_parse_string() so
+// [manifest] must be writable. After each record is parsed, [callback] is
+// called with the parser; it can inspect the results or call ap_get_error()
+// to check for an error. Invalid records never exit, whatever the parser's
+// exit-on-error setting. Returns false if memory allocation fails.
+//
+// To spread a manifest across threads, use ap_parse_batch_parallel() from the
+// optional args_batch.h module.
+bool ap_parse_batch(ArgParser* parser, char* manifest,
+    ap_batch_callback_t callback, void* context);
+
 // -----------------------------------------------------------------------------
 // Utilities.
 // -----------------------------------------------------------------------------
@@ -209,6 +703,12 @@ void ap_print(ArgParser* parser);
 // Returns true if an attempt to allocate memory failed.
 bool ap_had_memory_error(ArgParser* parser);
 
+// If parsing stopped because of an invalid argument, returns the error message,
+// otherwise NULL. Only set if exit-on-error has been disabled, or if
+// ap_load_config() failed. This function can be called on the root parser or
+// any command parser.
+char* ap_get_error(ArgParser* parser);
+
 // Returns the argument supplied at index-zero to the root parser. Typically
 // this is the filepath of the binary. This function can be called on the root
 // parser or any command sub-parser.
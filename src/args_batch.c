@@ -0,0 +1,393 @@
+// Required for pthreads under --std=c99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "args.h"
+#include "args_batch.h"
+
+
+// The number of records a worker takes from its own range at a time. Larger
+// chunks mean fewer lock operations; smaller chunks mean finer-grained
+// stealing.
+#define BATCH_CHUNK 32
+
+
+/* ------------------- */
+/* Batch declarations. */
+/* ------------------- */
+
+
+// The location of a record's serialized results, or of its error message if
+// [ok] is false, in the arena of the worker that parsed it.
+typedef struct {
+    int worker;
+    bool ok;
+    size_t offset;
+    size_t size;
+} BatchRecord;
+
+
+typedef struct {
+    ApBatch* batch;
+    ArgParser* parser;
+    pthread_t thread;
+    bool started;
+
+    // The records not yet taken by any worker: [next, end). Guarded by [lock];
+    // thieves take from the back.
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+
+    // The first record of the chunk currently being parsed, and the number
+    // parsed so far.
+    size_t chunk_start;
+    size_t chunk_parsed;
+
+    // Serialized results and error messages for every record this worker has
+    // parsed.
+    char* arena;
+    size_t arena_size;
+    size_t arena_capacity;
+
+    bool failed;
+} BatchWorker;
+
+
+struct ApBatch {
+    char* manifest;
+    char** starts;
+    BatchRecord* records;
+    size_t count;
+    BatchWorker* workers;
+    int worker_count;
+};
+
+
+/* ------------- */
+/* Worker arena. */
+/* ------------- */
+
+
+// Makes room for [size] more bytes in the worker's arena. Returns false if
+// memory allocation fails.
+static bool arena_reserve(BatchWorker* worker, size_t size) {
+    if (size <= worker->arena_capacity - worker->arena_size) {
+        return true;
+    }
+
+    size_t capacity =
+        worker->arena_capacity ? worker->arena_capacity * 2 : 4096;
+    while (capacity - worker->arena_size < size) {
+        capacity *= 2;
+    }
+
+    char* arena = realloc(worker->arena, capacity);
+    if (!arena) {
+        return false;
+    }
+
+    worker->arena = arena;
+    worker->arena_capacity = capacity;
+    return true;
+}
+
+
+// Batch callback. Copies the record's results -- or its error message -- into
+// the arena.
+static void store_record(ArgParser* parser, size_t index, void* context) {
+    BatchWorker* worker = context;
+    BatchRecord* record = &worker->batch->records[worker->chunk_start + index];
+    worker->chunk_parsed = index + 1;
+
+    record->worker = (int)(worker - worker->batch->workers);
+    record->offset = worker->arena_size;
+
+    char* error = ap_get_error(parser);
+    if (error) {
+        record->ok = false;
+        record->size = strlen(error) + 1;
+        if (!arena_reserve(worker, record->size)) {
+            worker->failed = true;
+            return;
+        }
+        memcpy(worker->arena + worker->arena_size, error, record->size);
+        worker->arena_size += record->size;
+        return;
+    }
+
+    size_t available = worker->arena_capacity - worker->arena_size;
+    size_t size = ap_serialize_result(parser,
+        worker->arena + worker->arena_size, available);
+    if (size > available) {
+        if (!arena_reserve(worker, size)) {
+            worker->failed = true;
+            return;
+        }
+        ap_serialize_result(parser, worker->arena + worker->arena_size, size);
+    }
+
+    record->ok = true;
+    record->size = size;
+    worker->arena_size += size;
+}
+
+
+/* ------------------ */
+/* Work distribution. */
+/* ------------------ */
+
+
+// Takes the next chunk of records from the worker's own range. Returns false if
+// it's empty.
+static bool take_chunk(BatchWorker* worker, size_t* start, size_t* end) {
+    pthread_mutex_lock(&worker->lock);
+    bool found = worker->next < worker->end;
+    if (found) {
+        *start = worker->next;
+        *end = worker->end - worker->next > BATCH_CHUNK ?
+            worker->next + BATCH_CHUNK : worker->end;
+        worker->next = *end;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+
+// Moves half of the remaining range of the first worker with work left onto the
+// end of [thief]'s range. Returns false if every range is empty.
+static bool steal_work(BatchWorker* thief) {
+    ApBatch* batch = thief->batch;
+    int thief_index = (int)(thief - batch->workers);
+
+    for (int i = 1; i < batch->worker_count; i++) {
+        BatchWorker* victim =
+            &batch->workers[(thief_index + i) % batch->worker_count];
+
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->next;
+        size_t start = victim->end - (remaining + 1) / 2;
+        size_t end = victim->end;
+        victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (start < end) {
+            pthread_mutex_lock(&thief->lock);
+            thief->next = start;
+            thief->end = end;
+            pthread_mutex_unlock(&thief->lock);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Parses the records [start, end) as a single sub-manifest.
+static void parse_chunk(BatchWorker* worker, size_t start, size_t end) {
+    ApBatch* batch = worker->batch;
+
+    // Terminate the sub-manifest at the newline ending its last record. The
+    // newline belongs to this chunk so no other worker reads it.
+    if (end < batch->count) {
+        batch->starts[end][-1] = '\0';
+    }
+
+    worker->chunk_start = start;
+    worker->chunk_parsed = 0;
+    if (!ap_parse_batch(worker->parser, batch->starts[start], store_record,
+        worker)) {
+        worker->failed = true;
+        return;
+    }
+
+    // Trailing empty records aren't seen once the sub-manifest is terminated;
+    // parse each as a blank line.
+    while (worker->chunk_start + worker->chunk_parsed < end &&
+        !worker->failed) {
+        char blank[] = " ";
+        worker->chunk_start += worker->chunk_parsed;
+        worker->chunk_parsed = 0;
+        if (!ap_parse_batch(worker->parser, blank, store_record, worker)) {
+            worker->failed = true;
+        }
+    }
+}
+
+
+static void* run_worker(void* arg) {
+    BatchWorker* worker = arg;
+    size_t start, end;
+
+    while (!worker->failed) {
+        if (take_chunk(worker, &start, &end)) {
+            parse_chunk(worker, start, end);
+        } else if (!steal_work(worker)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* ----------------- */
+/* Public interface. */
+/* ----------------- */
+
+
+void ap_batch_free(ApBatch* batch) {
+    if (!batch) {
+        return;
+    }
+
+    for (int i = 0; i < batch->worker_count; i++) {
+        ap_free(batch->workers[i].parser);
+        pthread_mutex_destroy(&batch->workers[i].lock);
+        free(batch->workers[i].arena);
+    }
+
+    free(batch->workers);
+    free(batch->records);
+    free(batch->starts);
+    free(batch);
+}
+
+
+// Records start at the beginning of the manifest and after each newline,
+// matching ap_parse_batch(): a final newline doesn't begin an empty record.
+static bool find_record_starts(ApBatch* batch) {
+    size_t count = 0;
+    for (char* cursor = batch->manifest; *cursor != '\0'; count++) {
+        char* newline = strchr(cursor, '\n');
+        cursor = newline ? newline + 1 : cursor + strlen(cursor);
+    }
+
+    batch->count = count;
+    batch->starts = malloc(sizeof(char*) * (count + 1));
+    batch->records = calloc(count + 1, sizeof(BatchRecord));
+    if (!batch->starts || !batch->records) {
+        return false;
+    }
+
+    count = 0;
+    for (char* cursor = batch->manifest; *cursor != '\0'; count++) {
+        batch->starts[count] = cursor;
+        char* newline = strchr(cursor, '\n');
+        cursor = newline ? newline + 1 : cursor + strlen(cursor);
+    }
+
+    return true;
+}
+
+
+ApBatch* ap_parse_batch_parallel(ArgParser* parser, char* manifest,
+    int num_threads) {
+    ApBatch* batch = calloc(1, sizeof(ApBatch));
+    if (!batch) {
+        return NULL;
+    }
+
+    batch->manifest = manifest;
+    if (!find_record_starts(batch)) {
+        ap_batch_free(batch);
+        return NULL;
+    }
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if ((size_t)num_threads > batch->count) {
+        num_threads = batch->count > 0 ? (int)batch->count : 1;
+    }
+
+    batch->workers = calloc((size_t)num_threads, sizeof(BatchWorker));
+    if (!batch->workers) {
+        ap_batch_free(batch);
+        return NULL;
+    }
+
+    // Give each worker its own parser and an equal share of the records.
+    for (int i = 0; i < num_threads; i++) {
+        BatchWorker* worker = &batch->workers[i];
+        if (pthread_mutex_init(&worker->lock, NULL) != 0) {
+            ap_batch_free(batch);
+            return NULL;
+        }
+        batch->worker_count++;
+
+        worker->batch = batch;
+        worker->parser = ap_clone(parser);
+        worker->next = batch->count * (size_t)i / (size_t)num_threads;
+        worker->end = batch->count * (size_t)(i + 1) / (size_t)num_threads;
+        if (!worker->parser) {
+            ap_batch_free(batch);
+            return NULL;
+        }
+    }
+
+    // The calling thread runs the first worker. If a thread can't be started,
+    // the other workers steal its range.
+    for (int i = 1; i < num_threads; i++) {
+        BatchWorker* worker = &batch->workers[i];
+        worker->started =
+            pthread_create(&worker->thread, NULL, run_worker, worker) == 0;
+    }
+
+    run_worker(&batch->workers[0]);
+
+    bool failed = batch->workers[0].failed;
+    for (int i = 1; i < num_threads; i++) {
+        if (batch->workers[i].started) {
+            pthread_join(batch->workers[i].thread, NULL);
+        }
+        failed = failed || batch->workers[i].failed;
+    }
+
+    // The parsers are no longer needed once every record has been serialized.
+    for (int i = 0; i < num_threads; i++) {
+        ap_free(batch->workers[i].parser);
+        batch->workers[i].parser = NULL;
+    }
+
+    if (failed) {
+        ap_batch_free(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+
+size_t ap_batch_count(ApBatch* batch) {
+    return batch->count;
+}
+
+
+bool ap_batch_ok(ApBatch* batch, size_t record) {
+    return record < batch->count && batch->records[record].ok;
+}
+
+
+const char* ap_batch_get_error(ApBatch* batch, size_t record) {
+    if (record >= batch->count || batch->records[record].ok) {
+        return NULL;
+    }
+    BatchRecord* entry = &batch->records[record];
+    return batch->workers[entry->worker].arena + entry->offset;
+}
+
+
+bool ap_batch_load_result(ApBatch* batch, size_t record, ArgParser* parser) {
+    if (!ap_batch_ok(batch, record)) {
+        return false;
+    }
+    BatchRecord* entry = &batch->records[record];
+    return ap_load_result(parser,
+        batch->workers[entry->worker].arena + entry->offset, entry->size);
+}
@@ -0,0 +1,49 @@
+// -----------------------------------------------------------------------------
+// Args: parallel batch parsing of command-line manifests.
+// Requires POSIX threads.
+// -----------------------------------------------------------------------------
+
+#ifndef args_batch_h
+#define args_batch_h
+
+#include "args.h"
+
+// The results of a parallel batch parse.
+typedef struct ApBatch ApBatch;
+
+// Parses a manifest of command lines, one record per line, across
+// [num_threads] threads. Each thread parses with its own copy of the parser,
+// created using ap_clone(), so the parser itself is only read. The records are
+// split into a contiguous range per thread; a thread that runs out of work
+// steals half of the remaining range of another thread. Each record's results
+// are serialized into a buffer owned by the thread that parsed it, so parsing
+// a record allocates nothing once the buffers have grown. Lines are tokenized
+// in place as for ap_parse_string() so [manifest] must be writable. Invalid
+// records never exit, whatever the parser's exit-on-error setting. Command
+// callbacks are called on the worker threads, one of which is the calling
+// thread. Returns NULL if memory allocation fails.
+ApBatch* ap_parse_batch_parallel(ArgParser* parser, char* manifest,
+    int num_threads);
+
+// Returns the number of records in the manifest.
+size_t ap_batch_count(ApBatch* batch);
+
+// Returns true if the specified record was parsed successfully.
+bool ap_batch_ok(ApBatch* batch, size_t record);
+
+// If the specified record was invalid, returns the error message, otherwise
+// NULL. The message is owned by the batch.
+const char* ap_batch_get_error(ApBatch* batch, size_t record);
+
+// Loads the results of the specified record into [parser], which must have the
+// same registered flags, options, and commands as the parser passed to
+// ap_parse_batch_parallel(), e.g. the parser itself once the batch is
+// complete. String values point into the batch, so the batch must outlive
+// the results. Returns false if the record wasn't parsed successfully
+// or memory allocation fails.
+bool ap_batch_load_result(ApBatch* batch, size_t record, ArgParser* parser);
+
+// Frees the batch and every record's results.
+void ap_batch_free(ApBatch* batch);
+
+#endif
@@ -0,0 +1,437 @@
+// Required for fork(), sockets, and descriptor passing.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "args.h"
+#include "args_server.h"
+
+
+// POSIX requires applications to declare this themselves.
+extern char** environ;
+
+
+// A request begins with a header of four 32-bit words: this magic number, the
+// argument count, the environment count, and the size of the payload that
+// follows. The payload holds the working directory, the arguments, and the
+// environment as consecutive NUL-terminated strings. The client's standard
+// streams travel with the header as SCM_RIGHTS ancillary data. The response is
+// the command's 32-bit exit code.
+#define REQUEST_MAGIC 0x31575041 // "APW1"
+
+
+// Avoid SIGPIPE if the other end goes away; the error is reported through the
+// return value.
+#ifdef MSG_NOSIGNAL
+    #define SEND_FLAGS MSG_NOSIGNAL
+#else
+    #define SEND_FLAGS 0
+#endif
+
+
+/* ----------------- */
+/* Socket utilities. */
+/* ----------------- */
+
+
+static bool write_all(int fd, const void* buf, size_t size) {
+    const char* cursor = buf;
+    while (size > 0) {
+        ssize_t count = send(fd, cursor, size, SEND_FLAGS);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        cursor += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+
+static bool read_all(int fd, void* buf, size_t size) {
+    char* cursor = buf;
+    while (size > 0) {
+        ssize_t count = recv(fd, cursor, size, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        cursor += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+
+static bool make_socket_address(const char* path, struct sockaddr_un* addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+
+// Sends the request header together with the descriptors for the standard
+// streams.
+static bool send_header(int fd, uint32_t header[4]) {
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {header, sizeof(uint32_t) * 4};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t count;
+    do {
+        count = sendmsg(fd, &msg, SEND_FLAGS);
+    } while (count < 0 && errno == EINTR);
+
+    // The descriptors are attached to the first byte so the rest of the header
+    // can follow in ordinary writes if the send was short.
+    if (count <= 0) {
+        return false;
+    }
+    return write_all(fd, (char*)header + count,
+        sizeof(uint32_t) * 4 - (size_t)count);
+}
+
+
+// Receives the request header and the client's standard stream descriptors.
+static bool recv_header(int fd, uint32_t header[4], int fds[3]) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+
+    struct iovec iov = {header, sizeof(uint32_t) * 4};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t count;
+    do {
+        count = recvmsg(fd, &msg, 0);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        return false;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3)) {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+
+    if (!read_all(fd, (char*)header + count,
+        sizeof(uint32_t) * 4 - (size_t)count)) {
+        for (int i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    return true;
+}
+
+
+/* ------- */
+/* Server. */
+/* ------- */
+
+
+// Runs in a worker with the client's directory, environment, and streams.
+// Returns the exit code.
+static int run_request(ArgParser* parser, int argc, char** argv) {
+    if (ap_parse(parser, argc, argv)) {
+        return ap_get_cmd_exit_code(parser);
+    }
+
+    // Only reached if exit-on-error has been disabled.
+    char* error = ap_get_error(parser);
+    if (error) {
+        fprintf(stderr, "error: %s\n", error);
+        return 1;
+    }
+    return ap_had_memory_error(parser) ? 1 : 0;
+}
+
+
+// Serves a single client. Runs in a child of the server process and never
+// returns. The parse runs in a further child so the exit code can be reported
+// even if parsing or a callback calls exit().
+static void serve_client(ArgParser* parser, int conn) {
+    uint32_t header[4];
+    int fds[3];
+    if (!recv_header(conn, header, fds)) {
+        _exit(1);
+    }
+
+    uint32_t argc = header[1];
+    uint32_t envc = header[2];
+    uint32_t size = header[3];
+    char* payload = header[0] == REQUEST_MAGIC && argc <= INT_MAX ?
+        malloc((size_t)size + 1) : NULL;
+    char** strings =
+        payload ? malloc(sizeof(char*) * ((size_t)argc + envc + 3)) : NULL;
+    if (!strings || !read_all(conn, payload, size)) {
+        _exit(1);
+    }
+    payload[size] = '\0';
+
+    // Split the payload into the directory, the arguments, and the environment.
+    // Each list is NULL-terminated in place.
+    size_t expected = (size_t)argc + envc + 1;
+    size_t found = 0;
+    for (char* cursor = payload; cursor < payload + size &&
+        found < expected; found++) {
+        strings[found + (found > argc ? 1 : 0)] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    if (found != expected) {
+        _exit(1);
+    }
+    char* cwd = strings[0];
+    char** argv = strings + 1;
+    char** env = argv + argc + 1;
+    argv[argc] = NULL;
+    env[envc] = NULL;
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(conn);
+        for (int i = 0; i < 3; i++) {
+            if (dup2(fds[i], i) < 0) {
+                _exit(1);
+            }
+            close(fds[i]);
+        }
+        if (chdir(cwd) != 0) {
+            fprintf(stderr, "error: cannot change to directory '%s'\n", cwd);
+            exit(1);
+        }
+        environ = env;
+        exit(run_request(parser, (int)argc, argv));
+    }
+
+    for (int i = 0; i < 3; i++) {
+        close(fds[i]);
+    }
+
+    int status = 0;
+    int32_t code = 1;
+    if (pid > 0 && waitpid(pid, &status, 0) == pid) {
+        code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    write_all(conn, &code, sizeof(code));
+    _exit(0);
+}
+
+
+int ap_serve(ArgParser* parser, const char* path, int max_workers) {
+    struct sockaddr_un addr;
+    if (!make_socket_address(path, &addr)) {
+        return -1;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return -1;
+    }
+
+    // Replace the socket left behind by a previous server.
+    unlink(path);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        int saved_errno = errno;
+        close(listener);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (max_workers < 1) {
+        max_workers = 1;
+    }
+    int active = 0;
+
+    while (true) {
+        // Reap finished workers. At capacity, wait for a worker to finish
+        // before accepting.
+        while (active > 0 &&
+            waitpid(-1, NULL, active >= max_workers ? 0 : WNOHANG) > 0) {
+            active--;
+        }
+
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            serve_client(parser, conn);
+        }
+        close(conn);
+        if (pid > 0) {
+            active++;
+        }
+    }
+
+    int saved_errno = errno;
+    close(listener);
+    errno = saved_errno;
+    return -1;
+}
+
+
+/* ------- */
+/* Client. */
+/* ------- */
+
+
+// Returns the working directory in a freshly-allocated string, or NULL on
+// failure.
+static char* get_cwd(void) {
+    size_t size = 256;
+    while (true) {
+        char* buf = malloc(size);
+        if (!buf) {
+            return NULL;
+        }
+        if (getcwd(buf, size)) {
+            return buf;
+        }
+        free(buf);
+        if (errno != ERANGE) {
+            return NULL;
+        }
+        size *= 2;
+    }
+}
+
+
+// Packs the directory, arguments, and environment into a single payload.
+// Returns NULL on failure.
+static char* build_payload(const char* cwd, int argc, char** argv, size_t envc,
+    size_t* size) {
+    size_t total = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        total += strlen(argv[i]) + 1;
+    }
+    for (size_t i = 0; i < envc; i++) {
+        total += strlen(environ[i]) + 1;
+    }
+    if (total > UINT32_MAX) {
+        return NULL;
+    }
+
+    char* payload = malloc(total);
+    if (!payload) {
+        return NULL;
+    }
+
+    char* cursor = payload;
+    size_t length = strlen(cwd) + 1;
+    memcpy(cursor, cwd, length);
+    cursor += length;
+    for (int i = 0; i < argc; i++) {
+        length = strlen(argv[i]) + 1;
+        memcpy(cursor, argv[i], length);
+        cursor += length;
+    }
+    for (size_t i = 0; i < envc; i++) {
+        length = strlen(environ[i]) + 1;
+        memcpy(cursor, environ[i], length);
+        cursor += length;
+    }
+
+    *size = total;
+    return payload;
+}
+
+
+int ap_run_client(const char* path, int argc, char** argv) {
+    struct sockaddr_un addr;
+    if (argc < 0 || !make_socket_address(path, &addr)) {
+        return -1;
+    }
+
+    size_t envc = 0;
+    while (environ[envc]) {
+        envc++;
+    }
+
+    char* cwd = get_cwd();
+    size_t size = 0;
+    char* payload = cwd ? build_payload(cwd, argc, argv, envc, &size) : NULL;
+    free(cwd);
+    if (!payload || envc > UINT32_MAX) {
+        free(payload);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        free(payload);
+        return -1;
+    }
+
+    uint32_t header[4] =
+        {REQUEST_MAGIC, (uint32_t)argc, (uint32_t)envc, (uint32_t)size};
+    bool sent = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && send_header(fd, header)
+        && write_all(fd, payload, size);
+    free(payload);
+
+    int32_t code = 1;
+    if (!sent) {
+        code = -1;
+    } else if (!read_all(fd, &code, sizeof(code))) {
+        code = 1;
+    }
+
+    close(fd);
+    return code;
+}
@@ -0,0 +1,35 @@
+// -----------------------------------------------------------------------------
+// Args: warm-process client/server mode over a UNIX domain socket.
+// Requires POSIX.
+// -----------------------------------------------------------------------------
+
+#ifndef args_server_h
+#define args_server_h
+
+#include "args.h"
+
+// Serves clients connecting to the UNIX domain socket at [path], which is
+// created -- replacing any stale socket -- when the server starts. Each client
+// forwards its arguments, environment, working directory, and standard
+// streams. The server forks a worker for each client, so the parser tree is
+// built once and shared by every worker; at most [max_workers] clients are
+// served at once and further clients wait in the socket's queue. The worker
+// changes to the client's directory, adopts its environment and streams, and
+// calls ap_parse() followed by the matching command callback. Output is
+// written directly to the client's streams. The client's exit code is the
+// value of ap_get_cmd_exit_code(), 1 if the arguments are invalid, or the
+// status passed to exit() if parsing exits, e.g. after --help. Only returns
+// if the socket cannot be created or accepting a connection fails, in which
+// case it returns -1 with errno set.
+int ap_serve(ArgParser* parser, const char* path, int max_workers);
+
+// Forwards [argc] and [argv] -- the arguments passed to main() -- together
+// with the environment, working directory, and standard streams to the
+// server listening on [path] and waits for the command to finish. Returns
+// the command's exit code. Returns -1 if the request could not be delivered,
+// e.g. if no server is running, in which case the caller can parse the
+// arguments itself. Returns 1 if the connection is lost once the request has
+// been delivered.
+int ap_run_client(const char* path, int argc, char** argv);
+
+#endif
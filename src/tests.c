@@ -2,12 +2,22 @@
 // Unit test suite.
 // -----------------------------------------------------------------------------
 
+// Required for setenv(), unsetenv(), fork(), and the warm server and batch tests.
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "args.h"
+#include "args_server.h"
+#include "args_batch.h"
 
 // -----------------------------------------------------------------------------
 // 1. Flags.
@@ -370,6 +380,86 @@ void test_all_args_as_pos_args(void) {
     printf(".");
 }
 
+void test_bulk_registration(void) {
+    ApOptionSpec specs[] = {
+        {.kind = AP_FLAG, .name = "foo f"},
+        {.kind = AP_STR_OPT, .name = "bar b", .str_fallback = "default"},
+        {.kind = AP_INT_OPT, .name = "baz", .int_fallback = 123},
+        {.kind = AP_DBL_OPT, .name = "bam", .dbl_fallback = 1.5},
+        {.kind = AP_GREEDY_STR_OPT, .name = "greedy g"},
+    };
+    ArgParser *parser = ap_new_parser();
+    ap_reserve(parser, 16, 4, 4);
+    ap_add_options(parser, specs, sizeof(specs) / sizeof(specs[0]));
+    ap_parse(parser, 7, (char *[]){"", "-f", "--baz", "456", "-g", "abc", "def"});
+    assert(ap_found(parser, "foo") == true);
+    assert(strcmp(ap_get_str_value(parser, "b"), "default") == 0);
+    assert(ap_get_int_value(parser, "baz") == 456);
+    assert(ap_get_dbl_value(parser, "bam") == 1.5);
+    assert(ap_count(parser, "greedy") == 2);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_value_views(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_str_opt(parser, "str s", "default");
+    ap_add_int_opt(parser, "int i", 0);
+    ap_add_dbl_opt(parser, "dbl d", 0.0);
+    ap_parse(parser, 10, (char *[]){"", "-ii", "1", "2", "-d", "0.5", "abc", "-i", "3", "def"});
+    int count;
+    assert(ap_view_str_values(parser, "str", &count) == NULL);
+    assert(count == 0);
+    int *ints = ap_view_int_values(parser, "int", &count);
+    assert(count == 3);
+    assert(ints[0] == 1 && ints[1] == 2 && ints[2] == 3);
+    double *dbls = ap_view_dbl_values(parser, "d", &count);
+    assert(count == 1);
+    assert(dbls[0] == 0.5);
+    char **args = ap_view_args(parser, &count);
+    assert(count == 2);
+    assert(strcmp(args[0], "abc") == 0);
+    assert(strcmp(args[1], "def") == 0);
+    ap_freeze(parser);
+    ints = ap_view_int_values(parser, "int", &count);
+    assert(count == 3);
+    assert(ints[0] == 1 && ints[1] == 2 && ints[2] == 3);
+    assert(ap_view_dbl_values(parser, "dbl", &count)[0] == 0.5);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_typed_getters_mismatch(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_int_opt(parser, "level", 3);
+    ap_add_set_opt(parser, "tag");
+    ap_parse(parser, 5, (char *[]){"", "--level", "4", "--tag", "x"});
+    for (int i = 0; i < 4; i++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, 2);
+            if (i == 0) {
+                ap_get_dbl_value(parser, "level");
+            } else if (i == 1) {
+                ap_get_dbl_value_at_index(parser, "level", 0);
+            } else if (i == 2) {
+                ap_get_int_value(parser, "tag");
+            } else {
+                ap_get_str_value(parser, "level");
+            }
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    }
+    assert(strcmp(ap_get_str_value(parser, "tag"), "x") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
 // -----------------------------------------------------------------------------
 // 9. Greedy options.
 // -----------------------------------------------------------------------------
@@ -487,73 +577,1742 @@ void test_zeroth_root_arg_on_cmd_parser(void) {
 }
 
 // -----------------------------------------------------------------------------
-// Test runner.
+// 11. Abbreviations.
 // -----------------------------------------------------------------------------
 
-void line(void) {
-    for (int i = 0; i < 80; i++) {
-        printf("-");
+void test_abbreviated_opt(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_abbreviations(parser, true);
+    ap_add_flag(parser, "verbose verbosity");
+    ap_add_int_opt(parser, "threads", 1);
+    ap_add_str_opt(parser, "output", "default");
+    ap_parse(parser, 5, (char *[]){"", "--verb", "--thr", "4", "--out=foo"});
+    assert(ap_found(parser, "verbose") == true);
+    assert(ap_get_int_value(parser, "threads") == 4);
+    assert(strcmp(ap_get_str_value(parser, "output"), "foo") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_abbreviated_opt_exact_match(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_abbreviations(parser, true);
+    ap_add_int_opt(parser, "thread", 1);
+    ap_add_int_opt(parser, "threads", 2);
+    ap_parse(parser, 5, (char *[]){"", "--thread", "3", "--threads", "4"});
+    assert(ap_get_int_value(parser, "thread") == 3);
+    assert(ap_get_int_value(parser, "threads") == 4);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_abbreviated_cmd(void) {
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "config");
+    ap_new_cmd(parser, "build");
+    ap_enable_abbreviations(parser, true);
+    ap_enable_abbreviations(cmd_parser, true);
+    ap_add_flag(cmd_parser, "verbose");
+    ap_parse(parser, 3, (char *[]){"", "conf", "--verb"});
+    assert(ap_get_cmd_parser(parser) == cmd_parser);
+    assert(strcmp(ap_get_cmd_name(parser), "config") == 0);
+    assert(ap_found(cmd_parser, "verbose") == true);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_sorted_names(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "zeta z");
+    ap_add_flag(parser, "alpha");
+    ap_add_flag(parser, "alp");
+    ap_new_cmd(parser, "remove rm");
+    ap_new_cmd(parser, "add");
+    char **opt_names = ap_get_opt_names(parser);
+    assert(strcmp(opt_names[0], "alp") == 0);
+    assert(strcmp(opt_names[1], "alpha") == 0);
+    assert(strcmp(opt_names[2], "z") == 0);
+    assert(strcmp(opt_names[3], "zeta") == 0);
+    assert(opt_names[4] == NULL);
+    char **cmd_names = ap_get_cmd_names(parser);
+    assert(strcmp(cmd_names[0], "add") == 0);
+    assert(strcmp(cmd_names[1], "remove") == 0);
+    assert(strcmp(cmd_names[2], "rm") == 0);
+    assert(cmd_names[3] == NULL);
+    free(opt_names);
+    free(cmd_names);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 12. Shell completion.
+// -----------------------------------------------------------------------------
+
+void test_complete_opts(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_set_helptext(parser, "helptext");
+    ap_add_flag(parser, "verbose v");
+    ap_add_str_opt(parser, "version-file", "");
+    ap_add_int_opt(parser, "threads", 1);
+    char **completions = ap_get_completions(parser, 3, (char *[]){"", "abc", "--ver"});
+    assert(strcmp(completions[0], "--verbose") == 0);
+    assert(strcmp(completions[1], "--version-file") == 0);
+    assert(completions[2] == NULL);
+    free(completions);
+    completions = ap_get_completions(parser, 2, (char *[]){"", "--"});
+    assert(strcmp(completions[0], "--threads") == 0);
+    assert(strcmp(completions[3], "--help") == 0);
+    assert(completions[4] == NULL);
+    free(completions);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_complete_cmds(void) {
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "config");
+    ap_new_cmd(parser, "commit");
+    ap_new_cmd(parser, "build");
+    ap_add_flag(parser, "foo f");
+    ap_add_int_opt(parser, "bar b", 0);
+    ap_add_str_opt(cmd_parser, "output", "");
+    char **completions = ap_get_completions(parser, 5, (char *[]){"", "-f", "--bar", "123", "co"});
+    assert(strcmp(completions[0], "commit") == 0);
+    assert(strcmp(completions[1], "config") == 0);
+    assert(completions[2] == NULL);
+    free(completions);
+    completions = ap_get_completions(parser, 4, (char *[]){"", "config", "abc", "--o"});
+    assert(strcmp(completions[0], "--output") == 0);
+    assert(completions[1] == NULL);
+    free(completions);
+    completions = ap_get_completions(parser, 3, (char *[]){"", "-b", "co"});
+    assert(completions[0] == NULL);
+    free(completions);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 13. Reuse and error handling.
+// -----------------------------------------------------------------------------
+
+void test_reset(void) {
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_add_flag(parser, "foo f");
+    ap_add_int_opt(cmd_parser, "bar", 123);
+    ap_parse(parser, 6, (char *[]){"", "-f", "cmd", "abc", "--bar", "456"});
+    assert(ap_found(parser, "foo") == true);
+    assert(ap_get_int_value(cmd_parser, "bar") == 456);
+    ap_reset(parser);
+    assert(ap_found(parser, "foo") == false);
+    assert(ap_found_cmd(parser) == false);
+    assert(ap_count_args(cmd_parser) == 0);
+    assert(ap_get_int_value(cmd_parser, "bar") == 123);
+    ap_parse(parser, 3, (char *[]){"", "cmd", "def"});
+    assert(ap_found(parser, "foo") == false);
+    assert(ap_get_cmd_parser(parser) == cmd_parser);
+    assert(ap_count_args(cmd_parser) == 1);
+    assert(strcmp(ap_get_arg_at_index(cmd_parser, 0), "def") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_no_exit_on_error(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_int_opt(parser, "foo f", 123);
+    assert(ap_parse(parser, 3, (char *[]){"", "--foo", "abc"}) == false);
+    assert(strcmp(ap_get_error(parser), "cannot parse 'abc' as an integer") == 0);
+    ap_reset(parser);
+    assert(ap_get_error(parser) == NULL);
+    assert(ap_parse(parser, 3, (char *[]){"", "--bar", "--foo"}) == false);
+    assert(strcmp(ap_get_error(parser), "--bar is not a recognised flag or option name") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 3, (char *[]){"", "-f", "456"}) == true);
+    assert(ap_get_int_value(parser, "foo") == 456);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_error_state_cleared(void) {
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_enable_exit_on_error(parser, false);
+    ap_add_int_opt(cmd_parser, "foo", 0);
+    assert(ap_parse(parser, 4, (char *[]){"", "cmd", "--foo", "abc"}) == false);
+    assert(ap_parse(parser, 4, (char *[]){"", "cmd", "--foo", "1"}) == true);
+    assert(ap_get_error(parser) == NULL);
+    assert(ap_parse(parser, 4, (char *[]){"", "cmd", "--foo", "abc"}) == false);
+    ap_reset(cmd_parser);
+    assert(ap_get_error(parser) == NULL);
+    assert(ap_parse(parser, 4, (char *[]){"", "cmd", "--foo", "2"}) == true);
+    assert(ap_get_int_value(cmd_parser, "foo") == 2);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_no_exit_on_ambiguous_abbreviation(void) {
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_enable_exit_on_error(cmd_parser, false);
+    ap_enable_abbreviations(cmd_parser, true);
+    ap_add_flag(cmd_parser, "verbose");
+    ap_add_flag(cmd_parser, "version-info");
+    assert(ap_parse(parser, 3, (char *[]){"", "cmd", "--ver"}) == false);
+    assert(strcmp(ap_get_error(cmd_parser), "--ver is ambiguous, could be: --verbose, --version-info") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 14. Serialized parse results.
+// -----------------------------------------------------------------------------
+
+ArgParser* new_result_test_parser(void) {
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_new_cmd(parser, "other");
+    ap_add_flag(parser, "foo f");
+    ap_add_str_opt(cmd_parser, "bar", "default");
+    ap_add_int_opt(cmd_parser, "baz", 0);
+    ap_add_dbl_opt(cmd_parser, "bam", 0.0);
+    return parser;
+}
+
+void test_serialize_result(void) {
+    ArgParser *parser = new_result_test_parser();
+    ap_parse(parser, 12, (char *[]){
+        "bin", "-ff", "cmd", "abc", "--bar", "x", "--baz", "1", "--baz", "2", "--bam", "1.5",
+    });
+    size_t size = ap_serialize_result(parser, NULL, 0);
+    char *buf = malloc(size);
+    assert(ap_serialize_result(parser, buf, size) == size);
+    ap_free(parser);
+
+    ArgParser *loaded = new_result_test_parser();
+    assert(ap_load_result(loaded, buf, size) == true);
+    ArgParser *cmd_parser = ap_get_cmd_parser(loaded);
+    assert(strcmp(ap_get_zeroth_root_arg(loaded), "bin") == 0);
+    assert(ap_count(loaded, "foo") == 2);
+    assert(strcmp(ap_get_cmd_name(loaded), "cmd") == 0);
+    assert(strcmp(ap_get_str_value(cmd_parser, "bar"), "x") == 0);
+    assert(ap_count(cmd_parser, "baz") == 2);
+    assert(ap_get_int_value_at_index(cmd_parser, "baz", 0) == 1);
+    assert(ap_get_int_value_at_index(cmd_parser, "baz", 1) == 2);
+    assert(ap_get_dbl_value(cmd_parser, "bam") == 1.5);
+    assert(ap_count_args(cmd_parser) == 1);
+    assert(strcmp(ap_get_arg_at_index(cmd_parser, 0), "abc") == 0);
+    ap_free(loaded);
+    free(buf);
+    printf(".");
+}
+
+void test_load_result_mismatch(void) {
+    ArgParser *parser = new_result_test_parser();
+    ap_parse(parser, 2, (char *[]){"", "-f"});
+    char buf[256];
+    size_t size = ap_serialize_result(parser, buf, sizeof(buf));
+    assert(size <= sizeof(buf));
+    ap_free(parser);
+
+    ArgParser *loaded = ap_new_parser();
+    ap_add_int_opt(loaded, "foo f", 0);
+    assert(ap_load_result(loaded, buf, size) == false);
+    assert(ap_load_result(loaded, buf, size - 1) == false);
+    assert(ap_count(loaded, "foo") == 0);
+    ap_free(loaded);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 15. Spec snapshot files.
+// -----------------------------------------------------------------------------
+
+void test_save_and_load_spec(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_set_helptext(parser, "helptext");
+    ap_add_flag(parser, "foo f");
+    ap_add_greedy_str_opt(parser, "greedy g");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd c");
+    ap_add_str_opt(cmd_parser, "bar b", "default");
+    ap_add_int_opt(cmd_parser, "baz", 123);
+    ap_add_dbl_opt(cmd_parser, "bam", 1.5);
+    assert(ap_save_spec(parser, "build/tests.spec") == true);
+    ap_free(parser);
+
+    ArgParser *loaded = ap_load_spec("build/tests.spec");
+    assert(loaded != NULL);
+    assert(strcmp(ap_get_helptext(loaded), "helptext") == 0);
+    ArgParser *loaded_cmd = ap_lookup_cmd(loaded, "c");
+    assert(loaded_cmd != NULL);
+    assert(ap_lookup_cmd(loaded, "cmd") == loaded_cmd);
+    ap_parse(loaded, 6, (char *[]){"", "-f", "c", "-b", "abc", "--baz=456"});
+    assert(ap_found(loaded, "foo") == true);
+    assert(ap_get_cmd_parser(loaded) == loaded_cmd);
+    assert(strcmp(ap_get_str_value(loaded_cmd, "bar"), "abc") == 0);
+    assert(ap_get_int_value(loaded_cmd, "baz") == 456);
+    assert(ap_get_dbl_value(loaded_cmd, "bam") == 1.5);
+    ap_reset(loaded);
+    ap_parse(loaded, 4, (char *[]){"", "-g", "-f", "c"});
+    assert(ap_found(loaded, "foo") == false);
+    assert(ap_count(loaded, "greedy") == 2);
+    assert(strcmp(ap_get_str_value(ap_lookup_cmd(loaded, "cmd"), "bar"), "default") == 0);
+    ap_free(loaded);
+    remove("build/tests.spec");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 16. Frozen parsers.
+// -----------------------------------------------------------------------------
+
+void test_freeze(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_abbreviations(parser, true);
+    ap_add_flag(parser, "foo f");
+    ap_add_str_opt(parser, "bar b", "default");
+    ap_add_int_opt(parser, "baz", 123);
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_add_dbl_opt(cmd_parser, "bam", 0.0);
+    ap_parse(parser, 10, (char *[]){"", "-ff", "--baz", "1", "--baz", "2", "cmd", "abc", "--bam", "1.5"});
+    assert(ap_freeze(parser) == true);
+    assert(ap_count(parser, "f") == 2);
+    assert(strcmp(ap_get_str_value(parser, "bar"), "default") == 0);
+    assert(ap_count(parser, "baz") == 2);
+    assert(ap_get_int_value_at_index(parser, "baz", 0) == 1);
+    assert(ap_get_int_value(parser, "baz") == 2);
+    assert(ap_get_dbl_value(cmd_parser, "bam") == 1.5);
+    assert(strcmp(ap_get_arg_at_index(cmd_parser, 0), "abc") == 0);
+    char **completions = ap_get_completions(parser, 2, (char *[]){"", "--ba"});
+    assert(strcmp(completions[0], "--bar") == 0);
+    assert(strcmp(completions[1], "--baz") == 0);
+    free(completions);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 17. Command strings.
+// -----------------------------------------------------------------------------
+
+void test_parse_string(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "foo f");
+    ap_add_str_opt(parser, "bar b", "default");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_add_int_opt(cmd_parser, "baz", 0);
+    char line[] = "  -ff --bar 'a b'\tcmd \"c \\\"d\\\" $e\" f\\ g '' --baz=12 \\\n h  ";
+    assert(ap_parse_string(parser, line) == true);
+    assert(ap_count(parser, "foo") == 2);
+    assert(strcmp(ap_get_str_value(parser, "bar"), "a b") == 0);
+    assert(strcmp(ap_get_cmd_name(parser), "cmd") == 0);
+    assert(ap_get_int_value(cmd_parser, "baz") == 12);
+    assert(ap_count_args(cmd_parser) == 4);
+    assert(strcmp(ap_get_arg_at_index(cmd_parser, 0), "c \"d\" $e") == 0);
+    assert(strcmp(ap_get_arg_at_index(cmd_parser, 1), "f g") == 0);
+    assert(strcmp(ap_get_arg_at_index(cmd_parser, 2), "") == 0);
+    assert(strcmp(ap_get_arg_at_index(cmd_parser, 3), "h") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_parse_string_unterminated_quote(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    char line[] = "abc 'def";
+    assert(ap_parse_string(parser, line) == false);
+    assert(strcmp(ap_get_error(parser), "unterminated quote in command string") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 18. Length-delimited arguments.
+// -----------------------------------------------------------------------------
+
+void test_parse_spans(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "foo f");
+    ap_add_int_opt(parser, "bar b", 0);
+    char frame[] = "--foo--bar=123-b456abc";
+    ApSpan spans[] = {{frame, 5}, {frame + 5, 9}, {frame + 14, 2}, {frame + 16, 3}, {frame + 19, 3}};
+    assert(ap_parse_spans(parser, spans, 5) == true);
+    memset(frame, 'x', sizeof(frame) - 1);
+    assert(ap_count(parser, "foo") == 1);
+    assert(ap_count(parser, "bar") == 2);
+    assert(ap_get_int_value_at_index(parser, "bar", 0) == 123);
+    assert(ap_get_int_value_at_index(parser, "bar", 1) == 456);
+    assert(ap_count_args(parser) == 1);
+    assert(strcmp(ap_get_arg_at_index(parser, 0), "abc") == 0);
+    ap_reset(parser);
+    assert(ap_parse_spans(parser, (ApSpan[]){{"-f", 2}, {"", 0}}, 2) == true);
+    assert(ap_count(parser, "foo") == 1);
+    assert(strcmp(ap_get_arg_at_index(parser, 0), "") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_parse_spans_without_reset(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_str_opt(parser, "name", "");
+    assert(ap_parse_spans(parser, (ApSpan[]){{"--name", 6}, {"abc", 3}}, 2) == true);
+    assert(ap_parse_spans(parser, (ApSpan[]){{"--name", 6}, {"def", 3}}, 2) == false);
+    assert(strcmp(ap_get_error(parser), "ap_parse_spans() requires a call to ap_reset() before the parser's next call") == 0);
+    assert(strcmp(ap_get_str_value(parser, "name"), "abc") == 0);
+    ap_reset(parser);
+    assert(ap_parse_spans(parser, (ApSpan[]){{"--name", 6}, {"def", 3}}, 2) == true);
+    assert(strcmp(ap_get_str_value(parser, "name"), "def") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 19. Cloning and batch parsing.
+// -----------------------------------------------------------------------------
+
+int batch_test_callback(char *cmd_name, ArgParser *cmd_parser) {
+    return ap_get_int_value(cmd_parser, "num");
+}
+
+void batch_test_record(ArgParser *parser, size_t record, void *context) {
+    int *results = context;
+    if (ap_get_error(parser)) {
+        results[record] = -1;
+    } else if (ap_found_cmd(parser)) {
+        results[record] = ap_get_cmd_exit_code(parser);
+    } else {
+        results[record] = ap_count(parser, "foo");
     }
-    printf("\n");
 }
 
-int main(void) {
-    setbuf(stdout, NULL);
-    line();
+void batch_count_record(ArgParser *parser, size_t record, void *context) {
+    int *results = context;
+    results[record] = ap_get_error(parser) ? -1 : ap_get_int_value(parser, "num");
+}
 
-    printf("Tests: 1 ");
-    test_flag_empty();
-    test_flag_missing();
-    test_flag_long();
-    test_flag_short();
-    test_flag_condensed();
-    test_flag_multi();
+void test_clone(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "foo f");
+    ap_add_str_opt(parser, "bar b", "default");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd c");
+    ap_add_int_opt(cmd_parser, "num n", 0);
+    ap_set_cmd_callback(cmd_parser, batch_test_callback);
+    ArgParser *clone = ap_clone(parser);
+    ap_free(parser);
+    ap_parse(clone, 7, (char *[]){"", "-f", "--bar", "abc", "c", "-n", "5"});
+    assert(ap_count(clone, "foo") == 1);
+    assert(strcmp(ap_get_str_value(clone, "b"), "abc") == 0);
+    assert(strcmp(ap_get_cmd_name(clone), "c") == 0);
+    assert(ap_get_int_value(ap_get_cmd_parser(clone), "num") == 5);
+    assert(ap_get_cmd_exit_code(clone) == 5);
+    ap_free(clone);
+    printf(".");
+}
 
-    printf(" 2 ");
-    test_str_opt_default();
-    test_str_opt_long();
-    test_str_opt_short();
-    test_str_opt_condensed();
-    test_str_opt_multi();
+void test_parse_batch(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "foo f");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_add_int_opt(cmd_parser, "num n", 0);
+    ap_set_cmd_callback(cmd_parser, batch_test_callback);
+    char manifest[] = "-ff\n--bar\ncmd --num 7\n\n-f 'abc\n--foo\n";
+    int results[6] = {0};
+    assert(ap_parse_batch(parser, manifest, batch_test_record, results) == true);
+    assert(results[0] == 2);
+    assert(results[1] == -1);
+    assert(results[2] == 7);
+    assert(results[3] == 0);
+    assert(results[4] == -1);
+    assert(results[5] == 1);
+    ap_free(parser);
+    printf(".");
+}
 
-    printf(" 3 ");
-    test_int_opt_default();
-    test_int_opt_long();
-    test_int_opt_short();
-    test_int_opt_multi();
+void test_parse_batch_cmd_errors(void) {
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_add_int_opt(cmd_parser, "num n", 0);
+    char manifest[] = "--num abc\n--num 3\n-n 4\n";
+    int results[3] = {0};
+    assert(ap_parse_batch(cmd_parser, manifest, batch_count_record, results) == true);
+    assert(results[0] == -1);
+    assert(results[1] == 3);
+    assert(results[2] == 4);
+    ap_free(parser);
+    printf(".");
+}
 
-    printf(" 4 ");
-    test_dbl_opt_default();
-    test_dbl_opt_long();
-    test_dbl_opt_short();
-    test_dbl_opt_multi();
+void test_parse_batch_parallel(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "foo f");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_add_int_opt(cmd_parser, "num n", 0);
+    ap_set_cmd_callback(cmd_parser, batch_test_callback);
 
-    printf(" 5 ");
-    test_pos_args();
-    test_pos_args_as_ints();
-    test_pos_args_as_doubles();
+    // Every fifth record is empty, including at chunk boundaries.
+    char *manifest = malloc(1000 * 16);
+    char *cursor = manifest;
+    for (int i = 0; i < 1000; i++) {
+        const char *records[] = {"-ff", "--bar", "", "-f"};
+        if (i % 5 == 0) {
+            cursor += sprintf(cursor, "cmd --num %d\n", i);
+        } else {
+            cursor += sprintf(cursor, "%s\n", records[i % 5 - 1]);
+        }
+    }
 
-    printf(" 6 ");
-    test_option_parsing_switch();
+    ApBatch *batch = ap_parse_batch_parallel(parser, manifest, 4);
+    assert(batch != NULL);
+    assert(ap_batch_count(batch) == 1000);
+    for (size_t i = 0; i < 1000; i++) {
+        if (i % 5 == 2) {
+            assert(ap_batch_ok(batch, i) == false);
+            assert(strstr(ap_batch_get_error(batch, i), "bar") != NULL);
+            assert(ap_batch_load_result(batch, i, parser) == false);
+            continue;
+        }
+        assert(ap_batch_get_error(batch, i) == NULL);
+        assert(ap_batch_load_result(batch, i, parser) == true);
+        if (i % 5 == 0) {
+            assert(ap_found_cmd(parser));
+            assert(ap_get_cmd_exit_code(parser) == (int)i);
+            assert(ap_get_int_value(cmd_parser, "num") == (int)i);
+        } else {
+            assert(!ap_found_cmd(parser));
+            assert(ap_count(parser, "foo") == (i % 5 == 1 ? 2 : i % 5 == 3 ? 0 : 1));
+        }
+    }
+    ap_batch_free(batch);
 
-    printf(" 7 ");
-    test_command();
+    batch = ap_parse_batch_parallel(parser, (char[]){""}, 4);
+    assert(batch != NULL);
+    assert(ap_batch_count(batch) == 0);
+    assert(ap_batch_ok(batch, 0) == false);
+    ap_batch_free(batch);
 
-    printf(" 8 ");
-    test_container_resizing();
-    test_first_pos_arg_ends_options();
-    test_all_args_as_pos_args();
+    free(manifest);
+    ap_free(parser);
+    printf(".");
+}
 
-    printf(" 9 ");
-    test_greedy_str_opt_long();
-    test_greedy_str_opt_short();
-    test_greedy_str_opt_long_equals();
-    test_greedy_str_opt_short_equals();
+void test_parse_batch_parallel_config(void) {
+    FILE *file = fopen("build/tests.conf", "w");
+    fputs("level = 7\nname = \"from config\"\n", file);
+    fclose(file);
+    ArgParser *parser = ap_new_parser();
+    ap_add_int_opt(parser, "level", 1);
+    ap_add_str_opt(parser, "name", "");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_add_str_opt(cmd_parser, "name", "");
+    ap_add_int_opt(cmd_parser, "level", 1);
+    assert(ap_load_config(parser, "build/tests.conf") == true);
+    assert(ap_load_config(cmd_parser, "build/tests.conf") == true);
 
-    printf(" 10 ");
-    test_zeroth_root_arg_on_root_parser_with_no_args();
-    test_zeroth_root_arg_on_root_parser_with_args();
-    test_zeroth_root_arg_on_cmd_parser();
+    char manifest[] = "--level 3\n\ncmd\ncmd --name x\n";
+    ApBatch *batch = ap_parse_batch_parallel(parser, manifest, 2);
+    assert(batch != NULL);
+    assert(ap_batch_load_result(batch, 0, parser) == true);
+    assert(ap_get_int_value(parser, "level") == 3);
+    assert(ap_batch_load_result(batch, 1, parser) == true);
+    assert(ap_get_int_value(parser, "level") == 7);
+    assert(ap_batch_load_result(batch, 2, parser) == true);
+    assert(strcmp(ap_get_str_value(cmd_parser, "name"), "from config") == 0);
+    assert(ap_get_int_value(cmd_parser, "level") == 7);
+    assert(ap_batch_load_result(batch, 3, parser) == true);
+    assert(strcmp(ap_get_str_value(cmd_parser, "name"), "x") == 0);
+    ap_batch_free(batch);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 20. Command chaining.
+// -----------------------------------------------------------------------------
+
+int chain_test_callback(char *cmd_name, ArgParser *cmd_parser) {
+    return ap_count_args(cmd_parser);
+}
+
+void test_cmd_chaining(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_cmd_chaining(parser, "+");
+    ArgParser *fetch_parser = ap_new_cmd(parser, "fetch");
+    ap_add_flag(fetch_parser, "all a");
+    ap_set_cmd_callback(fetch_parser, chain_test_callback);
+    ArgParser *report_parser = ap_new_cmd(parser, "report");
+    ap_parse(parser, 10, (char *[]){"", "fetch", "a", "b", "+", "report", "+", "fetch", "-a", "c"});
+    assert(ap_count_chained_cmds(parser) == 3);
+    assert(strcmp(ap_get_chained_cmd_name(parser, 0), "fetch") == 0);
+    assert(strcmp(ap_get_chained_cmd_name(parser, 1), "report") == 0);
+    assert(strcmp(ap_get_chained_cmd_name(parser, 2), "fetch") == 0);
+    assert(ap_get_chained_cmd_parser(parser, 0) == fetch_parser);
+    assert(ap_get_chained_cmd_parser(parser, 1) == report_parser);
+    ArgParser *second_fetch = ap_get_chained_cmd_parser(parser, 2);
+    assert(second_fetch != fetch_parser);
+    assert(ap_count(fetch_parser, "all") == 0);
+    assert(ap_count(second_fetch, "all") == 1);
+    assert(ap_get_chained_cmd_exit_code(parser, 0) == 2);
+    assert(ap_get_chained_cmd_exit_code(parser, 1) == 0);
+    assert(ap_get_chained_cmd_exit_code(parser, 2) == 1);
+    assert(ap_get_cmd_exit_code(parser) == 2);
+    assert(strcmp(ap_get_cmd_name(parser), "fetch") == 0);
+    ap_reset(parser);
+    assert(ap_count_chained_cmds(parser) == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_cmd_chaining_errors(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_enable_cmd_chaining(parser, "+");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "cmd");
+    ap_set_cmd_callback(cmd_parser, chain_test_callback);
+    assert(ap_parse(parser, 5, (char *[]){"", "cmd", "a", "+", "foo"}) == false);
+    assert(strcmp(ap_get_error(parser), "'foo' is not a recognised command") == 0);
+    assert(ap_get_chained_cmd_exit_code(parser, 0) == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 5, (char *[]){"", "cmd", "+", "cmd", "--bar"}) == false);
+    assert(strcmp(ap_get_error(parser), "--bar is not a recognised flag or option name") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 21. Suggestions.
+// -----------------------------------------------------------------------------
+
+void test_suggestions(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_flag(parser, "verbose v");
+    ap_add_int_opt(parser, "threads t", 1);
+    ap_add_str_opt(parser, "thread-name", "");
+    ap_parse(parser, 2, (char *[]){"", "--verbsoe"});
+    assert(strcmp(ap_get_error(parser), "--verbsoe is not a recognised flag or option name; did you mean --verbose?") == 0);
+    ap_reset(parser);
+    ap_parse(parser, 2, (char *[]){"", "--treads=4"});
+    assert(strcmp(ap_get_error(parser), "--treads is not a recognised option name; did you mean --threads?") == 0);
+    ap_reset(parser);
+    ap_parse(parser, 2, (char *[]){"", "--output"});
+    assert(strcmp(ap_get_error(parser), "--output is not a recognised flag or option name") == 0);
+    ap_reset(parser);
+    ap_parse(parser, 2, (char *[]){"", "--vv"});
+    assert(strcmp(ap_get_error(parser), "--vv is not a recognised flag or option name; did you mean -v?") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_suggestions_for_globals(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_set_helptext(parser, "usage");
+    ap_add_flag(parser, "verbose");
+    ap_add_str_opt(parser, "config", "");
+    ap_set_global(parser, "config");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "build");
+    ap_set_helptext(cmd_parser, "usage: build");
+    ap_add_flag(cmd_parser, "release");
+    ap_parse(parser, 3, (char *[]){"", "build", "--confg=x"});
+    assert(strcmp(ap_get_error(parser), "--confg is not a recognised option name; did you mean --config?") == 0);
+    ap_reset(parser);
+    ap_parse(parser, 3, (char *[]){"", "build", "--verbose"});
+    assert(strcmp(ap_get_error(parser), "--verbose is not a recognised flag or option name") == 0);
+    ap_reset(parser);
+    ap_parse(parser, 3, (char *[]){"", "build", "--halp"});
+    assert(strcmp(ap_get_error(parser), "--halp is not a recognised flag or option name; did you mean --help?") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_suggestions_for_cmds(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_new_cmd(parser, "build");
+    ap_new_cmd(parser, "bulid-all");
+    ap_parse(parser, 3, (char *[]){"", "help", "biuld"});
+    assert(strcmp(ap_get_error(parser), "'biuld' is not a recognised command; did you mean 'build'?") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 22. Environment variables.
+// -----------------------------------------------------------------------------
+
+void test_env_binding(void) {
+    setenv("APTEST_THREAD_COUNT", "8", 1);
+    setenv("APTEST_NAME", "from-env", 1);
+    setenv("APTEST_VERBOSE", "yes", 1);
+    setenv("APTEST_QUIET", "0", 1);
+    setenv("APTEST_T", "99", 1);
+    ArgParser *parser = ap_new_parser();
+    ap_bind_env_prefix(parser, "APTEST_");
+    ap_add_int_opt(parser, "thread-count t", 1);
+    ap_add_str_opt(parser, "name", "default");
+    ap_add_flag(parser, "verbose");
+    ap_add_flag(parser, "quiet");
+    ap_parse(parser, 3, (char *[]){"", "--name", "from-argv"});
+    assert(ap_get_int_value(parser, "thread-count") == 8);
+    assert(strcmp(ap_get_str_value(parser, "name"), "from-argv") == 0);
+    assert(ap_count(parser, "name") == 1);
+    assert(ap_found(parser, "verbose") == true);
+    assert(ap_found(parser, "quiet") == false);
+    ap_free(parser);
+    unsetenv("APTEST_THREAD_COUNT");
+    unsetenv("APTEST_NAME");
+    unsetenv("APTEST_VERBOSE");
+    unsetenv("APTEST_QUIET");
+    unsetenv("APTEST_T");
+    printf(".");
+}
+
+void test_env_binding_invalid_value(void) {
+    setenv("APTEST_THREAD_COUNT", "lots", 1);
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_bind_env_prefix(parser, "APTEST_");
+    ap_add_int_opt(parser, "thread-count", 1);
+    assert(ap_parse(parser, 1, (char *[]){""}) == false);
+    assert(strcmp(ap_get_error(parser), "APTEST_THREAD_COUNT: cannot parse 'lots' as an integer") == 0);
+    ap_free(parser);
+    unsetenv("APTEST_THREAD_COUNT");
+    setenv("APTEST_VERBOSE", "maybe", 1);
+    parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_bind_env_prefix(parser, "APTEST_");
+    ap_add_flag(parser, "verbose");
+    assert(ap_parse(parser, 1, (char *[]){""}) == false);
+    assert(strcmp(ap_get_error(parser), "APTEST_VERBOSE: invalid value 'maybe' for flag") == 0);
+    ap_free(parser);
+    unsetenv("APTEST_VERBOSE");
+    printf(".");
+}
+
+void test_env_binding_name_matching(void) {
+    setenv("APTEST_DRY_RUN", "yes", 1);
+    setenv("APTEST_LOGLEVEL", "3", 1);
+    setenv("APTEST_out_dir", "build", 1);
+    ArgParser *parser = ap_new_parser();
+    ap_bind_env_prefix(parser, "APTEST_");
+    ap_add_flag(parser, "dry_run");
+    ap_add_int_opt(parser, "logLevel", 1);
+    ap_add_str_opt(parser, "out-dir", "");
+    ap_parse(parser, 1, (char *[]){""});
+    assert(ap_found(parser, "dry_run") == true);
+    assert(ap_get_int_value(parser, "logLevel") == 3);
+    assert(strcmp(ap_get_str_value(parser, "out-dir"), "build") == 0);
+    ap_free(parser);
+    unsetenv("APTEST_DRY_RUN");
+    unsetenv("APTEST_LOGLEVEL");
+    unsetenv("APTEST_out_dir");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 23. Config files.
+// -----------------------------------------------------------------------------
+
+void test_load_config(void) {
+    FILE *file = fopen("build/tests.conf", "w");
+    fputs("# Defaults.\n\nthreads = 4\nname = \" from config \"\r\nverbose = on\nlevel=1\n  tag = a\ntag = b\n", file);
+    fclose(file);
+    setenv("APTEST_LEVEL", "2", 1);
+    ArgParser *parser = ap_new_parser();
+    ap_bind_env_prefix(parser, "APTEST_");
+    ap_add_int_opt(parser, "threads t", 1);
+    ap_add_str_opt(parser, "name", "default");
+    ap_add_flag(parser, "verbose");
+    ap_add_int_opt(parser, "level", 0);
+    ap_add_str_opt(parser, "tag", "");
+    ap_add_str_opt(parser, "unset", "fallback");
+    assert(ap_load_config(parser, "build/tests.conf") == true);
+    ap_parse(parser, 4, (char *[]){"", "abc", "-t", "8"});
+    assert(ap_get_int_value(parser, "threads") == 8);
+    assert(strcmp(ap_get_str_value(parser, "name"), " from config ") == 0);
+    assert(ap_found(parser, "verbose") == true);
+    assert(ap_get_int_value(parser, "level") == 2);
+    assert(ap_count(parser, "tag") == 2);
+    assert(strcmp(ap_get_str_value(parser, "tag"), "b") == 0);
+    ApSource source = ap_get_source(parser, "threads");
+    assert(source.kind == AP_SOURCE_ARGV && source.index == 2);
+    source = ap_get_source(parser, "name");
+    assert(source.kind == AP_SOURCE_CONFIG && source.index == 4);
+    assert(strcmp(source.name, "build/tests.conf") == 0);
+    source = ap_get_source(parser, "tag");
+    assert(source.kind == AP_SOURCE_CONFIG && source.index == 8);
+    source = ap_get_source(parser, "level");
+    assert(source.kind == AP_SOURCE_ENV);
+    assert(strncmp(source.name, "APTEST_LEVEL", source.name_len) == 0 && source.name_len == 12);
+    source = ap_get_source(parser, "unset");
+    assert(source.kind == AP_SOURCE_FALLBACK && source.name == NULL && source.index == -1);
+    ap_free(parser);
+    unsetenv("APTEST_LEVEL");
+    remove("build/tests.conf");
+    printf(".");
+}
+
+void test_load_config_unknown_key(void) {
+    FILE *file = fopen("build/tests.conf", "w");
+    fputs("threads = 4\nthraeds = 5\n", file);
+    fclose(file);
+    ArgParser *parser = ap_new_parser();
+    ap_add_int_opt(parser, "threads", 1);
+    assert(ap_load_config(parser, "build/tests.conf") == false);
+    assert(strcmp(ap_get_error(parser), "build/tests.conf:2: 'thraeds' is not a recognised option name; did you mean 'threads'?") == 0);
+    assert(ap_load_config(parser, "build/missing.conf") == false);
+    assert(strcmp(ap_get_error(parser), "cannot read config file 'build/missing.conf'") == 0);
+    assert(ap_parse(parser, 3, (char *[]){"", "--threads", "2"}) == true);
+    assert(ap_get_error(parser) == NULL);
+    assert(ap_get_int_value(parser, "threads") == 2);
+    ap_free(parser);
+    remove("build/tests.conf");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 24. Config reloading.
+// -----------------------------------------------------------------------------
+
+void write_test_config(const char *content) {
+    FILE *file = fopen("build/tests.conf", "w");
+    fputs(content, file);
+    fclose(file);
+}
+
+void reload_test_callback(ArgParser *parser, const ApChange *change, void *context) {
+    int *changes = context;
+    if (strcmp(change->name, "threads") == 0) {
+        assert(change->old_count == 1 && ((int *)change->old_values)[0] == 4);
+        assert(change->new_count == 1 && ((int *)change->new_values)[0] == 6);
+        changes[0]++;
+    } else if (strcmp(change->name, "name") == 0) {
+        assert(change->old_count == 0);
+        assert(change->new_count == 1 && strcmp(((char **)change->new_values)[0], "new") == 0);
+        changes[1]++;
+    } else if (strcmp(change->name, "verbose") == 0) {
+        assert(change->old_count == 1 && change->new_count == 0);
+        changes[2]++;
+    } else {
+        changes[3]++;
+    }
+}
+
+void test_reload_config(void) {
+    write_test_config("threads = 4\nlevel = 1\nverbose = yes\ncolor = red\n");
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_int_opt(parser, "threads t", 1);
+    ap_add_int_opt(parser, "level", 0);
+    ap_add_str_opt(parser, "name", "default");
+    ap_add_flag(parser, "verbose");
+    ap_add_str_opt(parser, "color", "none");
+    assert(ap_load_config(parser, "build/tests.conf") == true);
+    ap_parse(parser, 3, (char *[]){"", "--color", "blue"});
+    write_test_config("threads = 6\nlevel = 1\nname = new\ncolor = green\n");
+    int changes[4] = {0};
+    assert(ap_reload_config(parser, reload_test_callback, changes) == true);
+    assert(changes[0] == 1 && changes[1] == 1 && changes[2] == 1 && changes[3] == 0);
+    assert(ap_get_int_value(parser, "threads") == 6);
+    assert(ap_get_int_value(parser, "level") == 1);
+    assert(strcmp(ap_get_str_value(parser, "name"), "new") == 0);
+    assert(ap_found(parser, "verbose") == false);
+    assert(strcmp(ap_get_str_value(parser, "color"), "blue") == 0);
+    write_test_config("threads = many\nname = newer\n");
+    assert(ap_reload_config(parser, reload_test_callback, changes) == false);
+    assert(strcmp(ap_get_error(parser), "cannot parse 'many' as an integer") == 0);
+    assert(ap_get_int_value(parser, "threads") == 6);
+    assert(strcmp(ap_get_str_value(parser, "name"), "new") == 0);
+    assert(ap_get_source(parser, "name").index == 3);
+    ap_free(parser);
+    remove("build/tests.conf");
+    printf(".");
+}
+
+void count_reload_changes(ArgParser *parser, const ApChange *change, void *context) {
+    (*(int *)context)++;
+}
+
+void test_reload_config_constraints(void) {
+    write_test_config("tag = a\nmode = fast\n");
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_flag(parser, "dry-run");
+    ap_add_flag(parser, "force");
+    ap_add_str_opt(parser, "mode", "safe");
+    ap_add_set_opt(parser, "tag");
+    ap_add_conflicts(parser, "dry-run", "force");
+    assert(ap_load_config(parser, "build/tests.conf") == true);
+    ap_parse(parser, 2, (char *[]){"", "--dry-run"});
+    write_test_config("tag = b\nmode = slow\nforce = yes\n");
+    int changes = 0;
+    assert(ap_reload_config(parser, count_reload_changes, &changes) == false);
+    assert(strstr(ap_get_error(parser), "conflicts with") != NULL);
+    assert(changes == 0);
+    assert(strcmp(ap_get_str_value(parser, "mode"), "fast") == 0);
+    assert(ap_found(parser, "force") == false);
+    assert(ap_set_contains(parser, "tag", "a") == true);
+    assert(ap_set_contains(parser, "tag", "b") == false);
+    write_test_config("tag = b\nmode = fast\nforce = no\n");
+    assert(ap_reload_config(parser, count_reload_changes, &changes) == true);
+    assert(changes == 1);
+    assert(ap_set_contains(parser, "tag", "a") == false);
+    assert(ap_set_contains(parser, "tag", "b") == true);
+    ap_free(parser);
+    remove("build/tests.conf");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 25. Choice options.
+// -----------------------------------------------------------------------------
+
+void test_choice_opt(void) {
+    const char *modes[] = {"fast", "safe", "paranoid"};
+    ArgParser *parser = ap_new_parser();
+    ap_add_choice_opt(parser, "mode m", modes, 3, 1);
+    ap_parse(parser, 1, (char *[]){""});
+    assert(ap_get_choice(parser, "mode") == 1);
+    assert(strcmp(ap_get_choice_name(parser, "mode"), "safe") == 0);
+    ap_parse(parser, 5, (char *[]){"", "--mode", "paranoid", "-m", "fast"});
+    assert(ap_count(parser, "mode") == 2);
+    assert(ap_get_choice_at_index(parser, "mode", 0) == 2);
+    assert(ap_get_choice(parser, "mode") == 0);
+    assert(strcmp(ap_get_choice_name(parser, "mode"), "fast") == 0);
+    char **completions = ap_get_completions(parser, 3, (char *[]){"", "--mode", "pa"});
+    assert(strcmp(completions[0], "paranoid") == 0);
+    assert(completions[1] == NULL);
+    free(completions);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_choice_opt_str_getters(void) {
+    const char *modes[] = {"fast", "safe", "paranoid"};
+    ArgParser *parser = ap_new_parser();
+    ap_add_choice_opt(parser, "mode m", modes, 3, -1);
+    ap_parse(parser, 1, (char *[]){""});
+    assert(ap_get_str_value(parser, "mode") == NULL);
+    ap_parse(parser, 5, (char *[]){"", "--mode", "paranoid", "-m", "fast"});
+    assert(strcmp(ap_get_str_value(parser, "mode"), "fast") == 0);
+    assert(strcmp(ap_get_str_value_at_index(parser, "mode", 0), "paranoid") == 0);
+    char **values = ap_get_str_values(parser, "mode");
+    assert(strcmp(values[0], "paranoid") == 0);
+    assert(strcmp(values[1], "fast") == 0);
+    free(values);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_choice_opt_many(void) {
+    static char names[64][8];
+    const char *choices[64];
+    for (int i = 0; i < 64; i++) {
+        sprintf(names[i], "codec%d", i);
+        choices[i] = names[i];
+    }
+    ArgParser *parser = ap_new_parser();
+    ap_add_choice_opt(parser, "codec", choices, 64, -1);
+    ap_parse(parser, 1, (char *[]){""});
+    assert(ap_get_choice(parser, "codec") == -1);
+    assert(ap_get_choice_name(parser, "codec") == NULL);
+    for (int i = 0; i < 64; i++) {
+        ap_parse(parser, 3, (char *[]){"", "--codec", names[i]});
+        assert(ap_get_choice(parser, "codec") == i);
+    }
+    ap_free(parser);
+    printf(".");
+}
+
+void test_choice_opt_spec_and_freeze(void) {
+    const char *modes[] = {"fast", "safe", "paranoid"};
+    ArgParser *parser = ap_new_parser();
+    ap_add_choice_opt(parser, "mode", modes, 3, 0);
+    assert(ap_save_spec(parser, "build/tests.spec") == true);
+    ap_free(parser);
+    ArgParser *loaded = ap_load_spec("build/tests.spec");
+    assert(loaded != NULL);
+    ap_parse(loaded, 3, (char *[]){"", "--mode", "safe"});
+    assert(ap_freeze(loaded) == true);
+    assert(ap_get_choice(loaded, "mode") == 1);
+    assert(strcmp(ap_get_choice_name(loaded, "mode"), "safe") == 0);
+    ap_free(loaded);
+    remove("build/tests.spec");
+    printf(".");
+}
+
+void test_choice_opt_spec_duplicate_names(void) {
+    const char *modes[] = {"fast", "safe"};
+    ArgParser *parser = ap_new_parser();
+    ap_add_choice_opt(parser, "mode", modes, 2, 0);
+    assert(ap_save_spec(parser, "build/tests.spec") == true);
+    ap_free(parser);
+    FILE *file = fopen("build/tests.spec", "rb");
+    char buf[4096];
+    size_t size = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+    for (size_t i = 0; i + 4 <= size; i++) {
+        if (memcmp(buf + i, "safe", 4) == 0) {
+            memcpy(buf + i, "fast", 4);
+        }
+    }
+    file = fopen("build/tests.spec", "wb");
+    fwrite(buf, 1, size, file);
+    fclose(file);
+    assert(ap_load_spec("build/tests.spec") == NULL);
+    remove("build/tests.spec");
+    printf(".");
+}
+
+void test_choice_opt_invalid(void) {
+    const char *modes[] = {"fast", "safe", "paranoid"};
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_choice_opt(parser, "mode", modes, 3, 0);
+    assert(ap_parse(parser, 3, (char *[]){"", "--mode", "slow"}) == false);
+    assert(strcmp(ap_get_error(parser), "'slow' is not a valid choice; expected one of: fast, safe, paranoid") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 26. Option constraints.
+// -----------------------------------------------------------------------------
+
+void test_constraints(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_str_opt(parser, "tls-cert", "");
+    ap_add_str_opt(parser, "tls-key", "");
+    ap_add_flag(parser, "dry-run n");
+    ap_add_flag(parser, "force f");
+    ap_add_str_opt(parser, "output o", "");
+    ap_set_required(parser, "output");
+    ap_add_requires(parser, "tls-cert", "tls-key");
+    ap_add_conflicts(parser, "dry-run", "force");
+    assert(ap_parse(parser, 3, (char *[]){"", "-o", "out"}) == true);
+    ap_reset(parser);
+    assert(ap_parse(parser, 5, (char *[]){"", "--tls-cert", "a", "--tls-key", "b"}) == false);
+    assert(strcmp(ap_get_error(parser), "--output is required") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 6, (char *[]){"", "-nf", "--tls-cert", "a", "-o", "out"}) == false);
+    assert(strcmp(ap_get_error(parser), "--tls-cert requires --tls-key; --dry-run conflicts with --force") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_constraints_many_options(void) {
+    static char names[200][8];
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    for (int i = 0; i < 200; i++) {
+        sprintf(names[i], "opt%d", i);
+        ap_add_flag(parser, names[i]);
+    }
+    ap_add_requires(parser, "opt3", "opt150");
+    ap_add_requires(parser, "opt3", "opt199");
+    ap_add_conflicts(parser, "opt70", "opt130");
+    ap_set_required(parser, "opt64");
+    assert(ap_parse(parser, 4, (char *[]){"", "--opt3", "--opt150", "--opt64"}) == false);
+    assert(strcmp(ap_get_error(parser), "--opt3 requires --opt199") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 5, (char *[]){"", "--opt70", "--opt130", "--opt64", "--opt150"}) == false);
+    assert(strcmp(ap_get_error(parser), "--opt70 conflicts with --opt130") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 3, (char *[]){"", "--opt64", "--opt130"}) == true);
+    ArgParser *clone = ap_clone(parser);
+    assert(ap_parse(clone, 1, (char *[]){""}) == false);
+    assert(strcmp(ap_get_error(clone), "--opt64 is required") == 0);
+    ap_free(clone);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 27. Set options.
+// -----------------------------------------------------------------------------
+
+void test_set_opt(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_set_opt(parser, "feature f");
+    ap_parse(parser, 9, (char *[]){"", "-f", "x", "--feature", "y", "-f", "x", "--feature=z", "y"});
+    assert(ap_count(parser, "feature") == 3);
+    assert(ap_set_contains(parser, "feature", "x") == true);
+    assert(ap_set_contains(parser, "feature", "z") == true);
+    assert(ap_set_contains(parser, "feature", "w") == false);
+    int count;
+    char **values = ap_view_set_values(parser, "feature", &count);
+    assert(count == 3);
+    assert(strcmp(values[0], "x") == 0);
+    assert(strcmp(values[1], "y") == 0);
+    assert(strcmp(values[2], "z") == 0);
+    ap_reset(parser);
+    ap_parse(parser, 3, (char *[]){"", "-f", "w"});
+    assert(ap_count(parser, "feature") == 1);
+    assert(ap_set_contains(parser, "feature", "x") == false);
+    assert(ap_set_contains(parser, "feature", "w") == true);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_set_opt_many_values(void) {
+    static char names[1000][8];
+    char *argv[2001] = {""};
+    for (int i = 0; i < 1000; i++) {
+        sprintf(names[i], "v%d", i % 500);
+        argv[2 * i + 1] = "-x";
+        argv[2 * i + 2] = names[i];
+    }
+    ArgParser *parser = ap_new_parser();
+    ap_add_set_opt(parser, "exclude x");
+    ap_parse(parser, 2001, argv);
+    assert(ap_count(parser, "exclude") == 500);
+    assert(ap_set_contains(parser, "exclude", "v499") == true);
+    assert(ap_set_contains(parser, "exclude", "v500") == false);
+    size_t size = ap_serialize_result(parser, NULL, 0);
+    char *result = malloc(size);
+    assert(ap_serialize_result(parser, result, size) == size);
+    assert(ap_load_result(parser, result, size) == true);
+    assert(ap_count(parser, "exclude") == 500);
+    assert(ap_set_contains(parser, "exclude", "v123") == true);
+    ap_free(parser);
+    free(result);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 28. Key-value options.
+// -----------------------------------------------------------------------------
+
+void test_kv_opt(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_kv_opt(parser, "define D", false);
+    ap_parse(parser, 8, (char *[]){"", "-D", "name=foo", "-D", "flag", "--define=x=a=b", "-D", "name=bar"});
+    assert(ap_count(parser, "define") == 4);
+    assert(strcmp(ap_get_kv(parser, "D", "name"), "bar") == 0);
+    assert(strcmp(ap_get_kv(parser, "D", "flag"), "") == 0);
+    assert(strcmp(ap_get_kv(parser, "D", "x"), "a=b") == 0);
+    assert(ap_get_kv(parser, "D", "nam") == NULL);
+    assert(ap_get_kv(parser, "D", "missing") == NULL);
+    ap_reset(parser);
+    ap_parse(parser, 1, (char *[]){""});
+    assert(ap_get_kv(parser, "D", "name") == NULL);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_kv_opt_reject_duplicates(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_kv_opt(parser, "D", true);
+    assert(ap_parse(parser, 5, (char *[]){"", "-D", "a=1", "-D", "b=2"}) == true);
+    assert(strcmp(ap_get_kv(parser, "D", "b"), "2") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 5, (char *[]){"", "-D", "a=1", "-D", "a=2"}) == false);
+    assert(strcmp(ap_get_error(parser), "'a' is defined more than once") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 29. Global options.
+// -----------------------------------------------------------------------------
+
+void test_global_opts(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "verbose v");
+    ap_add_str_opt(parser, "log-level l", "info");
+    ap_set_global(parser, "verbose");
+    ap_set_global(parser, "log-level");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "remote");
+    ArgParser *sub_parser = ap_new_cmd(cmd_parser, "add");
+    ap_add_flag(sub_parser, "force f");
+    assert(ap_get_parent(sub_parser) == cmd_parser);
+    assert(ap_get_parent(cmd_parser) == parser);
+    ap_parse(parser, 8, (char *[]){"", "-v", "remote", "--verbose", "add", "-vf", "--log-level=debug", "x"});
+    assert(ap_count(parser, "verbose") == 3);
+    assert(ap_count(sub_parser, "verbose") == 3);
+    assert(ap_found(sub_parser, "force") == true);
+    assert(strcmp(ap_get_str_value(cmd_parser, "log-level"), "debug") == 0);
+    assert(ap_count_args(sub_parser) == 1);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_global_opts_precedence(void) {
+    setenv("APTEST_LOG_LEVEL", "warn", 1);
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_bind_env_prefix(parser, "APTEST_");
+    ap_add_str_opt(parser, "log-level", "info");
+    ap_add_str_opt(parser, "output", "");
+    ap_set_global(parser, "log-level");
+    ap_set_global(parser, "output");
+    ap_set_required(parser, "output");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "run");
+    ap_add_str_opt(cmd_parser, "output", "");
+    assert(ap_parse(parser, 2, (char *[]){"", "run"}) == false);
+    assert(strcmp(ap_get_error(parser), "--output is required") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 4, (char *[]){"", "run", "--output", "x"}) == false);
+    ap_reset(parser);
+    assert(ap_parse(parser, 6, (char *[]){"", "--output", "y", "run", "--log-level", "debug"}) == true);
+    assert(strcmp(ap_get_str_value(parser, "log-level"), "debug") == 0);
+    assert(ap_count(parser, "log-level") == 1);
+    assert(ap_get_source(parser, "log-level").kind == AP_SOURCE_ARGV);
+    ap_reset(parser);
+    assert(ap_parse(parser, 4, (char *[]){"", "--output", "y", "run"}) == true);
+    assert(strcmp(ap_get_str_value(cmd_parser, "log-level"), "warn") == 0);
+    ap_free(parser);
+    unsetenv("APTEST_LOG_LEVEL");
+    printf(".");
+}
+
+void test_global_opts_abbreviations_and_namespaces(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_flag(parser, "verbose");
+    ap_add_str_opt(parser, "db.host", "localhost");
+    ap_add_flag(parser, "quiet");
+    ap_set_global(parser, "verbose");
+    ap_set_global(parser, "db.host");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "run");
+    ap_enable_abbreviations(cmd_parser, true);
+    ap_add_flag(cmd_parser, "verify");
+    assert(ap_parse(parser, 5, (char *[]){"", "run", "--verb", "--db.h", "db1"}) == true);
+    assert(ap_found(parser, "verbose") == true);
+    assert(strcmp(ap_ns_get_str_value(ap_get_namespace(cmd_parser, "db"), "host"), "db1") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 3, (char *[]){"", "run", "--ver"}) == false);
+    assert(strcmp(ap_get_error(parser), "--ver is ambiguous, could be: --verbose, --verify") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 3, (char *[]){"", "run", "--qui"}) == false);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_global_opts_completion_and_namespaces(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "verbose v");
+    ap_add_str_opt(parser, "db.host H", "localhost");
+    ap_add_flag(parser, "quiet");
+    ap_set_global(parser, "verbose");
+    ap_set_global(parser, "db.host");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "run");
+    ap_add_flag(cmd_parser, "verify");
+    ap_add_str_opt(cmd_parser, "db.name", "");
+    char **completions = ap_get_completions(parser, 3, (char *[]){"", "run", "--ve"});
+    assert(strcmp(completions[0], "--verbose") == 0);
+    assert(strcmp(completions[1], "--verify") == 0);
+    assert(completions[2] == NULL);
+    free(completions);
+    completions = ap_get_completions(parser, 3, (char *[]){"", "run", "--"});
+    assert(strcmp(completions[0], "--db.host") == 0);
+    assert(strcmp(completions[1], "--db.name") == 0);
+    assert(strcmp(completions[2], "--verbose") == 0);
+    assert(strcmp(completions[3], "--verify") == 0);
+    assert(completions[4] == NULL);
+    free(completions);
+    completions = ap_get_completions(parser, 4, (char *[]){"", "run", "-vH", "--"});
+    assert(completions[0] == NULL);
+    free(completions);
+    char **names = ap_get_namespace_names(ap_get_namespace(cmd_parser, "db"));
+    assert(strcmp(names[0], "db.host") == 0);
+    assert(strcmp(names[1], "db.name") == 0);
+    assert(names[2] == NULL);
+    free(names);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_global_opts_constraints(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_flag(parser, "verbose");
+    ap_set_global(parser, "verbose");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "run");
+    ap_add_flag(cmd_parser, "force");
+    ap_add_flag(cmd_parser, "dry-run");
+    ap_add_conflicts(cmd_parser, "force", "dry-run");
+
+    // A constraint can't name an inherited global, as the command's tables
+    // only cover its own options.
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 2);
+        ap_add_requires(cmd_parser, "force", "verbose");
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+
+    char *argv[] = {"", "run", "--force", "--verbose", "--dry-run"};
+    assert(ap_parse(parser, 5, argv) == false);
+    assert(strcmp(ap_get_error(parser), "--force conflicts with --dry-run") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 30. Option namespaces.
+// -----------------------------------------------------------------------------
+
+void test_namespaces(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_int_opt(parser, "db.pool.size", 4);
+    ap_add_dbl_opt(parser, "db.pool.timeout", 1.5);
+    ap_add_str_opt(parser, "db.host", "localhost");
+    ap_add_int_opt(parser, "db.poolside", 0);
+    ap_add_int_opt(parser, "cache.l2.ttl", 60);
+    ap_parse(parser, 5, (char *[]){"", "--db.pool.size", "16", "--db.host", "db1"});
+    ApNamespace pool = ap_get_namespace(parser, "db.pool");
+    assert(ap_ns_get_int_value(pool, "size") == 16);
+    assert(ap_ns_count(pool, "size") == 1);
+    assert(ap_ns_get_dbl_value(pool, "timeout") == 1.5);
+    ApNamespace db = ap_get_namespace(parser, "db");
+    assert(strcmp(ap_ns_get_str_value(db, "host"), "db1") == 0);
+    assert(ap_ns_get_int_value(db, "pool.size") == 16);
+    char **names = ap_get_namespace_names(pool);
+    assert(strcmp(names[0], "db.pool.size") == 0);
+    assert(strcmp(names[1], "db.pool.timeout") == 0);
+    assert(names[2] == NULL);
+    free(names);
+    names = ap_get_namespace_names(db);
+    assert(strcmp(names[0], "db.host") == 0);
+    assert(strcmp(names[3], "db.poolside") == 0);
+    assert(names[4] == NULL);
+    free(names);
+    names = ap_get_namespace_names(ap_get_namespace(parser, "log"));
+    assert(names[0] == NULL);
+    free(names);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 31. Option families.
+// -----------------------------------------------------------------------------
+
+void test_option_families(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_str_family(parser, "label-*");
+    ap_add_str_family(parser, "label-x-*");
+    ap_add_str_family(parser, "feature-*");
+    ap_add_flag(parser, "label-all");
+    ap_parse(parser, 6, (char *[]){"", "--label-env=prod", "--feature-fast", "--label-all", "--label-x-y=1", "--label-tier=a=b"});
+    assert(strcmp(ap_get_kv(parser, "label-*", "env"), "prod") == 0);
+    assert(strcmp(ap_get_kv(parser, "label-*", "tier"), "a=b") == 0);
+    assert(ap_get_kv(parser, "label-*", "x-y") == NULL);
+    assert(strcmp(ap_get_kv(parser, "label-x-*", "y"), "1") == 0);
+    assert(strcmp(ap_get_kv(parser, "feature-*", "fast"), "") == 0);
+    assert(ap_count(parser, "label-*") == 2);
+    assert(ap_found(parser, "label-all") == true);
+    ap_reset(parser);
+    assert(ap_parse(parser, 2, (char *[]){"", "--label-"}) == false);
+    ArgParser *clone = ap_clone(parser);
+    assert(ap_parse(clone, 2, (char *[]){"", "--label-x-z=2"}) == true);
+    assert(strcmp(ap_get_kv(clone, "label-x-*", "z"), "2") == 0);
+    assert(ap_parse(clone, 3, (char *[]){"", "--label-*", "k=v"}) == false);
+    assert(strcmp(ap_get_error(clone), "--label-* is not a recognised flag or option name") == 0);
+    ap_free(clone);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_option_families_hidden(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_enable_abbreviations(parser, true);
+    ap_add_str_family(parser, "label-*");
+    ap_add_flag(parser, "verbose");
+    assert(ap_parse(parser, 3, (char *[]){"", "--lab", "q=w"}) == false);
+    assert(strcmp(ap_get_error(parser), "--lab is not a recognised flag or option name") == 0);
+    ap_reset(parser);
+    assert(ap_parse(parser, 2, (char *[]){"", "--label-*=k=v"}) == false);
+    char **names = ap_get_opt_names(parser);
+    assert(strcmp(names[0], "verbose") == 0 && names[1] == NULL);
+    free(names);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_option_families_and_globals(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_str_opt(parser, "label-env", "");
+    ap_set_global(parser, "label-env");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "run");
+    ap_add_str_family(cmd_parser, "label-*");
+    assert(ap_parse(parser, 5, (char *[]){"", "run", "--label-env", "a", "--label-env=b"}) == true);
+    assert(ap_count(parser, "label-env") == 2);
+    assert(ap_count(cmd_parser, "label-*") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 32. Option resolvers.
+// -----------------------------------------------------------------------------
+
+void resolve_plugin_opts(ArgParser* parser, const char* name, void* context) {
+    int* calls = context;
+    (*calls)++;
+    if (strncmp(name, "zip.", 4) == 0) {
+        ap_add_int_opt(parser, "zip.level", 6);
+        ap_add_flag(parser, "zip.fast z");
+    }
+}
+
+void test_option_resolver(void) {
+    int calls = 0;
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ap_add_flag(parser, "verbose");
+    ap_set_resolver(parser, resolve_plugin_opts, &calls);
+    assert(ap_parse(parser, 4, (char *[]){"", "--verbose", "--zip.level=9", "-z"}) == true);
+    assert(calls == 1);
+    assert(ap_get_int_value(parser, "zip.level") == 9);
+    assert(ap_found(parser, "zip.fast") == true);
+    ap_reset(parser);
+    assert(ap_parse(parser, 2, (char *[]){"", "--tar.level"}) == false);
+    assert(calls == 2);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_option_resolver_frozen(void) {
+    int calls = 0;
+    ArgParser *parser = ap_new_parser();
+    ap_enable_exit_on_error(parser, false);
+    ArgParser *cmd_parser = ap_new_cmd(parser, "pack");
+    ap_set_resolver(cmd_parser, resolve_plugin_opts, &calls);
+    assert(ap_freeze(cmd_parser) == true);
+    assert(ap_parse(parser, 3, (char *[]){"", "pack", "--zip.level"}) == false);
+    assert(strcmp(ap_get_error(parser), "--zip.level is not a recognised flag or option name") == 0);
+    assert(calls == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 33. Parse order.
+// -----------------------------------------------------------------------------
+
+void test_iter_in_order(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_str_opt(parser, "include i", "");
+    ap_add_str_opt(parser, "exclude", "");
+    ap_add_flag(parser, "verbose v");
+    ap_enable_parse_order(parser, true);
+    ap_parse(parser, 7, (char *[]){"", "-vi", "a*", "src", "--exclude=b*", "--include", "c*"});
+    const char* names[] = {"verbose", "include", NULL, "exclude", "include"};
+    const char* values[] = {NULL, "a*", "src", "b*", "c*"};
+    int indexes[] = {1, 2, 3, 4, 6};
+    int cursor = 0;
+    ApEvent event;
+    for (int i = 0; i < 5; i++) {
+        assert(ap_iter_in_order(parser, &cursor, &event) == true);
+        assert(names[i] ? strcmp(event.name, names[i]) == 0 : event.name == NULL);
+        assert(values[i] ? strcmp(event.value, values[i]) == 0 : event.value == NULL);
+        assert(event.argv_index == indexes[i]);
+    }
+    assert(ap_iter_in_order(parser, &cursor, &event) == false);
+    ap_reset(parser);
+    cursor = 0;
+    assert(ap_iter_in_order(parser, &cursor, &event) == false);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_iter_in_order_cmds(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_flag(parser, "debug");
+    ap_set_global(parser, "debug");
+    ArgParser *cmd_parser = ap_new_cmd(parser, "run");
+    ap_add_int_opt(cmd_parser, "jobs", 1);
+    ap_enable_parse_order(cmd_parser, true);
+    ap_parse(parser, 5, (char *[]){"", "run", "--jobs", "4", "--debug"});
+    int cursor = 0;
+    ApEvent event;
+    assert(ap_iter_in_order(parser, &cursor, &event) == false);
+    cursor = 0;
+    assert(ap_iter_in_order(cmd_parser, &cursor, &event) == true);
+    assert(strcmp(event.name, "jobs") == 0 && strcmp(event.value, "4") == 0 && event.argv_index == 3);
+    assert(ap_iter_in_order(cmd_parser, &cursor, &event) == true);
+    assert(strcmp(event.name, "debug") == 0 && event.value == NULL && event.argv_index == 4);
+    assert(ap_iter_in_order(cmd_parser, &cursor, &event) == false);
+    ap_free(parser);
+    printf(".");
+}
+
+void test_iter_in_order_disabled(void) {
+    ArgParser *parser = ap_new_parser();
+    ap_add_str_opt(parser, "include i", "");
+    ap_parse(parser, 3, (char *[]){"", "-i", "a*"});
+    int cursor = 0;
+    ApEvent event;
+    assert(ap_iter_in_order(parser, &cursor, &event) == false);
+    assert(strcmp(ap_get_str_value(parser, "include"), "a*") == 0);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 34. Warm server.
+// -----------------------------------------------------------------------------
+
+char server_test_cwd[4096];
+
+int server_test_callback(char* cmd_name, ArgParser* cmd_parser) {
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)) || strcmp(cwd, server_test_cwd) != 0) {
+        return 100;
+    }
+    return ap_get_int_value(cmd_parser, "code");
+}
+
+// Runs the client, retrying while the server starts up.
+int run_server_test_client(const char* path, int argc, char** argv) {
+    struct timespec delay = {0, 10 * 1000 * 1000};
+    for (int i = 0; i < 500; i++) {
+        int code = ap_run_client(path, argc, argv);
+        if (code != -1) {
+            return code;
+        }
+        nanosleep(&delay, NULL);
+    }
+    return -1;
+}
+
+void test_warm_server(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/args-test-%d.sock", (int)getpid());
+    assert(getcwd(server_test_cwd, sizeof(server_test_cwd)) != NULL);
+    assert(ap_run_client(path, 2, (char *[]){"", "run"}) == -1);
+
+    ArgParser *parser = ap_new_parser();
+    ArgParser *cmd_parser = ap_new_cmd(parser, "run");
+    ap_add_int_opt(cmd_parser, "code", 0);
+    ap_bind_env_prefix(cmd_parser, "APTEST_");
+    ap_set_cmd_callback(cmd_parser, server_test_callback);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        if (chdir("/") == 0) {
+            ap_serve(parser, path, 2);
+        }
+        _exit(1);
+    }
+
+    assert(run_server_test_client(path, 4, (char *[]){"", "run", "--code", "7"}) == 7);
+    setenv("APTEST_CODE", "9", 1);
+    assert(ap_run_client(path, 2, (char *[]){"", "run"}) == 9);
+    unsetenv("APTEST_CODE");
+
+    int saved_stderr = dup(2);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 2);
+    int code = ap_run_client(path, 4, (char *[]){"", "run", "--code", "abc"});
+    dup2(saved_stderr, 2);
+    close(saved_stderr);
+    close(null_fd);
+    assert(code == 1);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(path);
+    ap_free(parser);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// Test runner.
+// -----------------------------------------------------------------------------
+
+void line(void) {
+    for (int i = 0; i < 80; i++) {
+        printf("-");
+    }
+    printf("\n");
+}
+
+int main(void) {
+    setbuf(stdout, NULL);
+    line();
+
+    printf("Tests: 1 ");
+    test_flag_empty();
+    test_flag_missing();
+    test_flag_long();
+    test_flag_short();
+    test_flag_condensed();
+    test_flag_multi();
+
+    printf(" 2 ");
+    test_str_opt_default();
+    test_str_opt_long();
+    test_str_opt_short();
+    test_str_opt_condensed();
+    test_str_opt_multi();
+
+    printf(" 3 ");
+    test_int_opt_default();
+    test_int_opt_long();
+    test_int_opt_short();
+    test_int_opt_multi();
+
+    printf(" 4 ");
+    test_dbl_opt_default();
+    test_dbl_opt_long();
+    test_dbl_opt_short();
+    test_dbl_opt_multi();
+
+    printf(" 5 ");
+    test_pos_args();
+    test_pos_args_as_ints();
+    test_pos_args_as_doubles();
+
+    printf(" 6 ");
+    test_option_parsing_switch();
+
+    printf(" 7 ");
+    test_command();
+
+    printf(" 8 ");
+    test_container_resizing();
+    test_first_pos_arg_ends_options();
+    test_all_args_as_pos_args();
+    test_bulk_registration();
+    test_value_views();
+    test_typed_getters_mismatch();
+
+    printf(" 9 ");
+    test_greedy_str_opt_long();
+    test_greedy_str_opt_short();
+    test_greedy_str_opt_long_equals();
+    test_greedy_str_opt_short_equals();
+
+    printf(" 10 ");
+    test_zeroth_root_arg_on_root_parser_with_no_args();
+    test_zeroth_root_arg_on_root_parser_with_args();
+    test_zeroth_root_arg_on_cmd_parser();
+
+    printf(" 11 ");
+    test_abbreviated_opt();
+    test_abbreviated_opt_exact_match();
+    test_abbreviated_cmd();
+    test_sorted_names();
+
+    printf(" 12 ");
+    test_complete_opts();
+    test_complete_cmds();
+
+    printf(" 13 ");
+    test_reset();
+    test_no_exit_on_error();
+    test_error_state_cleared();
+    test_no_exit_on_ambiguous_abbreviation();
+
+    printf(" 14 ");
+    test_serialize_result();
+    test_load_result_mismatch();
+
+    printf(" 15 ");
+    test_save_and_load_spec();
+
+    printf(" 16 ");
+    test_freeze();
+
+    printf(" 17 ");
+    test_parse_string();
+    test_parse_string_unterminated_quote();
+
+    printf(" 18 ");
+    test_parse_spans();
+    test_parse_spans_without_reset();
+
+    printf(" 19 ");
+    test_clone();
+    test_parse_batch();
+    test_parse_batch_cmd_errors();
+    test_parse_batch_parallel();
+    test_parse_batch_parallel_config();
+
+    printf(" 20 ");
+    test_cmd_chaining();
+    test_cmd_chaining_errors();
+
+    printf(" 21 ");
+    test_suggestions();
+    test_suggestions_for_globals();
+    test_suggestions_for_cmds();
+
+    printf(" 22 ");
+    test_env_binding();
+    test_env_binding_invalid_value();
+    test_env_binding_name_matching();
+
+    printf(" 23 ");
+    test_load_config();
+    test_load_config_unknown_key();
+
+    printf(" 24 ");
+    test_reload_config();
+    test_reload_config_constraints();
+
+    printf(" 25 ");
+    test_choice_opt();
+    test_choice_opt_str_getters();
+    test_choice_opt_many();
+    test_choice_opt_spec_and_freeze();
+    test_choice_opt_spec_duplicate_names();
+    test_choice_opt_invalid();
+
+    printf(" 26 ");
+    test_constraints();
+    test_constraints_many_options();
+
+    printf(" 27 ");
+    test_set_opt();
+    test_set_opt_many_values();
+
+    printf(" 28 ");
+    test_kv_opt();
+    test_kv_opt_reject_duplicates();
+
+    printf(" 29 ");
+    test_global_opts();
+    test_global_opts_precedence();
+    test_global_opts_abbreviations_and_namespaces();
+    test_global_opts_completion_and_namespaces();
+    test_global_opts_constraints();
+
+    printf(" 30 ");
+    test_namespaces();
+
+    printf(" 31 ");
+    test_option_families();
+    test_option_families_hidden();
+    test_option_families_and_globals();
+
+    printf(" 32 ");
+    test_option_resolver();
+    test_option_resolver_frozen();
+
+    printf(" 33 ");
+    test_iter_in_order();
+    test_iter_in_order_cmds();
+    test_iter_in_order_disabled();
+
+    printf(" 34 ");
+    test_warm_server();
 
     printf(" [ok]\n");
     line();